@@ -0,0 +1,83 @@
+/*
+ * loop_test - checks for the main loop with pollers
+ *
+ * Two pollers that always have work and a pipe that's always readable:
+ * neither poller may starve the other, and they mustn't starve the pipe
+ * either, every round of polling is followed by a look at the fds.
+ *
+ * Build and run: make -C tests check
+ */
+#include <usfstl/loop.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define ROUNDS 99
+
+static int failures;
+
+#define CHECK_EQ(actual, expected)                                       \
+  do {                                                                   \
+    unsigned long long _a = (actual), _e = (expected);                  \
+    if (_a != _e) {                                                      \
+      fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__,   \
+              __LINE__, #actual, _a, _e);                                \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+static bool busy_pending(struct usfstl_loop_poller *poller) { return true; }
+
+static void busy_handle(struct usfstl_loop_poller *poller) {
+  (*(unsigned int *)poller->data)++;
+}
+
+static void pipe_handle(struct usfstl_loop_entry *entry) {
+  /* leave the data there, so it's always readable */
+  (*(unsigned int *)entry->data)++;
+}
+
+int main(void) {
+  unsigned int polled[2] = {}, readable = 0, i;
+  struct usfstl_loop_poller pollers[2] = {
+      {.pending = busy_pending, .handle = busy_handle, .data = &polled[0]},
+      {.pending = busy_pending, .handle = busy_handle, .data = &polled[1]},
+  };
+  struct usfstl_loop_entry entry = {.handler = pipe_handle, .data = &readable};
+  int fds[2];
+
+  if (pipe(fds) || write(fds[1], "", 1) != 1) {
+    perror("pipe");
+    return 1;
+  }
+  entry.fd = fds[0];
+
+  usfstl_loop_register(&entry);
+  usfstl_loop_register_poller(&pollers[0]);
+  usfstl_loop_register_poller(&pollers[1]);
+
+  for (i = 0; i < ROUNDS; i++) {
+    usfstl_loop_wait_and_handle();
+  }
+
+  /* poller, fd, poller, fd, ... */
+  CHECK_EQ(polled[0] + polled[1], (ROUNDS + 1) / 2);
+  CHECK_EQ(readable, ROUNDS / 2);
+  /* and the pollers take turns */
+  CHECK_EQ(polled[0], (polled[0] + polled[1] + 1) / 2);
+
+  usfstl_loop_unregister_poller(&pollers[0]);
+  usfstl_loop_unregister_poller(&pollers[1]);
+  usfstl_loop_unregister(&entry);
+  close(fds[0]);
+  close(fds[1]);
+
+  if (failures) {
+    fprintf(stderr, "loop_test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("loop_test: OK\n");
+  return 0;
+}
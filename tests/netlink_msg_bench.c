@@ -0,0 +1,289 @@
+/*
+ * netlink_msg_bench - cost of building the messages wmediumd sends
+ *
+ * Compares the fixed-layout templates used for the TX status and RX
+ * frame messages against building the same messages with libnl (which
+ * is what wmediumd did before), after checking that both produce the
+ * same bytes:
+ *
+ * - messages per second for HWSIM_CMD_TX_INFO_FRAME and HWSIM_CMD_FRAME
+ * - delivering a 64 B, 1500 B and 8 KB frame into a guest's (vhost-user)
+ *   receive buffer: building an nl_msg and copying that, against copying
+ *   the template pieces and the frame straight into the buffer
+ *
+ * Run as netlink_msg_bench [ITERATIONS [tx|rx|guest-rx]] to only run one
+ * of them. This uses wmediumd.c itself, so needs libnl-genl and libconfig
+ * like wmediumd does. Build: make -C tests netlink_msg_bench
+ */
+#define main wmediumd_main
+#include "../wmediumd/wmediumd.c"
+#undef main
+
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 1000000
+#define FAMILY_ID 30
+#define MAX_FRAME_LEN 8192
+/* the guest posts receive buffers of a few pages */
+#define GUEST_PAGE 4096
+#define GUEST_PAGES 4
+
+static struct wmediumd bench_ctx = {
+    .family_id = FAMILY_ID,
+};
+static struct station bench_station = {
+    .hwaddr = {0x42, 0x00, 0x00, 0x00, 0x01, 0x00},
+};
+static u8 frame_data[MAX_FRAME_LEN];
+static u8 guest_mem[2][GUEST_PAGES * GUEST_PAGE];
+static volatile size_t sink;
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double ns, int iterations) {
+  printf("%-28s %7.1f ns/msg, %6.2f M msg/s\n", name, ns / iterations,
+         iterations / ns * 1e3);
+}
+
+/* what send_tx_info_frame_nl() did, with the template's attribute order */
+static struct nl_msg *build_tx_info_libnl(struct frame *frame) {
+  struct nl_msg *msg = nlmsg_alloc();
+
+  if (!msg ||
+      !genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, bench_ctx.family_id, 0,
+                   NLM_F_REQUEST, HWSIM_CMD_TX_INFO_FRAME, VERSION_NR) ||
+      nla_put(msg, HWSIM_ATTR_ADDR_TRANSMITTER, ETH_ALEN,
+              frame->sender->hwaddr) ||
+      nla_put_u32(msg, HWSIM_ATTR_FLAGS, frame->flags) ||
+      nla_put_u32(msg, HWSIM_ATTR_SIGNAL, frame->signal) ||
+      nla_put_u64(msg, HWSIM_ATTR_COOKIE, frame->cookie) ||
+      nla_put(msg, HWSIM_ATTR_TX_INFO,
+              frame->tx_rates_count * sizeof(struct hwsim_tx_rate),
+              frame->tx_rates)) {
+    fprintf(stderr, "error: cannot build the TX info message\n");
+    exit(1);
+  }
+
+  return msg;
+}
+
+/* what build_cloned_frame_msg() did */
+static struct nl_msg *build_rx_libnl(u8 *data, int data_len) {
+  struct nl_msg *msg;
+
+  msg = nlmsg_alloc_size(nlmsg_total_size(
+      GENL_HDRLEN + nla_total_size(ETH_ALEN) + nla_total_size(data_len) +
+      3 * nla_total_size(sizeof(u32))));
+  if (!msg ||
+      !genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, bench_ctx.family_id, 0,
+                   NLM_F_REQUEST, HWSIM_CMD_FRAME, VERSION_NR) ||
+      nla_put(msg, HWSIM_ATTR_ADDR_RECEIVER, ETH_ALEN,
+              bench_station.hwaddr) ||
+      nla_put(msg, HWSIM_ATTR_FRAME, data_len, data) ||
+      nla_put_u32(msg, HWSIM_ATTR_RX_RATE, 1) ||
+      nla_put_u32(msg, HWSIM_ATTR_FREQ, 2412) ||
+      nla_put_u32(msg, HWSIM_ATTR_SIGNAL, -50)) {
+    fprintf(stderr, "error: cannot build the RX message\n");
+    exit(1);
+  }
+
+  return msg;
+}
+
+static void check_same(const char *name, struct nl_msg *msg, const void *buf,
+                       size_t len) {
+  struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+  if (nlh->nlmsg_len != len || memcmp(nlh, buf, len)) {
+    fprintf(stderr, "error: %s: template differs from libnl (%zu/%u)\n",
+            name, len, nlh->nlmsg_len);
+    exit(1);
+  }
+}
+
+static void bench_tx_info(struct frame *frame, int iterations) {
+  struct tx_info_frame_msg tmpl;
+  struct nl_msg *msg;
+  double start;
+  size_t len;
+  int i;
+
+  msg = build_tx_info_libnl(frame);
+  len = fill_tx_info_frame_msg(&bench_ctx, &tmpl, frame);
+  check_same("tx info", msg, &tmpl, len);
+  nlmsg_free(msg);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    msg = build_tx_info_libnl(frame);
+    sink += nlmsg_hdr(msg)->nlmsg_len;
+    nlmsg_free(msg);
+  }
+  report("tx info, libnl", now_ns() - start, iterations);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    sink += fill_tx_info_frame_msg(&bench_ctx, &tmpl, frame);
+    __asm__ volatile("" : : "r"(&tmpl) : "memory");
+  }
+  report("tx info, template", now_ns() - start, iterations);
+}
+
+static void bench_rx(int data_len, int iterations) {
+  struct cloned_frame_iov rx;
+  struct nl_msg *msg;
+  char name[32];
+  double start;
+  int i;
+
+  msg = build_rx_libnl(frame_data, data_len);
+  fill_cloned_frame_iov(&bench_ctx, &rx, &bench_station, frame_data, data_len,
+                        -50, 2412, 0);
+  iov_read(guest_mem[0], sizeof(guest_mem[0]), rx.iov, 4);
+  check_same("rx", msg, guest_mem[0], rx.head.nlh.nlmsg_len);
+  nlmsg_free(msg);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    msg = build_rx_libnl(frame_data, data_len);
+    sink += nlmsg_hdr(msg)->nlmsg_len;
+    nlmsg_free(msg);
+  }
+  snprintf(name, sizeof(name), "rx %d B, libnl", data_len);
+  report(name, now_ns() - start, iterations);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    fill_cloned_frame_iov(&bench_ctx, &rx, &bench_station, frame_data,
+                          data_len, -50, 2412, 0);
+    __asm__ volatile("" : : "r"(&rx) : "memory");
+    sink += rx.head.nlh.nlmsg_len;
+  }
+  snprintf(name, sizeof(name), "rx %d B, template", data_len);
+  report(name, now_ns() - start, iterations);
+}
+
+/* like usfstl_vhost_user_fill_buf(), for the guest buffer */
+static size_t fill_guest(struct iovec *sg, unsigned int nsg,
+                         const struct iovec *iov, unsigned int n_iov) {
+  size_t written = 0;
+  unsigned int i;
+
+  for (i = 0; i < n_iov; i++) {
+    written += iov_fill_offset(sg, nsg, written, iov[i].iov_base,
+                               iov[i].iov_len);
+  }
+
+  return written;
+}
+
+static void init_guest_sg(struct iovec *sg, u8 *mem) {
+  int i;
+
+  for (i = 0; i < GUEST_PAGES; i++) {
+    sg[i].iov_base = mem + i * GUEST_PAGE;
+    sg[i].iov_len = GUEST_PAGE;
+  }
+}
+
+static void bench_guest_rx(int data_len, int iterations) {
+  struct iovec sg_copy[GUEST_PAGES], sg_direct[GUEST_PAGES];
+  struct cloned_frame_iov rx;
+  struct nl_msg *msg;
+  size_t len, written;
+  char name[40];
+  double start;
+  int i;
+
+  init_guest_sg(sg_copy, guest_mem[0]);
+  init_guest_sg(sg_direct, guest_mem[1]);
+
+  /* both must leave the same bytes in the guest */
+  msg = build_rx_libnl(frame_data, data_len);
+  len = iov_fill(sg_copy, GUEST_PAGES, nlmsg_hdr(msg),
+                 nlmsg_hdr(msg)->nlmsg_len);
+  nlmsg_free(msg);
+  fill_cloned_frame_iov(&bench_ctx, &rx, &bench_station, frame_data, data_len,
+                        -50, 2412, 0);
+  written = fill_guest(sg_direct, GUEST_PAGES, rx.iov, 4);
+  if (len != written || memcmp(guest_mem[0], guest_mem[1], len)) {
+    fprintf(stderr, "error: guest rx %d B: buffers differ (%zu/%zu)\n",
+            data_len, len, written);
+    exit(1);
+  }
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    msg = build_rx_libnl(frame_data, data_len);
+    sink += iov_fill(sg_copy, GUEST_PAGES, nlmsg_hdr(msg),
+                     nlmsg_hdr(msg)->nlmsg_len);
+    nlmsg_free(msg);
+  }
+  snprintf(name, sizeof(name), "guest rx %d B, nl_msg copy", data_len);
+  report(name, now_ns() - start, iterations);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    fill_cloned_frame_iov(&bench_ctx, &rx, &bench_station, frame_data,
+                          data_len, -50, 2412, 0);
+    sink += fill_guest(sg_direct, GUEST_PAGES, rx.iov, 4);
+  }
+  snprintf(name, sizeof(name), "guest rx %d B, direct", data_len);
+  report(name, now_ns() - start, iterations);
+}
+
+int main(int argc, char **argv) {
+  static const int sizes[] = {64, 1500, MAX_FRAME_LEN};
+  int iterations = DEFAULT_ITERATIONS;
+  const char *only = argc > 2 ? argv[2] : NULL;
+  struct frame *frame;
+  unsigned int i;
+
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+  if (iterations <= 0 ||
+      (only && strcmp(only, "tx") && strcmp(only, "rx") &&
+       strcmp(only, "guest-rx"))) {
+    fprintf(stderr, "usage: %s [ITERATIONS [tx|rx|guest-rx]]\n", argv[0]);
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(frame_data); i++) {
+    frame_data[i] = i * 7;
+  }
+
+  frame = calloc(1, sizeof(*frame));
+  if (!frame) {
+    return 1;
+  }
+  frame->sender = &bench_station;
+  frame->flags = HWSIM_TX_STAT_ACK;
+  frame->signal = -50;
+  frame->cookie = 0x1234;
+  frame->tx_rates_count = IEEE80211_TX_MAX_RATES;
+  for (i = 0; i < IEEE80211_TX_MAX_RATES; i++) {
+    frame->tx_rates[i].idx = i;
+    frame->tx_rates[i].count = 1;
+  }
+
+  if (!only || !strcmp(only, "tx")) {
+    bench_tx_info(frame, iterations);
+  }
+  if (!only || !strcmp(only, "rx")) {
+    bench_rx(1500, iterations);
+  }
+  if (!only || !strcmp(only, "guest-rx")) {
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      bench_guest_rx(sizes[i], iterations);
+    }
+  }
+
+  free(frame);
+  return 0;
+}
@@ -0,0 +1,517 @@
+/*
+ * timetravel_test - checks for the time-travel scheduler control
+ *
+ * A fake controller runs in a thread on a unix socket, ACKs everything,
+ * runs the client at the earliest time it requested once it waits, and
+ * counts the messages it sees:
+ *
+ * - UPDATE and GET are only sent when the controller's time may differ
+ *   from what we know, i.e. not while we're running; a GET while waiting
+ *   (e.g. from a vhost-user message handler) is a round trip
+ * - inside a FREE_UNTIL window jobs run without a REQUEST
+ * - REQUESTs made while running don't wait for their ACK, but at most
+ *   64 are outstanding, and WAIT collects all of them; those made while
+ *   waiting do wait, the controller must have them before we reply
+ * - with shared memory offered on the START ACK, requests and the time
+ *   go through that, and our request is taken out of it on RUN
+ * - the per-message statistics count what was actually sent
+ *
+ * Build and run: make -C tests check
+ */
+#define _GNU_SOURCE
+#include <usfstl/loop.h>
+#include <usfstl/sched.h>
+#include <usfstl/schedctrl.h>
+#include <linux/um_timetravel.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define NSEC_PER_TICK 1000
+#define CLIENT_ID 0x1234
+/* the ID the controller assigns us with shared memory */
+#define SHM_ID 3
+#define SHM_LEN (2 * 4096)
+/* USFSTL_SCHED_CTRL_MAX_UNACKED */
+#define MAX_UNACKED 64
+
+static int failures;
+
+#define CHECK_EQ(actual, expected)                                       \
+  do {                                                                   \
+    unsigned long long _a = (actual), _e = (expected);                  \
+    if (_a != _e) {                                                      \
+      fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__,   \
+              __LINE__, #actual, _a, _e);                                \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+struct fake_ctrl {
+  char dir[64], path[128];
+  int listen_fd;
+  pthread_t thread;
+
+  /* set up before the client connects */
+  struct um_timetravel_schedshm *shm;
+  int memfd;
+  /* sent before (or with shared memory, stored with) every RUN */
+  uint64_t free_until;
+  /* the time returned for GET */
+  uint64_t get_time;
+  /* written on the first WAIT, the RUN is then held back until a GET */
+  int poke_fd;
+
+  /* controller thread only */
+  uint32_t seq;
+  uint64_t req_time;
+  bool req_set, run_held;
+
+  /* messages seen, by op */
+  unsigned int ops[UM_TIMETRAVEL_GET_TOD + 1];
+};
+
+static unsigned int fake_ops(struct fake_ctrl *fake,
+                             enum um_timetravel_ops op) {
+  return __atomic_load_n(&fake->ops[op], __ATOMIC_SEQ_CST);
+}
+
+static void fake_send(int fd, enum um_timetravel_ops op, uint32_t seq,
+                      uint64_t time, int pass_fd) {
+  struct um_timetravel_msg msg = {
+      .op = op,
+      .seq = seq,
+      .time = time,
+  };
+  uint8_t control[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov = {
+      .iov_base = &msg,
+      .iov_len = sizeof(msg),
+  };
+  struct msghdr hdr = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+  };
+  struct cmsghdr *cmsg;
+
+  if (pass_fd >= 0) {
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+  }
+
+  /* the client may already be gone after its last WAIT */
+  sendmsg(fd, &hdr, MSG_NOSIGNAL);
+}
+
+static void fake_run(struct fake_ctrl *fake, int fd) {
+  union um_timetravel_schedshm_client *client;
+
+  if (fake->shm) {
+    client = &fake->shm->clients[SHM_ID];
+    if (!(client->flags & UM_TIMETRAVEL_SCHEDSHM_FLAGS_REQ_RUN)) {
+      return;
+    }
+    /* it's up to the client to take its request out */
+    fake->shm->running_id = SHM_ID;
+    fake->shm->current_time = client->req_time;
+    fake->shm->free_until = fake->free_until;
+    fake_send(fd, UM_TIMETRAVEL_RUN, ++fake->seq, client->req_time, -1);
+    return;
+  }
+
+  if (!fake->req_set) {
+    return;
+  }
+  if (fake->free_until) {
+    fake_send(fd, UM_TIMETRAVEL_FREE_UNTIL, ++fake->seq, fake->free_until,
+              -1);
+  }
+  fake_send(fd, UM_TIMETRAVEL_RUN, ++fake->seq, fake->req_time, -1);
+  fake->req_set = false;
+}
+
+static void *fake_thread(void *data) {
+  struct fake_ctrl *fake = data;
+  struct um_timetravel_msg msg;
+  int fd = accept(fake->listen_fd, NULL, NULL);
+
+  while (fd >= 0 && read(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+    if (msg.op <= UM_TIMETRAVEL_GET_TOD) {
+      __atomic_fetch_add(&fake->ops[msg.op], 1, __ATOMIC_SEQ_CST);
+    }
+
+    switch (msg.op) {
+      case UM_TIMETRAVEL_START:
+        fake_send(fd, UM_TIMETRAVEL_ACK, msg.seq, SHM_ID,
+                  fake->shm ? fake->memfd : -1);
+        break;
+      case UM_TIMETRAVEL_REQUEST:
+        if (!fake->req_set || msg.time < fake->req_time) {
+          fake->req_time = msg.time;
+        }
+        fake->req_set = true;
+        fake_send(fd, UM_TIMETRAVEL_ACK, msg.seq, 0, -1);
+        break;
+      case UM_TIMETRAVEL_WAIT:
+        if (fake->shm) {
+          fake->shm->running_id = 0;
+        }
+        fake_send(fd, UM_TIMETRAVEL_ACK, msg.seq, 0, -1);
+        if (fake->poke_fd >= 0) {
+          if (write(fake->poke_fd, "", 1) != 1) {
+            fprintf(stderr, "error: cannot poke the client\n");
+            exit(1);
+          }
+          fake->poke_fd = -1;
+          fake->run_held = true;
+          break;
+        }
+        fake_run(fake, fd);
+        break;
+      case UM_TIMETRAVEL_GET:
+        fake_send(fd, UM_TIMETRAVEL_ACK, msg.seq, fake->get_time, -1);
+        if (fake->run_held) {
+          fake->run_held = false;
+          fake_run(fake, fd);
+        }
+        break;
+      case UM_TIMETRAVEL_ACK:
+        break;
+      default:
+        fake_send(fd, UM_TIMETRAVEL_ACK, msg.seq, 0, -1);
+        break;
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  return NULL;
+}
+
+static void fake_start(struct fake_ctrl *fake, bool with_shm) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  memset(fake, 0, sizeof(*fake));
+  fake->memfd = -1;
+  fake->poke_fd = -1;
+
+  strcpy(fake->dir, "/tmp/timetravel_test.XXXXXX");
+  if (!mkdtemp(fake->dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(fake->path, sizeof(fake->path), "%s/ctrl", fake->dir);
+
+  if (with_shm) {
+    fake->memfd = memfd_create("timetravel_test", MFD_CLOEXEC);
+    if (fake->memfd < 0 || ftruncate(fake->memfd, SHM_LEN)) {
+      perror("memfd");
+      exit(1);
+    }
+    fake->shm = mmap(NULL, SHM_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fake->memfd, 0);
+    if (fake->shm == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    fake->shm->version = UM_TIMETRAVEL_SCHEDSHM_VERSION;
+    fake->shm->len = SHM_LEN;
+    fake->shm->max_clients = 64;
+    /* the controller itself is running, and reads requests from here */
+    fake->shm->running_id = 0;
+    fake->shm->clients[0].capa = UM_TIMETRAVEL_SCHEDSHM_CAP_TIME_SHARE;
+    fake->shm->free_until = 20000;
+  }
+
+  strcpy(addr.sun_path, fake->path);
+  fake->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fake->listen_fd < 0 ||
+      bind(fake->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fake->listen_fd, 1)) {
+    perror("controller socket");
+    exit(1);
+  }
+
+  if (pthread_create(&fake->thread, NULL, fake_thread, fake)) {
+    fprintf(stderr, "error: cannot start the controller\n");
+    exit(1);
+  }
+}
+
+static void fake_stop(struct fake_ctrl *fake) {
+  pthread_join(fake->thread, NULL);
+  close(fake->listen_fd);
+  unlink(fake->path);
+  rmdir(fake->dir);
+  if (fake->shm) {
+    munmap(fake->shm, SHM_LEN);
+    close(fake->memfd);
+  }
+}
+
+static void check_op_stats(const char *name,
+                           const struct usfstl_sched_ctrl_op_stats *stats,
+                           uint64_t count) {
+  uint64_t sum = 0;
+  int i;
+
+  for (i = 0; i < USFSTL_SCHED_CTRL_HIST_BUCKETS; i++) {
+    sum += stats->hist[i];
+  }
+
+  if (stats->count != count || sum != count || stats->max_ns > stats->total_ns) {
+    fprintf(stderr,
+            "%s stats: count %llu, histogram %llu, expected %llu "
+            "(max %llu ns, total %llu ns)\n",
+            name, (unsigned long long)stats->count, (unsigned long long)sum,
+            (unsigned long long)count, (unsigned long long)stats->max_ns,
+            (unsigned long long)stats->total_ns);
+    failures++;
+  }
+}
+
+static void job_done(struct usfstl_job *job) {}
+
+static uint64_t poke_time;
+static bool poke_waiting;
+static unsigned int poke_outstanding;
+static struct usfstl_job poke_job = {
+    .start = 60, .name = "poke", .callback = job_done};
+
+/* like a vhost-user message arriving while we wait */
+static void poke_handler(struct usfstl_loop_entry *entry) {
+  struct usfstl_sched_ctrl *ctrl = entry->data;
+  char c;
+
+  if (read(entry->fd, &c, 1) != 1) {
+    fprintf(stderr, "error: cannot read the poke\n");
+    exit(1);
+  }
+
+  poke_waiting = ctrl->waiting;
+  usfstl_sched_ctrl_sync_from(ctrl);
+  poke_time = ctrl->sched->current_time;
+
+  /*
+   * Once we reply, the sender may WAIT on its own socket, so the
+   * controller must have our request by then.
+   */
+  usfstl_sched_add_job(ctrl->sched, &poke_job);
+  poke_outstanding = ctrl->seq - ctrl->acked_seq;
+  usfstl_sched_del_job(&poke_job);
+}
+
+static void test_messages(void) {
+  static USFSTL_SCHEDULER(sched);
+  struct usfstl_sched_ctrl ctrl = {};
+  struct usfstl_job job_a = {.start = 50, .name = "a", .callback = job_done};
+  struct usfstl_job job_b = {.start = 70, .name = "b", .callback = job_done};
+  struct usfstl_loop_entry poke = {.handler = poke_handler, .data = &ctrl};
+  struct fake_ctrl fake;
+  int pipe_fds[2];
+
+  fake_start(&fake, false);
+  if (pipe(pipe_fds)) {
+    perror("pipe");
+    exit(1);
+  }
+  fake.free_until = 100 * NSEC_PER_TICK;
+  fake.get_time = 20 * NSEC_PER_TICK;
+  fake.poke_fd = pipe_fds[1];
+  poke.fd = pipe_fds[0];
+  usfstl_loop_register(&poke);
+
+  usfstl_sched_ctrl_start(&ctrl, fake.path, NSEC_PER_TICK, CLIENT_ID, &sched);
+
+  /* the first UPDATE tells the controller, then it knows */
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_UPDATE), 1);
+  CHECK_EQ(ctrl.stats.updates_elided, 2);
+
+  /* and so do we */
+  usfstl_sched_ctrl_sync_from(&ctrl);
+  CHECK_EQ(ctrl.stats.gets_elided, 1);
+
+  /*
+   * Others run while we wait, so the GET from the handler is sent,
+   * and so is its request, but the controller still has ours first.
+   */
+  usfstl_sched_add_job(&sched, &job_a);
+  CHECK_EQ((uintptr_t)usfstl_sched_next(&sched), (uintptr_t)&job_a);
+  CHECK_EQ(poke_waiting, 1);
+  CHECK_EQ(poke_time, 20);
+  CHECK_EQ(poke_outstanding, 0);
+  CHECK_EQ(sched.current_time, 50);
+  CHECK_EQ(ctrl.seq - ctrl.acked_seq, 0);
+  CHECK_EQ(ctrl.stats.runs, 1);
+  CHECK_EQ(ctrl.stats.free_untils, 1);
+
+  /* inside the FREE_UNTIL window, there's no need to ask */
+  usfstl_sched_add_job(&sched, &job_b);
+  CHECK_EQ((uintptr_t)usfstl_sched_next(&sched), (uintptr_t)&job_b);
+  CHECK_EQ(sched.current_time, 70);
+
+  usfstl_sched_ctrl_sync_from(&ctrl);
+  CHECK_EQ(ctrl.stats.gets_elided, 2);
+
+  /* we moved the time, so the controller must be told once */
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_UPDATE), 2);
+  CHECK_EQ(ctrl.stats.updates_elided, 3);
+
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_REQUEST), 2);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_WAIT), 1);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_GET), 1);
+  /* for FREE_UNTIL and RUN */
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_ACK), 2);
+
+  check_op_stats("request", &ctrl.stats.request, 2);
+  check_op_stats("wait", &ctrl.stats.wait, 1);
+  check_op_stats("update", &ctrl.stats.update, 2);
+  check_op_stats("get", &ctrl.stats.get, 1);
+  CHECK_EQ(ctrl.stats.wait_ns > 0, 1);
+
+  usfstl_loop_unregister(&poke);
+  usfstl_sched_ctrl_stop(&ctrl);
+  fake_stop(&fake);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+static void test_pipelining(void) {
+  static USFSTL_SCHEDULER(sched);
+  struct usfstl_sched_ctrl ctrl = {};
+  struct usfstl_job job = {.name = "job", .callback = job_done};
+  struct fake_ctrl fake;
+  unsigned int i, outstanding, max_outstanding = 0;
+
+  fake_start(&fake, false);
+  usfstl_sched_ctrl_start(&ctrl, fake.path, NSEC_PER_TICK, CLIENT_ID, &sched);
+
+  /* every one is the earliest job, so is requested */
+  for (i = 0; i < 200; i++) {
+    job.start = 100 + i;
+    usfstl_sched_add_job(&sched, &job);
+    usfstl_sched_del_job(&job);
+
+    outstanding = ctrl.seq - ctrl.acked_seq;
+    if (outstanding > max_outstanding) {
+      max_outstanding = outstanding;
+    }
+  }
+  CHECK_EQ(max_outstanding, MAX_UNACKED);
+
+  /* the controller runs us at the earliest request it has */
+  job.start = 100;
+  usfstl_sched_add_job(&sched, &job);
+  CHECK_EQ((uintptr_t)usfstl_sched_next(&sched), (uintptr_t)&job);
+  CHECK_EQ(sched.current_time, 100);
+  CHECK_EQ(ctrl.seq - ctrl.acked_seq, 0);
+  CHECK_EQ(ctrl.stats.runs, 1);
+
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_REQUEST), 201);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_WAIT), 1);
+  check_op_stats("request", &ctrl.stats.request, 201);
+  check_op_stats("wait", &ctrl.stats.wait, 1);
+
+  usfstl_sched_ctrl_stop(&ctrl);
+  fake_stop(&fake);
+}
+
+static void test_shm(void) {
+  static USFSTL_SCHEDULER(sched);
+  struct usfstl_sched_ctrl ctrl = {};
+  struct usfstl_job job = {.name = "job", .callback = job_done};
+  union um_timetravel_schedshm_client *client;
+  struct fake_ctrl fake;
+
+  fake_start(&fake, true);
+  fake.free_until = 90 * NSEC_PER_TICK;
+  client = &fake.shm->clients[SHM_ID];
+
+  usfstl_sched_ctrl_start(&ctrl, fake.path, NSEC_PER_TICK, CLIENT_ID, &sched);
+  CHECK_EQ(ctrl.shm != NULL, 1);
+  CHECK_EQ(ctrl.shm_id, SHM_ID);
+  CHECK_EQ(client->capa, UM_TIMETRAVEL_SCHEDSHM_CAP_TIME_SHARE);
+  CHECK_EQ(client->name, CLIENT_ID);
+
+  /* the controller is running and reads the request from memory */
+  job.start = 50;
+  usfstl_sched_add_job(&sched, &job);
+  CHECK_EQ(client->req_time, 50 * NSEC_PER_TICK);
+  CHECK_EQ(client->flags, UM_TIMETRAVEL_SCHEDSHM_FLAGS_REQ_RUN);
+
+  /* we're not running, so this is a message, and syncs with the thread */
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_UPDATE), 1);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_REQUEST), 0);
+
+  CHECK_EQ((uintptr_t)usfstl_sched_next(&sched), (uintptr_t)&job);
+  CHECK_EQ(sched.current_time, 50);
+  CHECK_EQ(ctrl.stats.runs, 1);
+  /* the request was granted, so mustn't hold free_until down */
+  CHECK_EQ(client->flags, 0);
+
+  /* free_until is read from memory */
+  job.start = 60;
+  usfstl_sched_add_job(&sched, &job);
+  CHECK_EQ((uintptr_t)usfstl_sched_next(&sched), (uintptr_t)&job);
+  CHECK_EQ(sched.current_time, 60);
+
+  /* while running, the time is just stored */
+  usfstl_sched_ctrl_sync_to(&ctrl);
+  CHECK_EQ(fake.shm->current_time, 60 * NSEC_PER_TICK);
+  usfstl_sched_ctrl_sync_from(&ctrl);
+  CHECK_EQ(ctrl.stats.gets_elided, 1);
+
+  /* someone else asked to run earlier, so our next job is requested */
+  fake.shm->free_until = 55 * NSEC_PER_TICK;
+  job.start = 80;
+  usfstl_sched_add_job(&sched, &job);
+  CHECK_EQ(client->req_time, 80 * NSEC_PER_TICK);
+  CHECK_EQ(client->flags, UM_TIMETRAVEL_SCHEDSHM_FLAGS_REQ_RUN);
+  usfstl_sched_del_job(&job);
+
+  usfstl_sched_ctrl_stop(&ctrl);
+  CHECK_EQ(ctrl.shm == NULL, 1);
+  fake_stop(&fake);
+
+  /* only START, the first UPDATE and the WAITs were messages */
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_START), 1);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_UPDATE), 1);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_REQUEST), 0);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_GET), 0);
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_WAIT), 2);
+  /* RUN isn't ACKed with shared memory */
+  CHECK_EQ(fake_ops(&fake, UM_TIMETRAVEL_ACK), 0);
+  check_op_stats("update", &ctrl.stats.update, 1);
+  check_op_stats("request", &ctrl.stats.request, 0);
+}
+
+int main(void) {
+  test_messages();
+  test_pipelining();
+  test_shm();
+
+  if (failures) {
+    fprintf(stderr, "timetravel_test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("timetravel_test: OK\n");
+  return 0;
+}
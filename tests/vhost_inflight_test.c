@@ -0,0 +1,253 @@
+/*
+ * vhost_inflight_test - checks for the vhost-user ring state handling
+ *
+ * - inflight recovery on a split ring: the device takes five buffers,
+ *   returns two and "crashes"; a new device mapping the same inflight
+ *   area must process the other three again, in the order they were
+ *   taken, before anything new
+ * - the packed ring base from SET_VRING_BASE: a fresh ring (no base, or
+ *   the 0 that UML sends) starts with both wrap counters set, the state
+ *   returned by GET_VRING_BASE is restored exactly
+ *
+ * Build and run: make -C tests check
+ */
+#include "../wmediumd/lib/vhost.c"
+
+#include <stdio.h>
+#include <sys/eventfd.h>
+
+#define QUEUE_SIZE 16
+#define BUF_SIZE 64
+#define TX_QUEUE 1
+
+static uint8_t guest_mem[1 << 20];
+static int failures;
+
+#define CHECK_EQ(actual, expected)                                       \
+  do {                                                                   \
+    unsigned long long _a = (actual), _e = (expected);                  \
+    if (_a != _e) {                                                      \
+      fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__,   \
+              __LINE__, #actual, _a, _e);                                \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+static const struct usfstl_vhost_user_ops test_ops;
+
+static struct usfstl_vhost_user_server test_server = {
+    .ops = &test_ops,
+    .max_queues = 2,
+    .input_queues = 1 << TX_QUEUE,
+};
+
+static struct usfstl_vhost_user_dev_int *create_dev(uint64_t features) {
+  struct usfstl_vhost_user_dev_int *dev;
+  int q;
+
+  dev = calloc(1, sizeof(*dev) + 2 * sizeof(dev->virtqs[0]));
+  if (!dev) {
+    fprintf(stderr, "error: out of memory\n");
+    exit(1);
+  }
+
+  dev->ext.server = &test_server;
+  dev->ext.features = (1ULL << VIRTIO_F_VERSION_1) | features;
+  dev->n_regions = 1;
+  dev->regions[0].size = sizeof(guest_mem);
+  dev->region_vaddr[0] = guest_mem;
+
+  for (q = 0; q < 2; q++) {
+    dev->virtqs[q].call_fd = eventfd(0, EFD_NONBLOCK);
+    usfstl_list_init(&dev->virtqs[q].backlog);
+  }
+
+  return dev;
+}
+
+static void free_dev(struct usfstl_vhost_user_dev_int *dev) {
+  int q;
+
+  usfstl_vhost_user_inflight_unmap(dev);
+  for (q = 0; q < 2; q++) {
+    close(dev->virtqs[q].call_fd);
+    free(dev->virtqs[q].resubmit);
+  }
+  free(dev);
+}
+
+/* what SET_VRING_ADDR does for the split ring */
+static void setup_split(struct usfstl_vhost_user_dev_int *dev) {
+  struct usfstl_vhost_user_virtq *vq = &dev->virtqs[TX_QUEUE];
+
+  vring_init(&vq->virtq, QUEUE_SIZE, guest_mem, 4096);
+  usfstl_vhost_user_set_base(dev, vq);
+  vq->used_idx = vq->virtq.used->idx;
+  usfstl_vhost_user_inflight_recover(dev, TX_QUEUE);
+  vq->enabled = true;
+}
+
+static void release_buf(struct usfstl_vhost_user_buf *buf) {
+  free(buf->in_sg);
+  free(buf->out_sg);
+  free(buf);
+}
+
+/* the buffers are single descriptors, so always fit the fixed one */
+static struct usfstl_vhost_user_buf *get_buf(
+    struct usfstl_vhost_user_dev_int *dev) {
+  struct usfstl_vhost_user_buf *fixed = calloc(1, sizeof(*fixed)), *buf;
+
+  fixed->n_in_sg = fixed->n_out_sg = 4;
+  fixed->in_sg = calloc(fixed->n_in_sg, sizeof(*fixed->in_sg));
+  fixed->out_sg = calloc(fixed->n_out_sg, sizeof(*fixed->out_sg));
+
+  buf = usfstl_vhost_user_get_virtq_buf(dev, TX_QUEUE, fixed);
+  if (buf != fixed) {
+    fprintf(stderr, "error: no buffer, or not in the fixed one\n");
+    exit(1);
+  }
+
+  return buf;
+}
+
+static void put_buf(struct usfstl_vhost_user_dev_int *dev,
+                    struct usfstl_vhost_user_buf *buf) {
+  usfstl_vhost_user_push_used(dev, buf, TX_QUEUE);
+  release_buf(buf);
+}
+
+static void test_inflight_recovery(void) {
+  struct usfstl_vhost_user_dev_int *dev = create_dev(0), *dev2;
+  struct usfstl_vhost_user_buf *bufs[5], *buf;
+  struct usfstl_vhost_user_virtq *vq;
+  struct vring *vring;
+  uint64_t size;
+  unsigned int i, n;
+  int fd;
+
+  memset(guest_mem, 0, sizeof(guest_mem));
+
+  fd = usfstl_vhost_user_inflight_alloc(dev, 2, QUEUE_SIZE, &size);
+  if (fd < 0) {
+    fprintf(stderr, "error: cannot allocate the inflight area\n");
+    exit(1);
+  }
+
+  setup_split(dev);
+  vring = &dev->virtqs[TX_QUEUE].virtq;
+  for (i = 0; i < QUEUE_SIZE; i++) {
+    vring->desc[i].addr = 65536 + BUF_SIZE * i;
+    vring->desc[i].len = BUF_SIZE;
+  }
+
+  /* five buffers, not using the descriptors in order */
+  for (i = 0; i < 5; i++) {
+    vring->avail->ring[i] = (i * 3) % QUEUE_SIZE;
+  }
+  vring->avail->idx = 5;
+
+  for (i = 0; i < 5; i++) {
+    bufs[i] = get_buf(dev);
+    CHECK_EQ(bufs[i]->idx, (i * 3) % QUEUE_SIZE);
+  }
+
+  /* return the second and fourth, then lose the device */
+  put_buf(dev, bufs[1]);
+  put_buf(dev, bufs[3]);
+  usfstl_vhost_user_flush_used(dev, TX_QUEUE);
+  CHECK_EQ(vring->used->idx, 2);
+
+  dev2 = create_dev(0);
+  if (usfstl_vhost_user_inflight_map(dev2, fd, size, 0, 2, QUEUE_SIZE)) {
+    fprintf(stderr, "error: cannot map the inflight area\n");
+    exit(1);
+  }
+  setup_split(dev2);
+  vq = &dev2->virtqs[TX_QUEUE];
+
+  CHECK_EQ(vq->last_avail_idx, 5);
+  CHECK_EQ(vq->n_resubmit, 3);
+
+  /* the three lost buffers come back first, in order */
+  for (i = 0; i < 3; i++) {
+    CHECK_EQ(usfstl_vhost_user_virtq_pending(dev2, TX_QUEUE), 1);
+    buf = get_buf(dev2);
+    CHECK_EQ(buf->idx, (i * 6) % QUEUE_SIZE);
+    put_buf(dev2, buf);
+  }
+  CHECK_EQ(usfstl_vhost_user_virtq_pending(dev2, TX_QUEUE), 0);
+  usfstl_vhost_user_flush_used(dev2, TX_QUEUE);
+
+  /* then new ones */
+  vring->avail->ring[5] = 7;
+  vring->avail->idx = 6;
+  buf = get_buf(dev2);
+  CHECK_EQ(buf->idx, 7);
+  put_buf(dev2, buf);
+  usfstl_vhost_user_flush_used(dev2, TX_QUEUE);
+
+  CHECK_EQ(vring->used->idx, 6);
+  CHECK_EQ(vq->inflight->used_idx, 6);
+  for (i = 0, n = 0; i < QUEUE_SIZE; i++) {
+    n += vq->inflight->desc[i].inflight;
+  }
+  CHECK_EQ(n, 0);
+
+  for (i = 0; i < 5; i += 2) {
+    release_buf(bufs[i]);
+  }
+  free_dev(dev);
+  free_dev(dev2);
+  close(fd);
+}
+
+static void test_packed_base(void) {
+  struct usfstl_vhost_user_dev_int *dev =
+      create_dev(1ULL << VIRTIO_F_RING_PACKED);
+  struct usfstl_vhost_user_virtq *vq = &dev->virtqs[TX_QUEUE];
+
+  /* no SET_VRING_BASE at all */
+  usfstl_vhost_user_set_base(dev, vq);
+  CHECK_EQ(vq->last_avail_idx, 0);
+  CHECK_EQ(vq->used_idx, 0);
+  CHECK_EQ(vq->avail_wrap, 1);
+  CHECK_EQ(vq->used_wrap, 1);
+
+  /* UML's virtio_uml sends 0 for a new ring */
+  vq->base = 0;
+  vq->base_set = true;
+  usfstl_vhost_user_set_base(dev, vq);
+  CHECK_EQ(vq->avail_wrap, 1);
+  CHECK_EQ(vq->used_wrap, 1);
+
+  /* resuming with what GET_VRING_BASE returned, wrapped once */
+  vq->base = 5 | (0 << 15) | (3U << 16) | (1U << 31);
+  vq->base_stopped = true;
+  usfstl_vhost_user_set_base(dev, vq);
+  CHECK_EQ(vq->last_avail_idx, 5);
+  CHECK_EQ(vq->avail_wrap, 0);
+  CHECK_EQ(vq->used_idx, 3);
+  CHECK_EQ(vq->used_wrap, 1);
+
+  /* both counters wrapped, so the state really is 0 */
+  vq->base = 0;
+  usfstl_vhost_user_set_base(dev, vq);
+  CHECK_EQ(vq->avail_wrap, 0);
+  CHECK_EQ(vq->used_wrap, 0);
+
+  free_dev(dev);
+}
+
+int main(void) {
+  test_inflight_recovery();
+  test_packed_base();
+
+  if (failures) {
+    fprintf(stderr, "vhost_inflight_test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("vhost_inflight_test: OK\n");
+  return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * vhost_ring_bench - drive the vhost-user device code with a fake guest
+ *
+ * The guest side is simulated in-process: it posts batches of TX buffers
+ * on a split or packed ring (with and without VIRTIO_F_IN_ORDER), lets the
+ * device handle the queue, and then reaps the used entries, checking that
+ * every buffer comes back exactly once. Prints the cost per buffer for
+ * each ring layout.
+ *
+ * Build: make -C tests vhost_ring_bench
+ */
+#include "../wmediumd/lib/vhost.c"
+
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#define QUEUE_SIZE 256
+#define BATCH 32
+#define DEFAULT_ITERATIONS 200000
+#define BUF_SIZE 64
+/* guest physical address of the buffers, in the second region */
+#define BUF_GPA (1ULL << 30)
+
+#define PACKED_AVAIL (1 << VRING_PACKED_DESC_F_AVAIL)
+#define PACKED_USED (1 << VRING_PACKED_DESC_F_USED)
+
+static uint8_t guest_mem[2][1 << 21];
+static uint64_t handled;
+
+static void bench_handle(struct usfstl_vhost_user_dev *dev,
+                         struct usfstl_vhost_user_buf *buf,
+                         unsigned int vring) {
+  /* touch the data like a real device would */
+  (void)*(volatile uint8_t *)buf->out_sg[0].iov_base;
+  handled++;
+}
+
+static const struct usfstl_vhost_user_ops bench_ops = {
+    .handle = bench_handle,
+};
+
+static struct usfstl_vhost_user_server bench_server = {
+    .ops = &bench_ops,
+    .max_queues = 2,
+    .input_queues = 1,
+    .batch_notify = true,
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct usfstl_vhost_user_dev_int *create_dev(uint64_t features) {
+  struct usfstl_vhost_user_dev_int *dev;
+  int q;
+
+  memset(guest_mem, 0, sizeof(guest_mem));
+
+  dev = calloc(1, sizeof(*dev) + 2 * sizeof(dev->virtqs[0]));
+  if (!dev) {
+    fprintf(stderr, "error: out of memory\n");
+    exit(1);
+  }
+
+  dev->ext.server = &bench_server;
+  dev->ext.features = (1ULL << VIRTIO_F_VERSION_1) |
+                      (1ULL << VIRTIO_RING_F_EVENT_IDX) | features;
+
+  /* rings in the first region, buffers in the second */
+  dev->n_regions = 2;
+  dev->regions[0].guest_phys_addr = 0;
+  dev->regions[0].size = sizeof(guest_mem[0]);
+  dev->region_vaddr[0] = guest_mem[0];
+  dev->regions[1].guest_phys_addr = BUF_GPA;
+  dev->regions[1].size = sizeof(guest_mem[1]);
+  dev->region_vaddr[1] = guest_mem[1];
+
+  for (q = 0; q < 2; q++) {
+    dev->virtqs[q].call_fd = eventfd(0, EFD_NONBLOCK);
+    dev->virtqs[q].enabled = true;
+    dev->virtqs[q].avail_wrap = true;
+    dev->virtqs[q].used_wrap = true;
+    usfstl_list_init(&dev->virtqs[q].backlog);
+  }
+
+  return dev;
+}
+
+static void free_dev(struct usfstl_vhost_user_dev_int *dev) {
+  int q;
+
+  for (q = 0; q < 2; q++) {
+    close(dev->virtqs[q].call_fd);
+  }
+  free(dev);
+}
+
+static void report(const char *name, double total_ns, double handle_ns,
+                   uint64_t entries, int iterations) {
+  uint64_t bufs = (uint64_t)iterations * BATCH;
+
+  printf("%-17s %6.1f ns/buf (device %5.1f ns/buf), "
+         "%4.1f used entries per %d buffers\n",
+         name, total_ns / bufs, handle_ns / bufs,
+         (double)entries / iterations, BATCH);
+}
+
+static void bench_split(bool in_order, int iterations) {
+  struct usfstl_vhost_user_dev_int *dev =
+      create_dev(in_order ? 1ULL << VIRTIO_F_IN_ORDER : 0);
+  struct vring *vring = &dev->virtqs[0].virtq;
+  uint16_t avail = 0, used = 0;
+  uint64_t entries = 0;
+  double start, handle_ns = 0;
+  int i, j;
+
+  vring_init(vring, QUEUE_SIZE, guest_mem[0], 4096);
+  for (i = 0; i < QUEUE_SIZE; i++) {
+    vring->desc[i].addr = BUF_GPA + BUF_SIZE * i;
+    vring->desc[i].len = BUF_SIZE;
+  }
+
+  handled = 0;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    uint16_t used_idx;
+    double t;
+
+    for (j = 0; j < BATCH; j++) {
+      vring->avail->ring[avail % QUEUE_SIZE] = avail % QUEUE_SIZE;
+      avail++;
+    }
+    __sync_synchronize();
+    vring->avail->idx = avail;
+
+    t = now_ns();
+    usfstl_vhost_user_handle_queue(dev, 0);
+    handle_ns += now_ns() - t;
+
+    used_idx = vring->used->idx;
+    __sync_synchronize();
+    if (used_idx != avail) {
+      fprintf(stderr, "error: split: used idx %u, expected %u\n", used_idx,
+              avail);
+      exit(1);
+    }
+
+    /* the used index counts buffers, whatever the entries say */
+    for (; used != used_idx; used++) {
+      if (vring->used->ring[used % QUEUE_SIZE].id != used % QUEUE_SIZE) {
+        fprintf(stderr, "error: split: used entry %u has ID %u\n", used,
+                vring->used->ring[used % QUEUE_SIZE].id);
+        exit(1);
+      }
+      entries++;
+    }
+    vring_used_event(vring) = used - 1;
+  }
+
+  if (handled != (uint64_t)iterations * BATCH) {
+    fprintf(stderr, "error: split: handled %llu buffers\n",
+            (unsigned long long)handled);
+    exit(1);
+  }
+
+  report(in_order ? "split+in_order" : "split", now_ns() - start, handle_ns,
+         entries, iterations);
+  free_dev(dev);
+}
+
+static void bench_packed(bool in_order, int iterations) {
+  struct usfstl_vhost_user_dev_int *dev =
+      create_dev((1ULL << VIRTIO_F_RING_PACKED) |
+                 (in_order ? 1ULL << VIRTIO_F_IN_ORDER : 0));
+  struct usfstl_vhost_user_virtq *vq = &dev->virtqs[0];
+  struct vring_packed_desc *ring = (void *)guest_mem[0];
+  uint16_t next = 0, used = 0, id = 0;
+  bool wrap = true, used_wrap = true;
+  uint64_t entries = 0;
+  double start, handle_ns = 0;
+  int i, j;
+
+  vq->virtq.num = QUEUE_SIZE;
+  vq->packed_desc = ring;
+  vq->driver_event = (void *)(guest_mem[0] + 8192);
+  vq->device_event = (void *)(guest_mem[0] + 8200);
+  vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+  handled = 0;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    uint16_t head = next, head_flags = 0, first_id = id;
+    int reaped = 0;
+    double t;
+
+    for (j = 0; j < BATCH; j++) {
+      uint16_t flags = wrap ? PACKED_AVAIL : PACKED_USED;
+
+      ring[next].addr = BUF_GPA + BUF_SIZE * next;
+      ring[next].len = BUF_SIZE;
+      ring[next].id = id++ % QUEUE_SIZE;
+      /* the head is made available last, for the whole batch */
+      if (next == head) {
+        head_flags = flags;
+      } else {
+        ring[next].flags = flags;
+      }
+
+      if (++next == QUEUE_SIZE) {
+        next = 0;
+        wrap = !wrap;
+      }
+    }
+    __sync_synchronize();
+    ring[head].flags = head_flags;
+
+    t = now_ns();
+    usfstl_vhost_user_handle_queue(dev, 0);
+    handle_ns += now_ns() - t;
+
+    /* with IN_ORDER, one entry may stand for several buffers */
+    while (reaped < BATCH) {
+      uint16_t flags = ring[used].flags;
+      bool a = !!(flags & PACKED_AVAIL), u = !!(flags & PACKED_USED);
+      uint16_t expected = (first_id + reaped) % QUEUE_SIZE;
+      int n = 1;
+
+      if (a != u || a != used_wrap) {
+        break;
+      }
+      __sync_synchronize();
+
+      if (in_order) {
+        n = (uint16_t)(ring[used].id - expected) % QUEUE_SIZE + 1;
+      } else if (ring[used].id != expected) {
+        fprintf(stderr, "error: packed: used entry has ID %u, expected %u\n",
+                ring[used].id, expected);
+        exit(1);
+      }
+
+      reaped += n;
+      entries++;
+      used += n;
+      if (used >= QUEUE_SIZE) {
+        used -= QUEUE_SIZE;
+        used_wrap = !used_wrap;
+      }
+    }
+
+    if (reaped != BATCH) {
+      fprintf(stderr, "error: packed: reaped %d of %d buffers\n", reaped,
+              BATCH);
+      exit(1);
+    }
+  }
+
+  report(in_order ? "packed+in_order" : "packed", now_ns() - start,
+         handle_ns, entries, iterations);
+  free_dev(dev);
+}
+
+int main(int argc, char **argv) {
+  int iterations = DEFAULT_ITERATIONS;
+
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+
+  bench_split(false, iterations);
+  bench_split(true, iterations);
+  bench_packed(false, iterations);
+  bench_packed(true, iterations);
+
+  return 0;
+}
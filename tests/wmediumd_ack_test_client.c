@@ -141,7 +141,7 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  struct wmediumd_message_control control_message;
+  struct wmediumd_message_control control_message = {};
 
   control_message.flags = WMEDIUMD_CTL_RX_ALL_FRAMES;
 
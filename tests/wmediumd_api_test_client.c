@@ -0,0 +1,1200 @@
+/*
+ * wmediumd_api_test_client - exercise and check the API socket
+ *
+ * The commands print what wmediumd answers, "check" compares it to what
+ * api.h describes instead. Run it against a wmediumd with at least one
+ * station: make -C tests check-api API_SOCK=PATH
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "wmediumd/api.h"
+
+#define MAC_FMT "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC_ARGS(a)                                                  \
+  (uint8_t)(a)[0], (uint8_t)(a)[1], (uint8_t)(a)[2], (uint8_t)(a)[3], \
+      (uint8_t)(a)[4], (uint8_t)(a)[5]
+
+/*
+ * The check command looks at the responses and events instead of
+ * printing them, counting what isn't as the API describes.
+ */
+static int checking;
+static int failures;
+
+/* the last WMEDIUMD_MSG_STATION_EVENTS seen while checking */
+static uint8_t *events;
+static uint32_t events_len;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                   \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                       \
+  do {                                                                   \
+    unsigned long long _a = (actual), _e = (expected);                  \
+    if (_a != _e) {                                                      \
+      fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__,   \
+              __LINE__, #actual, _a, _e);                                \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+void print_help(int exit_code) {
+  printf(
+      "wmediumd_api_test_client - exercise the wmediumd api server's "
+      "statistics and station messages\n\n");
+  printf("Usage: wmediumd_api_test_client -s PATH COMMAND [ARGS]\n");
+  printf("  Options:\n");
+  printf("     - h : Print help\n");
+  printf("     - s : Path for unix socket of wmediumd api server\n");
+  printf("  Commands:\n");
+  printf("     station-events [SECONDS] : subscribe to station and link\n");
+  printf("                                SNR changes and print them\n");
+  printf("                                (default 5 seconds)\n");
+  printf("     link-stats [reset]       : print per-link statistics\n");
+  printf("     set-position MAC X Y     : move a station\n");
+  printf("     vhost-stats              : print vhost-user statistics\n");
+  printf("     netlink-stats            : print netlink statistics\n");
+  printf("     timetravel-stats         : print time-travel statistics\n");
+  printf("     check                    : check the above against the API\n");
+  printf("                                description, needs at least one\n");
+  printf("                                station, exits 1 on failures\n");
+
+  exit(exit_code);
+}
+
+int write_fixed(int sock, const void *data, int len) {
+  int remain = len;
+  int pos = 0;
+
+  while (remain > 0) {
+    int actual_written = write(sock, ((const char *)data) + pos, remain);
+
+    if (actual_written <= 0) {
+      return actual_written;
+    }
+
+    remain -= actual_written;
+    pos += actual_written;
+  }
+
+  return pos;
+}
+
+int read_fixed(int sock, void *data, int len) {
+  int remain = len;
+  int pos = 0;
+
+  while (remain > 0) {
+    int actual_read = read(sock, ((char *)data) + pos, remain);
+
+    if (actual_read <= 0) {
+      return actual_read;
+    }
+
+    remain -= actual_read;
+    pos += actual_read;
+  }
+
+  return pos;
+}
+
+int wmediumd_send_packet(int sock, uint32_t type, const void *data,
+                         uint32_t len) {
+  struct wmediumd_message_header header;
+
+  header.type = type;
+  header.data_len = len;
+
+  if (write_fixed(sock, &header, sizeof(uint32_t) * 2) <= 0) {
+    return -1;
+  }
+
+  if (len != 0 && write_fixed(sock, data, len) <= 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* reads one message, the caller must free *data */
+int wmediumd_read_packet(int sock, uint32_t *type, uint8_t **data,
+                         uint32_t *len) {
+  struct wmediumd_message_header header;
+
+  if (read_fixed(sock, &header, sizeof(uint32_t) * 2) <= 0) {
+    fprintf(stderr, "error: connection to wmediumd lost\n");
+    return -1;
+  }
+
+  *type = header.type;
+  *len = header.data_len;
+  *data = NULL;
+
+  if (header.data_len != 0) {
+    *data = malloc(header.data_len);
+    if (*data == NULL ||
+        read_fixed(sock, *data, header.data_len) <= 0) {
+      fprintf(stderr, "error: cannot read %u bytes of message %u\n",
+              header.data_len, header.type);
+      free(*data);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* checks that the message has as many events as it says */
+int station_events_valid(const uint8_t *data, uint32_t len) {
+  const struct wmediumd_station_events *ev = (const void *)data;
+
+  return len >= sizeof(*ev) &&
+         len == sizeof(*ev) +
+                    (uint64_t)ev->n_stations *
+                        sizeof(struct wmediumd_station_event) +
+                    (uint64_t)ev->n_links * sizeof(struct wmediumd_link_event);
+}
+
+void print_station_events(const uint8_t *data, uint32_t len) {
+  const struct wmediumd_station_events *ev = (const void *)data;
+  const struct wmediumd_station_event *station;
+  const struct wmediumd_link_event *link;
+  uint32_t i;
+
+  if (!station_events_valid(data, len)) {
+    fprintf(stderr, "error: bad station events message (%u bytes)\n", len);
+    return;
+  }
+
+  station = (const void *)ev->data;
+  for (i = 0; i < ev->n_stations; i++, station++) {
+    printf("station " MAC_FMT " (hwaddr " MAC_FMT ") changed 0x%x: "
+           "bound %u pos %.2f,%.2f dir %.2f,%.2f tx_power %d\n",
+           MAC_ARGS(station->addr), MAC_ARGS(station->hwaddr),
+           station->changed, station->bound, station->x, station->y,
+           station->dir_x, station->dir_y, station->tx_power);
+  }
+
+  link = (const void *)station;
+  for (i = 0; i < ev->n_links; i++, link++) {
+    printf("link " MAC_FMT " -> " MAC_FMT ": snr %d\n", MAC_ARGS(link->src),
+           MAC_ARGS(link->dst), link->snr);
+  }
+}
+
+/*
+ * Handle a message that wmediumd sent on its own, returns 1 if it was
+ * one (and has been ACKed), 0 if it's a response to our request.
+ */
+int handle_event(int sock, uint32_t type, const uint8_t *data, uint32_t len) {
+  switch (type) {
+    case WMEDIUMD_MSG_STATION_EVENTS:
+      if (!checking) {
+        print_station_events(data, len);
+        break;
+      }
+      free(events);
+      events = malloc(len ?: 1);
+      events_len = events ? len : 0;
+      if (events) {
+        memcpy(events, data, len);
+      }
+      break;
+    case WMEDIUMD_MSG_TX_START:
+    case WMEDIUMD_MSG_NETLINK:
+      break;
+    default:
+      return 0;
+  }
+
+  if (wmediumd_send_packet(sock, WMEDIUMD_MSG_ACK, NULL, 0) < 0) {
+    return -1;
+  }
+
+  return 1;
+}
+
+/*
+ * Send a request and wait for its response, handling events that come
+ * in before it, the caller must free *response.
+ */
+int wmediumd_exchange(int sock, uint32_t type, const void *data, uint32_t len,
+                      uint32_t *response_type, uint8_t **response,
+                      uint32_t *response_len) {
+  int ret;
+
+  if (wmediumd_send_packet(sock, type, data, len) < 0) {
+    fprintf(stderr, "error: cannot send message %u\n", type);
+    return -1;
+  }
+
+  while (1) {
+    if (wmediumd_read_packet(sock, response_type, response, response_len) <
+        0) {
+      return -1;
+    }
+
+    ret = handle_event(sock, *response_type, *response, *response_len);
+    if (ret < 0) {
+      free(*response);
+      return -1;
+    }
+    if (ret == 0) {
+      return 0;
+    }
+    free(*response);
+  }
+}
+
+/* as above, returns 0 if the response has the expected type */
+int wmediumd_request(int sock, uint32_t type, const void *data, uint32_t len,
+                     uint32_t response_type, uint8_t **response,
+                     uint32_t *response_len) {
+  uint32_t rtype;
+
+  if (wmediumd_exchange(sock, type, data, len, &rtype, response,
+                        response_len) < 0) {
+    return -1;
+  }
+
+  if (rtype != response_type) {
+    fprintf(stderr, "error: got message %u for message %u, expected %u\n",
+            rtype, type, response_type);
+    free(*response);
+    *response = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+int parse_mac(const char *str, uint8_t *mac) {
+  return sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+                &mac[2], &mac[3], &mac[4], &mac[5]) == 6
+             ? 0
+             : -1;
+}
+
+/* sends a request that's answered with just an ACK */
+int wmediumd_request_ack(int sock, uint32_t type, const void *data,
+                         uint32_t len) {
+  uint8_t *response;
+  uint32_t response_len;
+
+  if (wmediumd_request(sock, type, data, len, WMEDIUMD_MSG_ACK, &response,
+                       &response_len) < 0) {
+    return -1;
+  }
+
+  free(response);
+  return 0;
+}
+
+int subscribe_station_events(int sock) {
+  struct wmediumd_message_control control = {};
+
+  control.flags = WMEDIUMD_CTL_NOTIFY_STATIONS | WMEDIUMD_CTL_NOTIFY_LINK_SNR;
+
+  return wmediumd_request_ack(sock, WMEDIUMD_MSG_SET_CONTROL, &control,
+                              sizeof(control));
+}
+
+/*
+ * Wait up to timeout_ms for station events, unless some came in already
+ * (with a response). Returns 1 if there are some, 0 if none came.
+ */
+int wait_station_events(int sock, int timeout_ms) {
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  uint8_t *data;
+  uint32_t type, len;
+  int ret;
+
+  while (!events && poll(&pfd, 1, timeout_ms) > 0) {
+    if (wmediumd_read_packet(sock, &type, &data, &len) < 0) {
+      return -1;
+    }
+    ret = handle_event(sock, type, data, len);
+    free(data);
+    if (ret <= 0) {
+      fprintf(stderr, "error: unexpected message %u\n", type);
+      return -1;
+    }
+  }
+
+  return events != NULL;
+}
+
+void forget_station_events(void) {
+  free(events);
+  events = NULL;
+  events_len = 0;
+}
+
+int do_station_events(int sock, int argc, char **argv) {
+  int seconds = argc > 0 ? atoi(argv[0]) : 5;
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  uint8_t *data;
+  uint32_t type, len;
+
+  /* notifications only go to registered clients */
+  if (wmediumd_request_ack(sock, WMEDIUMD_MSG_REGISTER, NULL, 0) < 0 ||
+      subscribe_station_events(sock) < 0) {
+    return -1;
+  }
+
+  /* the current state comes first, then the changes */
+  while (poll(&pfd, 1, seconds * 1000) > 0) {
+    if (wmediumd_read_packet(sock, &type, &data, &len) < 0) {
+      return -1;
+    }
+    if (handle_event(sock, type, data, len) == 0) {
+      fprintf(stderr, "error: unexpected message %u\n", type);
+    }
+    free(data);
+  }
+
+  return 0;
+}
+
+int do_link_stats(int sock, int argc, char **argv) {
+  struct wmediumd_get_link_stats get = {};
+  const struct wmediumd_link_stats_list *list;
+  const struct wmediumd_link_stats *link;
+  uint8_t *data;
+  uint32_t i, len;
+
+  if (argc > 0 && strcmp(argv[0], "reset") == 0) {
+    get.flags |= WMEDIUMD_LINK_STATS_RESET;
+  }
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_LINK_STATS, &get, sizeof(get),
+                       WMEDIUMD_MSG_LINK_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  list = (const void *)data;
+  if (len < sizeof(*list) || len < sizeof(*list) + list->count * sizeof(*link)) {
+    fprintf(stderr, "error: short link statistics (%u bytes)\n", len);
+    free(data);
+    return -1;
+  }
+
+  for (i = 0; i < list->count; i++) {
+    link = &list->links[i];
+    printf(MAC_FMT " -> " MAC_FMT ": frames %" PRIu64 " bytes %" PRIu64
+                   " retries %" PRIu64 " acked %" PRIu64
+                   " dropped (per) %" PRIu64 " dropped (cca) %" PRIu64 "\n",
+           MAC_ARGS(link->src), MAC_ARGS(link->dst), link->frames,
+           link->bytes, link->retries, link->acked, link->dropped_per,
+           link->dropped_cca);
+  }
+
+  free(data);
+  return 0;
+}
+
+int do_set_position(int sock, int argc, char **argv) {
+  struct wmediumd_set_position position;
+  uint8_t *data;
+  uint32_t len;
+
+  if (argc < 3 || parse_mac(argv[0], position.mac) < 0) {
+    print_help(-1);
+  }
+
+  position.x = strtod(argv[1], NULL);
+  position.y = strtod(argv[2], NULL);
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_SET_POSITION, &position,
+                       sizeof(position), WMEDIUMD_MSG_ACK, &data,
+                       &len) < 0) {
+    return -1;
+  }
+
+  free(data);
+  return 0;
+}
+
+void print_vhost_queue_stats(const char *name,
+                             const struct wmediumd_vhost_queue_stats *q) {
+  printf("  %s: kicks %" PRIu64 " buffers %" PRIu64 " used %" PRIu64
+         " calls %" PRIu64 " calls suppressed %" PRIu64 "\n",
+         name, q->kicks, q->buffers, q->used, q->calls, q->calls_suppressed);
+}
+
+int do_vhost_stats(int sock, int argc, char **argv) {
+  const struct wmediumd_vhost_stats_list *list;
+  const struct wmediumd_vhost_stats *client;
+  uint8_t *data;
+  uint32_t i, len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_VHOST_STATS, NULL, 0,
+                       WMEDIUMD_MSG_VHOST_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  list = (const void *)data;
+  /* newer wmediumd versions may have larger entries */
+  if (len < sizeof(*list) || list->entry_size < sizeof(*client) ||
+      len < sizeof(*list) + (uint64_t)list->count * list->entry_size) {
+    fprintf(stderr, "error: short vhost statistics (%u bytes)\n", len);
+    free(data);
+    return -1;
+  }
+
+  for (i = 0; i < list->count; i++) {
+    client = (const void *)(data + sizeof(*list) + i * list->entry_size);
+    printf("client %u (hwaddr " MAC_FMT "):\n", client->client_id,
+           MAC_ARGS(client->hwaddr));
+    print_vhost_queue_stats("tx", &client->tx);
+    print_vhost_queue_stats("rx", &client->rx);
+    printf("  rx dropped %" PRIu64 " backlogged %" PRIu64
+           " backlog %u (max %u)\n",
+           client->rx_dropped, client->rx_backlogged, client->rx_backlog,
+           client->rx_backlog_max);
+  }
+
+  free(data);
+  return 0;
+}
+
+int do_netlink_stats(int sock, int argc, char **argv) {
+  struct wmediumd_netlink_stats stats = {};
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_NETLINK_STATS, NULL, 0,
+                       WMEDIUMD_MSG_NETLINK_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  memcpy(&stats, data, len < sizeof(stats) ? len : sizeof(stats));
+  free(data);
+
+  printf("rx: msgs %" PRIu64 " reads %" PRIu64 " wakeups %" PRIu64
+         " budget exhausted %" PRIu64 " max batch %u\n",
+         stats.rx_msgs, stats.rx_reads, stats.wakeups,
+         stats.budget_exhausted, stats.max_batch);
+  printf("rx: overruns %" PRIu64 " kernel drops %" PRIu64 " errors %" PRIu64
+         " rcvbuf %u\n",
+         stats.overruns, stats.kernel_drops, stats.rx_errors, stats.rcvbuf);
+  printf("tx: msgs %" PRIu64 " syscalls %" PRIu64 " errors %" PRIu64 "\n",
+         stats.tx_msgs, stats.tx_syscalls, stats.tx_errors);
+
+  return 0;
+}
+
+void print_timetravel_op_stats(const char *name,
+                               const struct wmediumd_timetravel_op_stats *op) {
+  int i;
+
+  printf("%-8s count %" PRIu64 " avg %" PRIu64 " ns max %" PRIu64 " ns, usec",
+         name, op->count, op->count ? op->total_ns / op->count : 0,
+         op->max_ns);
+  for (i = 0; i < WMEDIUMD_TIMETRAVEL_HIST_BUCKETS; i++) {
+    if (op->hist[i] == 0) {
+      continue;
+    }
+    if (i == WMEDIUMD_TIMETRAVEL_HIST_BUCKETS - 1) {
+      printf(" >=%u:%" PRIu64, 1U << (i - 1), op->hist[i]);
+    } else {
+      printf(" <%u:%" PRIu64, 1U << i, op->hist[i]);
+    }
+  }
+  printf("\n");
+}
+
+int do_timetravel_stats(int sock, int argc, char **argv) {
+  struct wmediumd_timetravel_stats stats = {};
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_TIMETRAVEL_STATS, NULL, 0,
+                       WMEDIUMD_MSG_TIMETRAVEL_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  memcpy(&stats, data, len < sizeof(stats) ? len : sizeof(stats));
+  free(data);
+
+  print_timetravel_op_stats("request", &stats.request);
+  print_timetravel_op_stats("wait", &stats.wait);
+  print_timetravel_op_stats("update", &stats.update);
+  print_timetravel_op_stats("get", &stats.get);
+  printf("updates elided %" PRIu64 " gets elided %" PRIu64 "\n",
+         stats.updates_elided, stats.gets_elided);
+  printf("waiting %" PRIu64 " ns, running %" PRIu64 " ns, runs %" PRIu64
+         " free-untils %" PRIu64 "\n",
+         stats.wait_ns, stats.run_ns, stats.runs, stats.free_untils);
+
+  return 0;
+}
+
+/* all stations, as the subscription snapshot had them */
+static struct wmediumd_station_event *stations;
+static uint32_t n_stations;
+
+/* returns 1 if the station list has the station */
+int has_station(const struct wmediumd_station_infos *infos, const char *addr) {
+  uint32_t i;
+
+  for (i = 0; i < infos->count; i++) {
+    if (memcmp(infos->stations[i].addr, addr, ETH_ALEN) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Subscribing gives the full picture first, all stations as added and
+ * all links, and only once: subscribing again doesn't repeat it. The
+ * stations bound to a client are the ones WMEDIUMD_MSG_GET_STATIONS has.
+ */
+int check_station_events(int sock) {
+  const struct wmediumd_station_events *ev;
+  const struct wmediumd_station_infos *infos;
+  uint32_t i, bound = 0;
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request_ack(sock, WMEDIUMD_MSG_REGISTER, NULL, 0) < 0 ||
+      subscribe_station_events(sock) < 0) {
+    return -1;
+  }
+
+  CHECK_EQ(wait_station_events(sock, 1000), 1);
+  if (!events || !station_events_valid(events, events_len)) {
+    fprintf(stderr, "error: no valid station events after subscribing\n");
+    return -1;
+  }
+
+  ev = (const void *)events;
+  n_stations = ev->n_stations;
+  stations = malloc(n_stations * sizeof(*stations) ?: 1);
+  if (!stations) {
+    return -1;
+  }
+  memcpy(stations, ev->data, n_stations * sizeof(*stations));
+
+  CHECK_EQ(ev->n_links, n_stations * (n_stations - 1));
+  for (i = 0; i < n_stations; i++) {
+    CHECK_EQ(stations[i].changed, WMEDIUMD_STA_EV_ADDED);
+  }
+
+  forget_station_events();
+  if (subscribe_station_events(sock) < 0) {
+    return -1;
+  }
+  CHECK_EQ(wait_station_events(sock, 200), 0);
+  forget_station_events();
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_STATIONS, NULL, 0,
+                       WMEDIUMD_MSG_STATIONS_LIST, &data, &len) < 0) {
+    return -1;
+  }
+
+  infos = (const void *)data;
+  if (len < sizeof(*infos) ||
+      len < sizeof(*infos) + infos->count * sizeof(infos->stations[0])) {
+    fprintf(stderr, "error: short station list (%u bytes)\n", len);
+    free(data);
+    return -1;
+  }
+
+  for (i = 0; i < n_stations; i++) {
+    if (stations[i].bound) {
+      CHECK(has_station(infos, stations[i].addr));
+      bound++;
+    }
+  }
+  CHECK_EQ(infos->count, bound);
+
+  free(data);
+  return 0;
+}
+
+/* returns 1 if the snapshot had the station */
+int known_station(const char *addr) {
+  uint32_t i;
+
+  for (i = 0; i < n_stations; i++) {
+    if (memcmp(stations[i].addr, addr, ETH_ALEN) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* the caller must free the list */
+int get_link_stats(int sock, uint32_t flags,
+                   struct wmediumd_link_stats_list **list) {
+  struct wmediumd_get_link_stats get = {.flags = flags};
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_LINK_STATS, &get, sizeof(get),
+                       WMEDIUMD_MSG_LINK_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  *list = (void *)data;
+  if (len < sizeof(**list) ||
+      len != sizeof(**list) + (uint64_t)(*list)->count *
+                                  sizeof(struct wmediumd_link_stats)) {
+    fprintf(stderr, "error: bad link statistics (%u bytes)\n", len);
+    free(data);
+    return -1;
+  }
+
+  return 0;
+}
+
+const struct wmediumd_link_stats *find_link(
+    const struct wmediumd_link_stats_list *list,
+    const struct wmediumd_link_stats *link) {
+  uint32_t i;
+
+  for (i = 0; i < list->count; i++) {
+    if (memcmp(list->links[i].src, link->src, ETH_ALEN) == 0 &&
+        memcmp(list->links[i].dst, link->dst, ETH_ALEN) == 0) {
+      return &list->links[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Only links that carried frames are listed, between known stations,
+ * and their counters only grow until they're reset. Without a station
+ * bound to a client nothing can be sent, so nothing is left after the
+ * reset then.
+ */
+int check_link_stats(int sock) {
+  struct wmediumd_link_stats_list *before, *after;
+  const struct wmediumd_link_stats *link, *later;
+  uint32_t i, bound = 0;
+
+  if (get_link_stats(sock, 0, &before) < 0) {
+    return -1;
+  }
+  if (get_link_stats(sock, WMEDIUMD_LINK_STATS_RESET, &after) < 0) {
+    free(before);
+    return -1;
+  }
+
+  for (i = 0; i < before->count; i++) {
+    link = &before->links[i];
+    CHECK(memcmp(link->src, link->dst, ETH_ALEN) != 0);
+    CHECK(known_station(link->src) && known_station(link->dst));
+    CHECK(link->frames > 0);
+
+    later = find_link(after, link);
+    CHECK(later != NULL);
+    if (!later) {
+      continue;
+    }
+    CHECK(later->frames >= link->frames);
+    CHECK(later->bytes >= link->bytes);
+    CHECK(later->retries >= link->retries);
+    CHECK(later->acked >= link->acked);
+    CHECK(later->dropped_per >= link->dropped_per);
+    CHECK(later->dropped_cca >= link->dropped_cca);
+  }
+
+  free(before);
+  free(after);
+
+  if (get_link_stats(sock, 0, &after) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < n_stations; i++) {
+    bound += stations[i].bound;
+  }
+  if (!bound) {
+    CHECK_EQ(after->count, 0);
+  }
+
+  free(after);
+  return 0;
+}
+
+/* returns the response's type, or -1 */
+int response_type(int sock, uint32_t type, const void *data, uint32_t len) {
+  uint32_t rtype;
+  uint8_t *response;
+  uint32_t response_len;
+
+  if (wmediumd_exchange(sock, type, data, len, &rtype, &response,
+                        &response_len) < 0) {
+    return -1;
+  }
+
+  free(response);
+  return rtype;
+}
+
+/*
+ * Position, direction and TX power either all work (with a path loss
+ * model) or are all answered with WMEDIUMD_MSG_INVALID, and they're
+ * invalid for unknown stations in any case. A move is reported to
+ * subscribers.
+ */
+int check_set_position(int sock) {
+  const struct wmediumd_station_event *station = &stations[0];
+  const struct wmediumd_station_events *ev;
+  struct wmediumd_set_position position = {};
+  struct wmediumd_set_direction direction = {};
+  struct wmediumd_set_tx_power power = {};
+  int expected;
+
+  memcpy(position.mac, station->addr, ETH_ALEN);
+  position.x = station->x + 1;
+  position.y = station->y;
+  expected = response_type(sock, WMEDIUMD_MSG_SET_POSITION, &position,
+                           sizeof(position));
+  if (expected < 0) {
+    return -1;
+  }
+  CHECK(expected == WMEDIUMD_MSG_ACK || expected == WMEDIUMD_MSG_INVALID);
+
+  if (expected == WMEDIUMD_MSG_ACK) {
+    CHECK_EQ(wait_station_events(sock, 1000), 1);
+    ev = (const void *)events;
+    CHECK(events && station_events_valid(events, events_len) &&
+          ev->n_stations == 1);
+    if (events && station_events_valid(events, events_len) &&
+        ev->n_stations == 1) {
+      station = (const void *)ev->data;
+      CHECK(memcmp(station->addr, position.mac, ETH_ALEN) == 0);
+      CHECK(station->changed & WMEDIUMD_STA_EV_POSITION);
+      CHECK(station->x == position.x && station->y == position.y);
+    }
+    forget_station_events();
+
+    /* put it back */
+    station = &stations[0];
+    position.x = station->x;
+    if (wmediumd_request_ack(sock, WMEDIUMD_MSG_SET_POSITION, &position,
+                             sizeof(position)) < 0) {
+      return -1;
+    }
+  }
+
+  /* the current values, so nothing changes */
+  memcpy(direction.mac, station->addr, ETH_ALEN);
+  direction.dir_x = station->dir_x;
+  direction.dir_y = station->dir_y;
+  CHECK_EQ(response_type(sock, WMEDIUMD_MSG_SET_DIRECTION, &direction,
+                         sizeof(direction)),
+           expected);
+
+  memcpy(power.mac, station->addr, ETH_ALEN);
+  power.tx_power = station->tx_power;
+  CHECK_EQ(response_type(sock, WMEDIUMD_MSG_SET_TX_POWER, &power,
+                         sizeof(power)),
+           expected);
+
+  /* a locally administered address no station has */
+  memset(position.mac, 0xfe, ETH_ALEN);
+  position.mac[0] = 0x02;
+  if (!known_station((const char *)position.mac)) {
+    CHECK_EQ(response_type(sock, WMEDIUMD_MSG_SET_POSITION, &position,
+                           sizeof(position)),
+             WMEDIUMD_MSG_INVALID);
+  }
+
+  /* let the events of the above come in, and drop them */
+  wait_station_events(sock, 200);
+  forget_station_events();
+
+  return 0;
+}
+
+/* the caller must free the list */
+int get_vhost_stats(int sock, struct wmediumd_vhost_stats_list **list) {
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_VHOST_STATS, NULL, 0,
+                       WMEDIUMD_MSG_VHOST_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  *list = (void *)data;
+  if (len < sizeof(**list) ||
+      (*list)->entry_size < sizeof(struct wmediumd_vhost_stats) ||
+      len != sizeof(**list) + (uint64_t)(*list)->count * (*list)->entry_size) {
+    fprintf(stderr, "error: bad vhost statistics (%u bytes)\n", len);
+    free(data);
+    return -1;
+  }
+
+  return 0;
+}
+
+const struct wmediumd_vhost_stats *vhost_client(
+    const struct wmediumd_vhost_stats_list *list, uint32_t i) {
+  return (const void *)((const uint8_t *)list + sizeof(*list) +
+                        i * list->entry_size);
+}
+
+/* returns 1 if the snapshot had a station with the hwaddr */
+int known_hwaddr(const char *hwaddr) {
+  uint32_t i;
+
+  for (i = 0; i < n_stations; i++) {
+    if (memcmp(stations[i].hwaddr, hwaddr, ETH_ALEN) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void check_vhost_queue_stats(const struct wmediumd_vhost_queue_stats *q,
+                             const struct wmediumd_vhost_queue_stats *later) {
+  /* buffers are only returned after they were taken */
+  CHECK(q->used <= q->buffers);
+  CHECK(later->kicks >= q->kicks);
+  CHECK(later->buffers >= q->buffers);
+  CHECK(later->used >= q->used);
+  CHECK(later->calls >= q->calls);
+  CHECK(later->calls_suppressed >= q->calls_suppressed);
+}
+
+/*
+ * Each client is listed once, bound to a known station if any, and its
+ * counters only grow. Frames waiting in the backlog were counted when
+ * they got there.
+ */
+int check_vhost_stats(int sock) {
+  static const char no_hwaddr[ETH_ALEN];
+  struct wmediumd_vhost_stats_list *list, *again;
+  const struct wmediumd_vhost_stats *client, *later;
+  uint32_t i, j;
+
+  if (get_vhost_stats(sock, &list) < 0) {
+    return -1;
+  }
+  if (get_vhost_stats(sock, &again) < 0) {
+    free(list);
+    return -1;
+  }
+
+  for (i = 0; i < list->count; i++) {
+    client = vhost_client(list, i);
+
+    for (j = i + 1; j < list->count; j++) {
+      CHECK(vhost_client(list, j)->client_id != client->client_id);
+    }
+
+    if (memcmp(client->hwaddr, no_hwaddr, ETH_ALEN) != 0) {
+      CHECK(known_hwaddr(client->hwaddr));
+    }
+
+    CHECK(client->rx_backlog <= client->rx_backlogged);
+    CHECK(client->rx_backlog_max <= client->rx_backlogged);
+
+    /* it may have disconnected meanwhile */
+    for (j = 0, later = NULL; j < again->count && !later; j++) {
+      if (vhost_client(again, j)->client_id == client->client_id) {
+        later = vhost_client(again, j);
+      }
+    }
+    if (!later) {
+      continue;
+    }
+
+    check_vhost_queue_stats(&client->tx, &later->tx);
+    check_vhost_queue_stats(&client->rx, &later->rx);
+    CHECK(later->rx_dropped >= client->rx_dropped);
+    CHECK(later->rx_backlogged >= client->rx_backlogged);
+    CHECK(later->rx_backlog_max >= client->rx_backlog_max);
+  }
+
+  free(list);
+  free(again);
+  return 0;
+}
+
+int get_netlink_stats(int sock, struct wmediumd_netlink_stats *stats) {
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_NETLINK_STATS, NULL, 0,
+                       WMEDIUMD_MSG_NETLINK_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  /* newer versions may add fields */
+  CHECK(len >= sizeof(*stats));
+  memset(stats, 0, sizeof(*stats));
+  memcpy(stats, data, len < sizeof(*stats) ? len : sizeof(*stats));
+  free(data);
+
+  return 0;
+}
+
+/*
+ * Every wakeup reads at most the budget, and each syscall sends at least
+ * one message (or fails one). The counters only grow.
+ */
+int check_netlink_stats(int sock) {
+  struct wmediumd_netlink_stats stats, later;
+
+  if (get_netlink_stats(sock, &stats) < 0 ||
+      get_netlink_stats(sock, &later) < 0) {
+    return -1;
+  }
+
+  CHECK(stats.budget_exhausted <= stats.wakeups);
+  CHECK(stats.max_batch <= stats.rx_reads);
+  CHECK(stats.rx_reads <= stats.wakeups * stats.max_batch);
+  if (stats.wakeups) {
+    CHECK(stats.rcvbuf > 0);
+  }
+  CHECK(stats.tx_syscalls <= stats.tx_msgs);
+  CHECK(stats.tx_errors <= stats.tx_syscalls);
+
+  CHECK(later.rx_msgs >= stats.rx_msgs);
+  CHECK(later.rx_reads >= stats.rx_reads);
+  CHECK(later.wakeups >= stats.wakeups);
+  CHECK(later.budget_exhausted >= stats.budget_exhausted);
+  CHECK(later.overruns >= stats.overruns);
+  CHECK(later.kernel_drops >= stats.kernel_drops);
+  CHECK(later.rx_errors >= stats.rx_errors);
+  CHECK(later.max_batch >= stats.max_batch);
+  CHECK(later.tx_msgs >= stats.tx_msgs);
+  CHECK(later.tx_syscalls >= stats.tx_syscalls);
+  CHECK(later.tx_errors >= stats.tx_errors);
+
+  return 0;
+}
+
+int get_timetravel_stats(int sock, struct wmediumd_timetravel_stats *stats) {
+  uint8_t *data;
+  uint32_t len;
+
+  if (wmediumd_request(sock, WMEDIUMD_MSG_GET_TIMETRAVEL_STATS, NULL, 0,
+                       WMEDIUMD_MSG_TIMETRAVEL_STATS, &data, &len) < 0) {
+    return -1;
+  }
+
+  /* newer versions may add fields */
+  CHECK(len >= sizeof(*stats));
+  memset(stats, 0, sizeof(*stats));
+  memcpy(stats, data, len < sizeof(*stats) ? len : sizeof(*stats));
+  free(data);
+
+  return 0;
+}
+
+/*
+ * The histogram has every message once, and the slowest one is in the
+ * last bucket that has any.
+ */
+void check_timetravel_op_stats(const struct wmediumd_timetravel_op_stats *op,
+                               const struct wmediumd_timetravel_op_stats *later) {
+  uint64_t sum = 0, usec = op->max_ns / 1000;
+  int i, last = -1;
+
+  for (i = 0; i < WMEDIUMD_TIMETRAVEL_HIST_BUCKETS; i++) {
+    sum += op->hist[i];
+    if (op->hist[i]) {
+      last = i;
+    }
+  }
+
+  CHECK_EQ(sum, op->count);
+  CHECK(op->max_ns <= op->total_ns);
+  CHECK(op->total_ns <= op->count * op->max_ns);
+  if (last >= 0 && last < WMEDIUMD_TIMETRAVEL_HIST_BUCKETS - 1) {
+    CHECK(usec < 1ULL << last);
+  }
+  if (last > 0) {
+    CHECK(usec >= 1ULL << (last - 1));
+  }
+
+  CHECK(later->count >= op->count);
+  CHECK(later->total_ns >= op->total_ns);
+  CHECK(later->max_ns >= op->max_ns);
+  for (i = 0; i < WMEDIUMD_TIMETRAVEL_HIST_BUCKETS; i++) {
+    CHECK(later->hist[i] >= op->hist[i]);
+  }
+}
+
+/* the counters only grow, without a controller (-t) they stay zero */
+int check_timetravel_stats(int sock) {
+  struct wmediumd_timetravel_stats stats, later;
+
+  if (get_timetravel_stats(sock, &stats) < 0 ||
+      get_timetravel_stats(sock, &later) < 0) {
+    return -1;
+  }
+
+  check_timetravel_op_stats(&stats.request, &later.request);
+  check_timetravel_op_stats(&stats.wait, &later.wait);
+  check_timetravel_op_stats(&stats.update, &later.update);
+  check_timetravel_op_stats(&stats.get, &later.get);
+
+  CHECK(later.updates_elided >= stats.updates_elided);
+  CHECK(later.gets_elided >= stats.gets_elided);
+  CHECK(later.wait_ns >= stats.wait_ns);
+  CHECK(later.run_ns >= stats.run_ns);
+  CHECK(later.runs >= stats.runs);
+  CHECK(later.free_untils >= stats.free_untils);
+
+  return 0;
+}
+
+int do_check(int sock, int argc, char **argv) {
+  int ret;
+
+  checking = 1;
+
+  ret = check_station_events(sock);
+  if (ret == 0 && n_stations == 0) {
+    fprintf(stderr, "error: no stations to check with\n");
+    ret = -1;
+  }
+  if (ret == 0) {
+    ret = check_link_stats(sock);
+  }
+  if (ret == 0) {
+    ret = check_set_position(sock);
+  }
+  if (ret == 0) {
+    ret = check_vhost_stats(sock);
+  }
+  if (ret == 0) {
+    ret = check_netlink_stats(sock);
+  }
+  if (ret == 0) {
+    ret = check_timetravel_stats(sock);
+  }
+
+  forget_station_events();
+  free(stations);
+
+  if (ret < 0) {
+    return -1;
+  }
+  if (failures) {
+    fprintf(stderr, "wmediumd api check: %d failures\n", failures);
+    return -1;
+  }
+
+  printf("wmediumd api check: OK\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  int ret;
+  char *wmediumd_api_server_path = NULL;
+  const char *command;
+
+  while ((opt = getopt(argc, argv, "hs:")) != -1) {
+    switch (opt) {
+      case ':':
+        fprintf(stderr,
+                "error: Option `%c' "
+                "needs a value\n\n",
+                optopt);
+        break;
+      case 'h':
+        print_help(0);
+        break;
+      case 's':
+        if (wmediumd_api_server_path != NULL) {
+          fprintf(stderr,
+                  "error: You must provide just one option for `%c`\n\n",
+                  optopt);
+        }
+
+        wmediumd_api_server_path = strdup(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (wmediumd_api_server_path == NULL) {
+    fprintf(stderr, "error: must specify wmediumd api server path\n\n");
+    print_help(-1);
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "error: must specify a command\n\n");
+    print_help(-1);
+  }
+  command = argv[optind++];
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(wmediumd_api_server_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: unix socket path is too long(maximum %zu)\n",
+            sizeof(addr.sun_path) - 1);
+    print_help(-1);
+  }
+
+  strcpy(addr.sun_path, wmediumd_api_server_path);
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Cannot connect to %s\n", wmediumd_api_server_path);
+    return -1;
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if (strcmp(command, "station-events") == 0) {
+    ret = do_station_events(sock, argc, argv);
+  } else if (strcmp(command, "link-stats") == 0) {
+    ret = do_link_stats(sock, argc, argv);
+  } else if (strcmp(command, "set-position") == 0) {
+    ret = do_set_position(sock, argc, argv);
+  } else if (strcmp(command, "vhost-stats") == 0) {
+    ret = do_vhost_stats(sock, argc, argv);
+  } else if (strcmp(command, "netlink-stats") == 0) {
+    ret = do_netlink_stats(sock, argc, argv);
+  } else if (strcmp(command, "timetravel-stats") == 0) {
+    ret = do_timetravel_stats(sock, argc, argv);
+  } else if (strcmp(command, "check") == 0) {
+    ret = do_check(sock, argc, argv);
+  } else {
+    fprintf(stderr, "error: unknown command %s\n\n", command);
+    print_help(-1);
+  }
+
+  close(sock);
+  free(wmediumd_api_server_path);
+
+  return ret < 0 ? 1 : 0;
+}
@@ -35,7 +35,9 @@ enum wmediumd_message {
 
 	/*
 	 * Indicates TX start if WMEDIUMD_RX_CTL_NOTIFY_TX_START is set,
-	 * with struct wmediumd_tx_start as the payload.
+	 * with struct wmediumd_tx_start as the payload. It must be ACKed
+	 * like any message, but wmediumd only waits for that (and thus
+	 * the client's processing) with WMEDIUMD_CTL_TX_START_LOCKSTEP.
 	 */
 	WMEDIUMD_MSG_TX_START,
 
@@ -70,6 +72,66 @@ enum wmediumd_message {
 	WMEDIUMD_MSG_STOP_PCAP,
 
 	WMEDIUMD_MSG_STATIONS_LIST,
+
+	/*
+	 * Station state changes, sent to clients that set
+	 * WMEDIUMD_CTL_NOTIFY_STATIONS and/or WMEDIUMD_CTL_NOTIFY_LINK_SNR,
+	 * with struct wmediumd_station_events as the payload. All changes
+	 * made at the same simulation time are coalesced into one message.
+	 * The client must ACK it, but wmediumd doesn't wait for the ACK.
+	 */
+	WMEDIUMD_MSG_STATION_EVENTS,
+
+	/*
+	 * Get per-link traffic statistics, optionally with
+	 * struct wmediumd_get_link_stats as the payload. The
+	 * response is WMEDIUMD_MSG_LINK_STATS.
+	 */
+	WMEDIUMD_MSG_GET_LINK_STATS,
+
+	/*
+	 * Per-link traffic statistics, with struct wmediumd_link_stats_list
+	 * as the payload. Only links that carried frames are listed.
+	 */
+	WMEDIUMD_MSG_LINK_STATS,
+
+	/*
+	 * Set the position, direction or tx_power of one or more stations,
+	 * the payload is an array of struct wmediumd_set_position,
+	 * struct wmediumd_set_direction or struct wmediumd_set_tx_power
+	 * respectively. Only the links of the updated stations are
+	 * recalculated. They need the path loss model, without one
+	 * they're answered with WMEDIUMD_MSG_INVALID.
+	 */
+	WMEDIUMD_MSG_SET_POSITION,
+	WMEDIUMD_MSG_SET_DIRECTION,
+	WMEDIUMD_MSG_SET_TX_POWER,
+
+	/*
+	 * Get virtqueue statistics of the vhost-user clients, the
+	 * response is WMEDIUMD_MSG_VHOST_STATS with
+	 * struct wmediumd_vhost_stats_list as the payload.
+	 */
+	WMEDIUMD_MSG_GET_VHOST_STATS,
+	WMEDIUMD_MSG_VHOST_STATS,
+
+	/*
+	 * Get statistics of the netlink socket to mac80211_hwsim, the
+	 * response is WMEDIUMD_MSG_NETLINK_STATS with
+	 * struct wmediumd_netlink_stats as the payload (all zero if
+	 * netlink isn't used).
+	 */
+	WMEDIUMD_MSG_GET_NETLINK_STATS,
+	WMEDIUMD_MSG_NETLINK_STATS,
+
+	/*
+	 * Get statistics of the time-travel controller connection (-t),
+	 * the response is WMEDIUMD_MSG_TIMETRAVEL_STATS with
+	 * struct wmediumd_timetravel_stats as the payload (all zero if
+	 * time-travel isn't used). wmediumd also logs these on SIGUSR1.
+	 */
+	WMEDIUMD_MSG_GET_TIMETRAVEL_STATS,
+	WMEDIUMD_MSG_TIMETRAVEL_STATS,
 };
 
 struct wmediumd_message_header {
@@ -85,11 +147,38 @@ struct wmediumd_message_header {
 enum wmediumd_control_flags {
 	WMEDIUMD_CTL_NOTIFY_TX_START		= 1 << 0,
 	WMEDIUMD_CTL_RX_ALL_FRAMES		= 1 << 1,
+	WMEDIUMD_CTL_NOTIFY_STATIONS		= 1 << 2,
+	WMEDIUMD_CTL_NOTIFY_LINK_SNR		= 1 << 3,
+	/*
+	 * Wait for the client's ACK to WMEDIUMD_MSG_TX_START before going
+	 * on, e.g. to take simulated time into account when reacting to
+	 * it. Otherwise, the notification is sent and wmediumd continues.
+	 */
+	WMEDIUMD_CTL_TX_START_LOCKSTEP		= 1 << 4,
 };
 
+/*
+ * Clients must zero the whole struct before setting what they need,
+ * fields added later are then left at their defaults, see below.
+ */
 struct wmediumd_message_control {
 	uint32_t flags;
 
+	/*
+	 * Minimum SNR change (in dB) of a link that is reported with
+	 * WMEDIUMD_CTL_NOTIFY_LINK_SNR, 0 reports every change. Note
+	 * that the lowest threshold of all subscribed clients applies.
+	 */
+	uint32_t link_snr_threshold;
+
+	/*
+	 * Only send WMEDIUMD_MSG_TX_START for frames on this frequency
+	 * (in MHz) and/or from the station with this address; zero
+	 * doesn't filter.
+	 */
+	uint32_t tx_start_freq;
+	uint8_t tx_start_transmitter[ETH_ALEN];
+
 	/*
 	 * For compatibility, wmediumd is meant to understand shorter
 	 * (and ignore unknown parts of longer) control messages than
@@ -119,6 +208,31 @@ struct wmediumd_tx_start {
 };
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+struct wmediumd_set_position {
+	/* MAC address of the station */
+	uint8_t mac[ETH_ALEN];
+	/* new position [m] */
+	double x;
+	double y;
+};
+
+struct wmediumd_set_direction {
+	/* MAC address of the station */
+	uint8_t mac[ETH_ALEN];
+	/* new direction [m per movement interval] */
+	double dir_x;
+	double dir_y;
+};
+
+struct wmediumd_set_tx_power {
+	/* MAC address of the station */
+	uint8_t mac[ETH_ALEN];
+	/* new transmission power [dBm] */
+	int tx_power;
+};
+#pragma pack(pop)
+
 struct wmediumd_reload_config {
 	/* path of wmediumd configuration file */
 	char config_path[0];
@@ -145,4 +259,309 @@ struct wmediumd_station_infos {
 };
 #pragma pack(pop)
 
+enum wmediumd_station_event_flags {
+	WMEDIUMD_STA_EV_ADDED		= 1 << 0,
+	WMEDIUMD_STA_EV_REMOVED		= 1 << 1,
+	WMEDIUMD_STA_EV_CLIENT		= 1 << 2,
+	WMEDIUMD_STA_EV_POSITION	= 1 << 3,
+	WMEDIUMD_STA_EV_DIRECTION	= 1 << 4,
+	WMEDIUMD_STA_EV_TX_POWER	= 1 << 5,
+};
+
+#pragma pack(push, 1)
+struct wmediumd_station_event {
+	/*
+	 * Bitmap of enum wmediumd_station_event_flags describing what
+	 * changed, the other fields always carry the current state.
+	 * When subscribing, an ADDED event is generated for every
+	 * station, so a client may see ADDED for a known station.
+	 */
+	uint32_t changed;
+
+	char addr[ETH_ALEN];
+	char hwaddr[ETH_ALEN];
+
+	/* whether a client (VM or the kernel) is bound to the station */
+	uint8_t bound;
+
+	double x;
+	double y;
+
+	double dir_x;
+	double dir_y;
+
+	int tx_power;
+};
+
+struct wmediumd_link_event {
+	char src[ETH_ALEN];
+	char dst[ETH_ALEN];
+
+	/* new SNR from src to dst */
+	int snr;
+};
+
+struct wmediumd_station_events {
+	uint32_t n_stations;
+	uint32_t n_links;
+
+	/*
+	 * n_stations struct wmediumd_station_event followed by
+	 * n_links struct wmediumd_link_event
+	 */
+	uint8_t data[0];
+};
+#pragma pack(pop)
+
+enum wmediumd_link_stats_flags {
+	/* clear all counters after reading them */
+	WMEDIUMD_LINK_STATS_RESET		= 1 << 0,
+};
+
+struct wmediumd_get_link_stats {
+	uint32_t flags;
+};
+
+#pragma pack(push, 1)
+struct wmediumd_link_stats {
+	char src[ETH_ALEN];
+	char dst[ETH_ALEN];
+
+	/* frames sent from src to dst and their total length */
+	uint64_t frames;
+	uint64_t bytes;
+
+	/* additional transmission attempts of unicast frames */
+	uint64_t retries;
+
+	/* frames received by dst */
+	uint64_t acked;
+
+	/* frames lost due to the packet error rate */
+	uint64_t dropped_per;
+
+	/* frames lost below the CCA threshold or due to interference */
+	uint64_t dropped_cca;
+};
+
+struct wmediumd_link_stats_list {
+	uint32_t count;
+	struct wmediumd_link_stats links[0];
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct wmediumd_vhost_queue_stats {
+	/* notifications from the guest */
+	uint64_t kicks;
+
+	/* buffers taken from the guest, and returned to it */
+	uint64_t buffers;
+	uint64_t used;
+
+	/*
+	 * Notifications sent to the guest, and those suppressed since
+	 * the guest didn't need them (VIRTIO_RING_F_EVENT_IDX). Without
+	 * suppression on the guest side, every buffer would be kicked,
+	 * so the kicks saved are buffers - kicks on the TX queue.
+	 */
+	uint64_t calls;
+	uint64_t calls_suppressed;
+};
+
+struct wmediumd_vhost_stats {
+	/* identifies the client for its lifetime */
+	uint32_t client_id;
+
+	/* hwaddr of a station bound to the client, if any */
+	char hwaddr[ETH_ALEN];
+	uint8_t pad[2];
+
+	/* frames from the guest, summed over all queue pairs (-q) */
+	struct wmediumd_vhost_queue_stats tx;
+	/* frames to the guest */
+	struct wmediumd_vhost_queue_stats rx;
+
+	/*
+	 * Frames to the guest that were lost on the host side since the
+	 * guest had no receive buffers posted and the backlog was full
+	 * (or the queue wasn't set up), as opposed to the medium model.
+	 */
+	uint64_t rx_dropped;
+
+	/*
+	 * Frames that had to wait for the guest to post receive buffers,
+	 * the number waiting now over all RX queues, and the most that
+	 * were ever waiting on any single RX queue.
+	 */
+	uint64_t rx_backlogged;
+	uint32_t rx_backlog;
+	uint32_t rx_backlog_max;
+};
+
+struct wmediumd_vhost_stats_list {
+	uint32_t count;
+	/* size of each entry, more fields may be added in the future */
+	uint32_t entry_size;
+	struct wmediumd_vhost_stats clients[0];
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct wmediumd_netlink_stats {
+	/* messages from the kernel, and the socket reads they took */
+	uint64_t rx_msgs;
+	uint64_t rx_reads;
+
+	/*
+	 * Times the socket became readable, and those that ended with
+	 * data left since the per-wakeup budget was used up.
+	 */
+	uint64_t wakeups;
+	uint64_t budget_exhausted;
+
+	/*
+	 * Times the socket overflowed (ENOBUFS) and frames from the
+	 * kernel were lost, and the number of messages the kernel
+	 * dropped (if it reports that, otherwise 0).
+	 */
+	uint64_t overruns;
+	uint64_t kernel_drops;
+
+	/* other receive errors */
+	uint64_t rx_errors;
+
+	/* most reads in a single wakeup */
+	uint32_t max_batch;
+	/* receive buffer size, as granted by the kernel */
+	uint32_t rcvbuf;
+
+	/*
+	 * Messages to the kernel, the syscalls they took (they're sent
+	 * in batches, once per delivered frame) and failed sends.
+	 */
+	uint64_t tx_msgs;
+	uint64_t tx_syscalls;
+	uint64_t tx_errors;
+};
+#pragma pack(pop)
+
+#define WMEDIUMD_TIMETRAVEL_HIST_BUCKETS	16
+
+#pragma pack(push, 1)
+/*
+ * Wall time spent on one kind of message to the controller, until it
+ * was ACKed (requests aren't waited for, so just sending them).
+ */
+struct wmediumd_timetravel_op_stats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/*
+	 * Bucket 0 counts messages that took less than 1 usec, bucket i
+	 * those that took less than 2^i usec, the last one also the rest.
+	 */
+	uint64_t hist[WMEDIUMD_TIMETRAVEL_HIST_BUCKETS];
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct wmediumd_timetravel_stats {
+	/*
+	 * Time updates to the controller that were skipped since it
+	 * already had the current time, each saved a round trip.
+	 */
+	uint64_t updates_elided;
+
+	/*
+	 * Time queries to the controller that were skipped since we
+	 * were running and had the time already (or were free to run
+	 * in a FREE_UNTIL window), each saved a round trip.
+	 */
+	uint64_t gets_elided;
+
+	/* messages sent to the controller, by type */
+	struct wmediumd_timetravel_op_stats request;
+	struct wmediumd_timetravel_op_stats wait;
+	struct wmediumd_timetravel_op_stats update;
+	struct wmediumd_timetravel_op_stats get;
+
+	/*
+	 * Wall time (in nsec) spent waiting for the controller to let
+	 * us run, and running (simulating) in between.
+	 */
+	uint64_t wait_ns;
+	uint64_t run_ns;
+
+	/* RUN and FREE_UNTIL messages from the controller */
+	uint64_t runs;
+	uint64_t free_untils;
+};
+#pragma pack(pop)
+
+/*
+ * Telemetry shared memory region, see the -s option. It starts with
+ * struct wmediumd_telemetry, followed by n_stations entries of
+ * struct wmediumd_telemetry_station (station_size bytes each) at
+ * stations_offset, and the n_stations x n_stations SNR matrix as
+ * int32_t at snr_offset, indexed as [src * n_stations + dst].
+ *
+ * The content is protected by a sequence counter: a reader must read
+ * @seq, retry if it's odd, copy what it needs, and then read @seq again
+ * (with the appropriate barriers) and retry if it changed. The region
+ * only ever grows, if @size is larger than what's mapped the reader has
+ * to map it again. The offsets can change with the size.
+ */
+#define WMEDIUMD_TELEMETRY_MAGIC	0x54444d57	/* "WMDT" */
+#define WMEDIUMD_TELEMETRY_VERSION	1
+
+struct wmediumd_telemetry {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t header_size;
+
+	/* total size of the region */
+	uint64_t size;
+
+	/* number of updates so far, and simulation time [usec] of the last */
+	uint64_t updates;
+	uint64_t time;
+
+	uint32_t n_stations;
+	uint32_t station_size;
+	uint32_t stations_offset;
+	uint32_t snr_offset;
+
+	/* number of clients registered to receive frames */
+	uint32_t n_clients;
+	uint32_t reserved;
+
+	/* totals over all links, see struct wmediumd_link_stats */
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t retries;
+	uint64_t acked;
+	uint64_t dropped_per;
+	uint64_t dropped_cca;
+};
+
+struct wmediumd_telemetry_station {
+	char addr[ETH_ALEN];
+	char hwaddr[ETH_ALEN];
+
+	/* whether a client (VM or the kernel) is bound to the station */
+	uint8_t bound;
+	uint8_t pad[3];
+
+	int32_t tx_power;
+	uint32_t reserved;
+
+	double x;
+	double y;
+
+	double dir_x;
+	double dir_y;
+};
+
 #endif /* _WMEDIUMD_API_H */
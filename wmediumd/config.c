@@ -179,39 +179,82 @@ static int calc_path_loss_itu(void *model_param,
 	return PL;
 }
 
-static void recalc_path_loss(struct wmediumd *ctx)
+static void set_path_loss(struct wmediumd *ctx, int start, int end,
+			  int path_loss)
+{
+	ctx->snr_matrix[ctx->num_stas * start + end] =
+		ctx->sta_array[start]->tx_power - path_loss - NOISE_LEVEL;
+	ctx->snr_matrix[ctx->num_stas * end + start] =
+		ctx->sta_array[end]->tx_power - path_loss - NOISE_LEVEL;
+}
+
+/*
+ * All path loss models only depend on the distance between the
+ * stations, so calculate each pair once and fill in both directions.
+ */
+void recalc_path_loss(struct wmediumd *ctx)
 {
 	int start, end, path_loss;
 
 	for (start = 0; start < ctx->num_stas; start++) {
-		for (end = 0; end < ctx->num_stas; end++) {
-			if (start == end)
-				continue;
-
+		for (end = start + 1; end < ctx->num_stas; end++) {
 			path_loss = ctx->calc_path_loss(ctx->path_loss_param,
 				ctx->sta_array[end], ctx->sta_array[start]);
-			ctx->snr_matrix[ctx->num_stas * start + end] =
-				ctx->sta_array[start]->tx_power - path_loss -
-				NOISE_LEVEL;
+			set_path_loss(ctx, start, end, path_loss);
 		}
 	}
 }
 
+/*
+ * Recalculate only the links from and to a single station, after
+ * its position or tx_power changed.
+ */
+void recalc_station_path_loss(struct wmediumd *ctx, struct station *station)
+{
+	int other, path_loss;
+
+	for (other = 0; other < ctx->num_stas; other++) {
+		if (other == station->index)
+			continue;
+
+		path_loss = ctx->calc_path_loss(ctx->path_loss_param,
+			ctx->sta_array[other], station);
+		set_path_loss(ctx, station->index, other, path_loss);
+	}
+}
+
 static void move_stations_to_direction(struct usfstl_job *job)
 {
 	struct wmediumd *ctx = job->data;
 	struct station *station;
 
 	list_for_each_entry(station, &ctx->stations, list) {
+		if (!station->dir_x && !station->dir_y)
+			continue;
 		station->x += station->dir_x;
 		station->y += station->dir_y;
+		wmediumd_notify_station(ctx, station,
+					WMEDIUMD_STA_EV_POSITION);
 	}
 	recalc_path_loss(ctx);
+	wmediumd_notify_link_snr(ctx, NULL);
 
 	job->start += MOVE_INTERVAL * 1000000;
 	usfstl_sched_add_job(&scheduler, job);
 }
 
+void start_moving_stations(struct wmediumd *ctx)
+{
+	if (usfstl_job_scheduled(&ctx->move_job))
+		return;
+
+	ctx->move_job.start = scheduler.current_time + MOVE_INTERVAL * 1000000;
+	ctx->move_job.name = "move";
+	ctx->move_job.data = ctx;
+	ctx->move_job.callback = move_stations_to_direction;
+	usfstl_sched_add_job(&scheduler, &ctx->move_job);
+}
+
 static int parse_path_loss(struct wmediumd *ctx, config_t *cf)
 {
 	struct station *station;
@@ -239,11 +282,7 @@ static int parse_path_loss(struct wmediumd *ctx, config_t *cf)
 				"Specify %d directions\n", ctx->num_stas);
 			return -EINVAL;
 		}
-		ctx->move_job.start = MOVE_INTERVAL * 1000000;
-		ctx->move_job.name = "move";
-		ctx->move_job.data = ctx;
-		ctx->move_job.callback = move_stations_to_direction;
-		usfstl_sched_add_job(&scheduler, &ctx->move_job);
+		start_moving_stations(ctx);
 	}
 
 	tx_powers = config_lookup(cf, "model.tx_powers");
@@ -414,6 +453,18 @@ int validate_config(const char* file) {
 	return 1;
 }
 
+/* by address, the same address in config order (the first one wins) */
+static int compare_station_addr(const void *a, const void *b)
+{
+	const struct station *sta_a = *(const struct station **)a;
+	const struct station *sta_b = *(const struct station **)b;
+	int ret = memcmp(sta_a->addr, sta_b->addr, ETH_ALEN);
+
+	if (ret)
+		return ret;
+	return sta_a->index - sta_b->index;
+}
+
 /*
  *	Loads a config file into memory
  */
@@ -482,6 +533,17 @@ int load_config(struct wmediumd *ctx, const char *file, const char *per_file)
 
 		w_logf(ctx, LOG_NOTICE, "Added station %d: " MAC_FMT "\n", i, MAC_ARGS(addr));
 	}
+
+	/* index them by address, for API messages naming many stations */
+	ctx->sta_by_addr = malloc(count_ids * sizeof(struct station *));
+	if (!ctx->sta_by_addr) {
+		w_flogf(ctx, LOG_ERR, stderr, "Out of memory(sta_by_addr)!\n");
+		return -ENOMEM;
+	}
+	memcpy(ctx->sta_by_addr, ctx->sta_array,
+	       count_ids * sizeof(struct station *));
+	qsort(ctx->sta_by_addr, count_ids, sizeof(struct station *),
+	      compare_station_addr);
 	ctx->num_stas = count_ids;
 
 	enable_interference = config_lookup(cf, "ifaces.enable_interference");
@@ -522,6 +584,13 @@ int load_config(struct wmediumd *ctx, const char *file, const char *per_file)
 	for (i = 0; i < count_ids * count_ids; i++)
 		ctx->snr_matrix[i] = SNR_DEFAULT;
 
+	ctx->link_stats = calloc(sizeof(struct link_stats),
+				 count_ids * count_ids);
+	if (!ctx->link_stats) {
+		w_flogf(ctx, LOG_ERR, stderr, "Out of memory(link_stats)\n");
+		goto fail;
+	}
+
 	links = config_lookup(cf, "ifaces.links");
 	if (!links) {
 		model_type = config_lookup(cf, "model.type");
@@ -677,16 +746,26 @@ fail:
 
 int clear_config(struct wmediumd *ctx) {
 	free(ctx->sta_array);
+	free(ctx->sta_by_addr);
 	free(ctx->intf);
 	free(ctx->snr_matrix);
 	free(ctx->error_prob_matrix);
+	wmediumd_account_link_stats(ctx);
+	free(ctx->link_stats);
 	free(ctx->config_path);
 
 	ctx->sta_array = NULL;
+	ctx->sta_by_addr = NULL;
+	ctx->num_stas = 0;
 	ctx->intf = NULL;
 	ctx->snr_matrix = NULL;
 	ctx->error_prob_matrix = NULL;
+	ctx->link_stats = NULL;
 	ctx->config_path = NULL;
+	ctx->calc_path_loss = NULL;
+
+	/* the stations it would move are going away */
+	usfstl_sched_del_job(&ctx->move_job);
 
 	while (!list_empty(&ctx->stations)) {
 		struct station *station;
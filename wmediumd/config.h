@@ -28,5 +28,8 @@ int clear_config(struct wmediumd *ctx);
 int validate_config(const char* file);
 int load_config(struct wmediumd *ctx, const char *file, const char *per_file);
 int use_fixed_random_value(struct wmediumd *ctx);
+void recalc_path_loss(struct wmediumd *ctx);
+void recalc_station_path_loss(struct wmediumd *ctx, struct station *station);
+void start_moving_stations(struct wmediumd *ctx);
 
 #endif /* CONFIG_H_ */
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "list.h"
 
 #ifdef _WIN32
@@ -40,6 +41,33 @@ struct usfstl_loop_entry {
 
 extern struct usfstl_list g_usfstl_loop_entries;
 
+/**
+ * struct usfstl_loop_poller - main loop poller
+ * @list: private
+ * @pending: check if there's work to do, must not block
+ * @handle: handle the work found by @pending
+ * @max_idle_usec: maximum time to sleep (in microseconds) when there's
+ *	no work, this limits the latency of noticing new work
+ * @data: user data
+ *
+ * While pollers are registered, the main loop doesn't block in select()
+ * but checks all pollers between checking the file descriptors. After
+ * a poller had work, the file descriptors are checked (without waiting)
+ * before the pollers again, and the pollers take turns, so busy ones
+ * don't starve anything. When neither has anything to do for a while,
+ * it backs off by sleeping in select() for increasing amounts of time,
+ * up to @max_idle_usec.
+ */
+struct usfstl_loop_poller {
+	struct usfstl_list_entry list;
+	bool (*pending)(struct usfstl_loop_poller *);
+	void (*handle)(struct usfstl_loop_poller *);
+	unsigned int max_idle_usec;
+	void *data;
+};
+
+extern struct usfstl_list g_usfstl_loop_pollers;
+
 /**
  * g_usfstl_loop_pre_handler_fn - pre-handler function
  *
@@ -63,10 +91,23 @@ void usfstl_loop_register(struct usfstl_loop_entry *entry);
  */
 void usfstl_loop_unregister(struct usfstl_loop_entry *entry);
 
+/**
+ * usfstl_loop_register_poller - add a poller to the mainloop
+ * @poller: the poller to add, must be fully set up
+ */
+void usfstl_loop_register_poller(struct usfstl_loop_poller *poller);
+
+/**
+ * usfstl_loop_unregister_poller - remove a poller from the mainloop
+ * @poller: the poller to remove
+ */
+void usfstl_loop_unregister_poller(struct usfstl_loop_poller *poller);
+
 /**
  * usfstl_loop_wait_and_handle - wait and handle a single event
  *
- * Wait for, and handle, a single event, then return.
+ * Wait for, and handle, a single event, then return. The event
+ * may also be work found by a poller.
  */
 void usfstl_loop_wait_and_handle(void);
 
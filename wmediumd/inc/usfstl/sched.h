@@ -74,6 +74,9 @@ struct usfstl_job {
  *	function.
  * @external_sync_from: For external scheduler integration, return current
  *	time based on external time info.
+ * @external_sync_update: For external scheduler integration, optionally
+ *	refresh the next external sync point (usfstl_sched_set_sync_time())
+ *	before it's used, if it can change without us being told.
  * @time_advanced: Set this to have logging (or similar) when time
  *	advances. Note that the argument is relative to the previous
  *	time, if you need the current absolute time use
@@ -86,6 +89,7 @@ struct usfstl_scheduler {
 	void (*external_request)(struct usfstl_scheduler *, uint64_t);
 	void (*external_wait)(struct usfstl_scheduler *);
 	uint64_t (*external_sync_from)(struct usfstl_scheduler *sched);
+	void (*external_sync_update)(struct usfstl_scheduler *sched);
 	void (*time_advanced)(struct usfstl_scheduler *, uint64_t delta);
 
 /* private: */
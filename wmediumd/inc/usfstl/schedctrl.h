@@ -5,19 +5,65 @@
  */
 #ifndef _USFSTL_SCHEDCTRL_H_
 #define _USFSTL_SCHEDCTRL_H_
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include "loop.h"
 #include "sched.h"
 
+#define USFSTL_SCHED_CTRL_HIST_BUCKETS	16
+
+/*
+ * Wall time spent on one kind of message to the controller, i.e. until
+ * its ACK, or just sending it if we don't wait for that. Bucket 0 of
+ * the histogram counts those that took less than 1 usec, bucket i
+ * those less than 2^i usec, the last one also all that took longer.
+ */
+struct usfstl_sched_ctrl_op_stats {
+	uint64_t count;
+	uint64_t total_ns, max_ns;
+	uint64_t hist[USFSTL_SCHED_CTRL_HIST_BUCKETS];
+};
+
+struct usfstl_sched_ctrl_stats {
+	/* UM_TIMETRAVEL_UPDATE messages not sent as the time was known */
+	uint64_t updates_elided;
+	/* UM_TIMETRAVEL_GET messages not sent, see sync_from() */
+	uint64_t gets_elided;
+	struct usfstl_sched_ctrl_op_stats request, wait, update, get;
+	/* wall time from WAIT until RUN, and from RUN until the next WAIT */
+	uint64_t wait_ns, run_ns;
+	/* UM_TIMETRAVEL_RUN and UM_TIMETRAVEL_FREE_UNTIL messages received */
+	uint64_t runs, free_untils;
+};
+
+struct um_timetravel_schedshm;
+
 struct usfstl_sched_ctrl {
 	struct usfstl_scheduler *sched;
 	uint64_t ack_time;
 	int64_t offset;
 	uint32_t nsec_per_tick;
 	int fd;
-	unsigned int waiting:1, acked:1, frozen:1, started:1;
+	unsigned int waiting:1, frozen:1, started:1;
+	/*
+	 * Only WAIT, GET (and START, UPDATE) wait for their ACK, requests
+	 * made while running are sent without and may be outstanding
+	 * while we continue.
+	 */
+	uint32_t seq, acked_seq;
 	uint32_t expected_ack_seq;
+	/* the controller's current time (in nsec), if time_known */
+	uint64_t known_time;
+	unsigned int time_known:1;
+	struct usfstl_sched_ctrl_stats stats;
+	/* wall time (in nsec) we last started or stopped waiting */
+	uint64_t phase_start;
+	/* shared memory, if the controller offered it with the START ACK */
+	struct um_timetravel_schedshm *shm;
+	size_t shm_len;
+	int shm_fd;
+	uint16_t shm_id;
 };
 
 void usfstl_sched_ctrl_start(struct usfstl_sched_ctrl *ctrl,
@@ -25,7 +71,35 @@ void usfstl_sched_ctrl_start(struct usfstl_sched_ctrl *ctrl,
 			     uint32_t nsec_per_tick,
 			     uint64_t client_id,
 			     struct usfstl_scheduler *sched);
+
+/**
+ * usfstl_sched_ctrl_sync_to - update the controller's time
+ * @ctrl: scheduler control
+ *
+ * Tell the controller about our current time, e.g. before sending
+ * something to another participant. With shared memory this is just
+ * a store while we're running.
+ */
 void usfstl_sched_ctrl_sync_to(struct usfstl_sched_ctrl *ctrl);
+
+/**
+ * usfstl_sched_ctrl_sync_from - update the scheduler's time
+ * @ctrl: scheduler control
+ *
+ * Get the current time from the controller, e.g. before scheduling
+ * something relative to "now" in response to another participant.
+ *
+ * This is only a round trip while we're waiting, since then others
+ * run and the time may have moved. While we're running it returns
+ * right away: the time is either exactly the controller's (we were
+ * told to run at it, or told the controller about it), or a later
+ * one we ran to on our own inside the FREE_UNTIL window, which is
+ * ours to schedule in. In the latter case, a message another free
+ * running participant sent at a later time than ours is taken as if
+ * sent at ours, i.e. it's off by at most the rest of the window.
+ * With shared memory, the time is read from there instead of asked
+ * for, so it's never a round trip.
+ */
 void usfstl_sched_ctrl_sync_from(struct usfstl_sched_ctrl *ctrl);
 void usfstl_sched_ctrl_stop(struct usfstl_sched_ctrl *ctrl);
 
@@ -16,9 +16,37 @@ struct usfstl_vhost_user_buf {
 	struct iovec *in_sg, *out_sg;
 	size_t written;
 	unsigned int idx;
+	/* ring descriptors the buffer took (packed ring) */
+	unsigned int n_descs;
 	bool allocated;
 };
 
+/**
+ * struct usfstl_vhost_user_vq_stats - virtqueue statistics
+ * @kicks: notifications received from the driver
+ * @avail: buffers taken from the available ring
+ * @used: buffers returned to the driver in the used ring
+ * @calls: notifications sent to the driver
+ * @calls_suppressed: notifications not sent since the driver didn't
+ *	ask for them (with %VIRTIO_RING_F_EVENT_IDX)
+ * @dropped: messages dropped since the vring wasn't enabled, or the
+ *	driver had no buffers posted and the backlog was full
+ * @backlogged: messages that had to wait for the driver to post buffers
+ * @backlog: messages currently waiting
+ * @backlog_max: the most messages that were waiting at the same time
+ */
+struct usfstl_vhost_user_vq_stats {
+	uint64_t kicks;
+	uint64_t avail;
+	uint64_t used;
+	uint64_t calls;
+	uint64_t calls_suppressed;
+	uint64_t dropped;
+	uint64_t backlogged;
+	unsigned int backlog;
+	unsigned int backlog_max;
+};
+
 struct usfstl_vhost_user_dev {
 	uint64_t features, protocol_features;
 	struct usfstl_vhost_user_server *server;
@@ -76,6 +104,37 @@ struct usfstl_vhost_user_server {
 	 */
 	struct usfstl_sched_ctrl *ctrl;
 
+	/**
+	 * @batch_notify: if set, usfstl_vhost_user_dev_notify() and
+	 *	usfstl_vhost_user_dev_notify_iov() only fill the buffer,
+	 *	it's returned to the driver (together with all others
+	 *	since) by usfstl_vhost_user_dev_flush()
+	 */
+	bool batch_notify;
+
+	/**
+	 * @rx_backlog: number of messages to keep per vring when the
+	 *	driver has no buffers posted, they're delivered when it
+	 *	kicks after posting some; 0 drops them right away
+	 */
+	unsigned int rx_backlog;
+
+	/**
+	 * @poll: poll the input queues of all devices from the main
+	 *	loop instead of waiting for kicks, and tell the drivers
+	 *	that they needn't kick. This uses a CPU (mostly) for
+	 *	itself. With @ctrl, the drivers are still asked to kick,
+	 *	buffers found by polling are handled like kicked ones.
+	 */
+	bool poll;
+
+	/**
+	 * @poll_max_idle_usec: with @poll, the longest time to sleep
+	 *	when there's no work, i.e. the worst-case latency for
+	 *	noticing a new buffer (0 means to never sleep)
+	 */
+	unsigned int poll_max_idle_usec;
+
 	/**
 	 * @features: user features
 	 */
@@ -127,6 +186,55 @@ void usfstl_vhost_user_dev_notify(struct usfstl_vhost_user_dev *dev,
 				  unsigned int vring,
 				  const uint8_t *buf, size_t buflen);
 
+/**
+ * usfstl_vhost_user_dev_notify_iov - send a message on a vring
+ * @dev: device to send to
+ * @vring: vring index to send on
+ * @data: pieces of the message, copied back to back into the
+ *	guest's buffer without assembling them first
+ * @n_data: number of entries in @data
+ *
+ * If the driver has no buffer posted, the message is copied to the
+ * backlog (see @rx_backlog in the server) or dropped.
+ */
+void usfstl_vhost_user_dev_notify_iov(struct usfstl_vhost_user_dev *dev,
+				      unsigned int vring,
+				      const struct iovec *data,
+				      unsigned int n_data);
+
+/**
+ * usfstl_vhost_user_dev_flush - return filled buffers to the driver
+ * @dev: device to flush
+ * @vring: vring index to flush
+ *
+ * Publishes all buffers filled since the last flush with a single
+ * update of the used index, and notifies the driver (at most) once.
+ * Only needed with @batch_notify in the server.
+ */
+void usfstl_vhost_user_dev_flush(struct usfstl_vhost_user_dev *dev,
+				 unsigned int vring);
+
+/**
+ * usfstl_vhost_user_dev_vring_enabled - check if a vring is in use
+ * @dev: device to check
+ * @vring: vring index
+ *
+ * Returns whether the driver set up and enabled the vring, e.g. a
+ * driver may use fewer queues than advertised with multiqueue.
+ */
+bool usfstl_vhost_user_dev_vring_enabled(struct usfstl_vhost_user_dev *dev,
+					 unsigned int vring);
+
+/**
+ * usfstl_vhost_user_get_vq_stats - get virtqueue statistics
+ * @dev: device to get the statistics for
+ * @vring: vring index
+ * @stats: statistics are copied here
+ */
+void usfstl_vhost_user_get_vq_stats(struct usfstl_vhost_user_dev *dev,
+				    unsigned int vring,
+				    struct usfstl_vhost_user_vq_stats *stats);
+
 /**
  * usfstl_vhost_user_config_changed - notify host of a config change event
  * @dev: device to send to
@@ -151,6 +259,8 @@ void *usfstl_vhost_phys_to_va(struct usfstl_vhost_user_dev *dev, uint64_t addr);
 size_t iov_len(struct iovec *sg, unsigned int nsg);
 size_t iov_fill(struct iovec *sg, unsigned int nsg,
 		const void *buf, size_t buflen);
+size_t iov_fill_offset(struct iovec *sg, unsigned int nsg, size_t offset,
+		       const void *buf, size_t buflen);
 size_t iov_read(void *buf, size_t buflen,
 		struct iovec *sg, unsigned int nsg);
 
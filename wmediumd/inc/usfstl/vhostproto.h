@@ -63,6 +63,12 @@ struct vhost_user_msg {
 			uint64_t size;
 			uint64_t offset;
 		} vring_area;
+		struct {
+			uint64_t mmap_size;
+			uint64_t mmap_offset;
+			uint16_t num_queues;
+			uint16_t queue_size;
+		} inflight;
 	} __attribute__((packed)) payload;
 };
 
@@ -73,13 +79,17 @@ struct vhost_user_msg {
 #define VHOST_USER_SET_VRING_NUM		 8
 #define VHOST_USER_SET_VRING_ADDR		 9
 #define VHOST_USER_SET_VRING_BASE		10
+#define VHOST_USER_GET_VRING_BASE		11
 #define VHOST_USER_SET_VRING_KICK		12
 #define VHOST_USER_SET_VRING_CALL		13
 #define VHOST_USER_GET_PROTOCOL_FEATURES	15
 #define VHOST_USER_SET_VRING_ENABLE		18
 #define VHOST_USER_SET_PROTOCOL_FEATURES	16
+#define VHOST_USER_GET_QUEUE_NUM		17
 #define VHOST_USER_SET_SLAVE_REQ_FD		21
 #define VHOST_USER_GET_CONFIG			24
+#define VHOST_USER_GET_INFLIGHT_FD		31
+#define VHOST_USER_SET_INFLIGHT_FD		32
 #define VHOST_USER_VRING_KICK			35
 
 #define VHOST_USER_SLAVE_CONFIG_CHANGE_MSG	 2
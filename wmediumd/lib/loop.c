@@ -19,8 +19,15 @@
 #include <sys/select.h>
 #endif
 
+/* idle rounds before backing off, and the first sleep after that */
+#define USFSTL_LOOP_POLL_SPIN		1000
+#define USFSTL_LOOP_POLL_MIN_SLEEP	1
+
 struct usfstl_list g_usfstl_loop_entries =
 	USFSTL_LIST_INIT(g_usfstl_loop_entries);
+struct usfstl_list g_usfstl_loop_pollers =
+	USFSTL_LIST_INIT(g_usfstl_loop_pollers);
+static unsigned int usfstl_loop_poll_idle;
 void (*g_usfstl_loop_pre_handler_fn)(void *);
 void *g_usfstl_loop_pre_handler_fn_data;
 
@@ -44,37 +51,132 @@ void usfstl_loop_unregister(struct usfstl_loop_entry *entry)
 	usfstl_list_item_remove(&entry->list);
 }
 
+void usfstl_loop_register_poller(struct usfstl_loop_poller *poller)
+{
+	usfstl_list_append(&g_usfstl_loop_pollers, &poller->list);
+}
+
+void usfstl_loop_unregister_poller(struct usfstl_loop_poller *poller)
+{
+	usfstl_list_item_remove(&poller->list);
+}
+
+/*
+ * Run the first poller that has work, return whether there was one.
+ * Otherwise, return the time to wait in select() in @tv. The poller
+ * that ran goes to the end of the list, so a busy one can't keep the
+ * others from running.
+ */
+static bool usfstl_loop_poll(struct timeval *tv)
+{
+	struct usfstl_loop_poller *poller;
+	unsigned int sleep, max_sleep = ~0U;
+
+	usfstl_for_each_list_item(poller, &g_usfstl_loop_pollers, list) {
+		void *data = g_usfstl_loop_pre_handler_fn_data;
+
+		if (poller->max_idle_usec < max_sleep)
+			max_sleep = poller->max_idle_usec;
+
+		if (!poller->pending(poller))
+			continue;
+
+		usfstl_list_item_remove(&poller->list);
+		usfstl_list_append(&g_usfstl_loop_pollers, &poller->list);
+
+		usfstl_loop_poll_idle = 0;
+		if (g_usfstl_loop_pre_handler_fn)
+			g_usfstl_loop_pre_handler_fn(data);
+		poller->handle(poller);
+		return true;
+	}
+
+	/* spin for a while, then sleep exponentially longer */
+	sleep = 0;
+	if (usfstl_loop_poll_idle >= USFSTL_LOOP_POLL_SPIN) {
+		unsigned int shift = usfstl_loop_poll_idle - USFSTL_LOOP_POLL_SPIN;
+
+		sleep = USFSTL_LOOP_POLL_MIN_SLEEP << (shift < 20 ? shift : 20);
+		if (sleep > max_sleep)
+			sleep = max_sleep;
+	}
+	usfstl_loop_poll_idle++;
+
+	tv->tv_sec = sleep / 1000000;
+	tv->tv_usec = sleep % 1000000;
+	return false;
+}
+
+/*
+ * Wait for the file descriptors (at most @timeout, unless it's %NULL)
+ * and handle the first one that's ready, return whether there was one.
+ */
+static bool usfstl_loop_select(struct timeval *timeout)
+{
+	struct usfstl_loop_entry *tmp;
+	fd_set rd_set, exc_set;
+	unsigned int max = 0;
+	int num;
+
+	FD_ZERO(&rd_set);
+	FD_ZERO(&exc_set);
+
+	usfstl_loop_for_each_entry(tmp) {
+		FD_SET(tmp->fd, &rd_set);
+		FD_SET(tmp->fd, &exc_set);
+		if ((unsigned int)tmp->fd > max)
+			max = tmp->fd;
+	}
+
+	num = select(max + 1, &rd_set, NULL, &exc_set, timeout);
+	if (num == 0 && timeout)
+		return false;
+	assert(num > 0);
+
+	usfstl_loop_for_each_entry(tmp) {
+		void *data = g_usfstl_loop_pre_handler_fn_data;
+
+		if (!FD_ISSET(tmp->fd, &rd_set) &&
+		    !FD_ISSET(tmp->fd, &exc_set))
+			continue;
+
+		if (g_usfstl_loop_pre_handler_fn)
+			g_usfstl_loop_pre_handler_fn(data);
+		tmp->handler(tmp);
+		return true;
+	}
+
+	return false;
+}
+
 void usfstl_loop_wait_and_handle(void)
 {
-	while (true) {
-		struct usfstl_loop_entry *tmp;
-		fd_set rd_set, exc_set;
-		unsigned int max = 0, num;
-
-		FD_ZERO(&rd_set);
-		FD_ZERO(&exc_set);
-
-		usfstl_loop_for_each_entry(tmp) {
-			FD_SET(tmp->fd, &rd_set);
-			FD_SET(tmp->fd, &exc_set);
-			if ((unsigned int)tmp->fd > max)
-				max = tmp->fd;
-		}
+	/* whether a poller ran last time, so the fds get their turn now */
+	static bool polled;
 
-		num = select(max + 1, &rd_set, NULL, &exc_set, NULL);
-		assert(num > 0);
+	while (true) {
+		struct timeval tv;
 
-		usfstl_loop_for_each_entry(tmp) {
-			void *data = g_usfstl_loop_pre_handler_fn_data;
+		if (usfstl_list_empty(&g_usfstl_loop_pollers)) {
+			if (usfstl_loop_select(NULL))
+				return;
+			continue;
+		}
 
-			if (!FD_ISSET(tmp->fd, &rd_set) &&
-			    !FD_ISSET(tmp->fd, &exc_set))
-				continue;
+		if (polled) {
+			polled = false;
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			if (usfstl_loop_select(&tv))
+				return;
+		}
 
-			if (g_usfstl_loop_pre_handler_fn)
-				g_usfstl_loop_pre_handler_fn(data);
-			tmp->handler(tmp);
+		if (usfstl_loop_poll(&tv)) {
+			polled = true;
 			return;
 		}
+
+		if (usfstl_loop_select(&tv))
+			return;
 	}
 }
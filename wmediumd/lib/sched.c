@@ -31,6 +31,9 @@ static bool usfstl_sched_external_request(struct usfstl_scheduler *sched,
 	if (!sched->external_request)
 		return false;
 
+	if (!sched->waiting && sched->external_sync_update)
+		sched->external_sync_update(sched);
+
 	/*
 	 * If we received a next_external_sync point, we don't need to ask for
 	 * runtime for anything earlier than that point, we're allowed to run.
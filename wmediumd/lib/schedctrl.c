@@ -9,6 +9,26 @@
 #include "internal.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+/*
+ * Messages we don't wait for the ACK of, at most; beyond that we'd risk
+ * both sides blocking on full socket buffers, writing to each other.
+ */
+#define USFSTL_SCHED_CTRL_MAX_UNACKED	64
+
+/*
+ * The controller handles our messages in order, so the ACKs come in
+ * order too, and everything up to the last one was handled.
+ */
+static bool usfstl_sched_ctrl_acked(struct usfstl_sched_ctrl *ctrl,
+				    uint32_t seq)
+{
+	return (int32_t)(ctrl->acked_seq - seq) >= 0;
+}
 
 static void _usfstl_sched_ctrl_send_msg(struct usfstl_sched_ctrl *ctrl,
 					enum um_timetravel_ops op,
@@ -24,33 +44,278 @@ static void _usfstl_sched_ctrl_send_msg(struct usfstl_sched_ctrl *ctrl,
 			 (int)sizeof(msg), "%d");
 }
 
+static uint64_t usfstl_sched_ctrl_now(void)
+{
+	struct timespec now = {};
+
+	USFSTL_ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &now), 0, "%d");
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct usfstl_sched_ctrl_op_stats *
+usfstl_sched_ctrl_op_stats(struct usfstl_sched_ctrl *ctrl,
+			   enum um_timetravel_ops op)
+{
+	switch (op) {
+	case UM_TIMETRAVEL_REQUEST:
+		return &ctrl->stats.request;
+	case UM_TIMETRAVEL_WAIT:
+		return &ctrl->stats.wait;
+	case UM_TIMETRAVEL_UPDATE:
+		return &ctrl->stats.update;
+	case UM_TIMETRAVEL_GET:
+		return &ctrl->stats.get;
+	default:
+		return NULL;
+	}
+}
+
+static void usfstl_sched_ctrl_account(struct usfstl_sched_ctrl *ctrl,
+				      enum um_timetravel_ops op,
+				      uint64_t start)
+{
+	struct usfstl_sched_ctrl_op_stats *stats;
+	uint64_t ns = usfstl_sched_ctrl_now() - start;
+	uint64_t usec = ns / 1000;
+	unsigned int bucket = 0;
+
+	stats = usfstl_sched_ctrl_op_stats(ctrl, op);
+	if (!stats)
+		return;
+
+	while (usec && bucket < USFSTL_SCHED_CTRL_HIST_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+
+	stats->count++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	stats->hist[bucket]++;
+}
+
+/* switch between waiting and running, accounting for the time until now */
+static void usfstl_sched_ctrl_phase(struct usfstl_sched_ctrl *ctrl,
+				    bool waiting)
+{
+	uint64_t now = usfstl_sched_ctrl_now();
+
+	if (waiting)
+		ctrl->stats.run_ns += now - ctrl->phase_start;
+	else
+		ctrl->stats.wait_ns += now - ctrl->phase_start;
+	ctrl->phase_start = now;
+}
+
+static union um_timetravel_schedshm_client *
+usfstl_sched_ctrl_shm_client(struct usfstl_sched_ctrl *ctrl, uint16_t id)
+{
+	size_t len;
+	void *shm;
+
+	/* the controller grows it as clients connect, so we may need to remap */
+	if (sizeof(*ctrl->shm) + (id + 1) * sizeof(ctrl->shm->clients[0]) >
+	    ctrl->shm_len) {
+		len = ctrl->shm->len;
+		shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   ctrl->shm_fd, 0);
+		USFSTL_ASSERT(shm != MAP_FAILED);
+		munmap(ctrl->shm, ctrl->shm_len);
+		ctrl->shm = shm;
+		ctrl->shm_len = len;
+	}
+
+	USFSTL_ASSERT(sizeof(*ctrl->shm) +
+		      (id + 1) * sizeof(ctrl->shm->clients[0]) <= ctrl->shm_len);
+
+	return &ctrl->shm->clients[id];
+}
+
+static bool usfstl_sched_ctrl_shm_running(struct usfstl_sched_ctrl *ctrl)
+{
+	return ctrl->shm && !ctrl->waiting &&
+	       ctrl->shm->running_id == ctrl->shm_id;
+}
+
+static void usfstl_sched_ctrl_shm_init(struct usfstl_sched_ctrl *ctrl,
+				       uint64_t client_id)
+{
+	union um_timetravel_schedshm_client *client;
+	struct um_timetravel_schedshm *shm;
+	size_t len = sizeof(*shm);
+
+	/* map the header first, it tells us how long the whole thing is */
+	shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   ctrl->shm_fd, 0);
+	if (shm == MAP_FAILED)
+		goto fallback;
+
+	if (shm->version != UM_TIMETRAVEL_SCHEDSHM_VERSION) {
+		munmap(shm, len);
+		goto fallback;
+	}
+
+	ctrl->shm = shm;
+	ctrl->shm_len = len;
+	ctrl->shm_id = ctrl->ack_time & UM_TIMETRAVEL_START_ACK_ID;
+
+	client = usfstl_sched_ctrl_shm_client(ctrl, ctrl->shm_id);
+	client->name = client_id;
+	client->capa |= UM_TIMETRAVEL_SCHEDSHM_CAP_TIME_SHARE;
+	return;
+fallback:
+	/* without the capability set, the controller keeps using messages */
+	close(ctrl->shm_fd);
+	ctrl->shm_fd = -1;
+}
+
+static void usfstl_sched_ctrl_set_remote_time(struct usfstl_sched_ctrl *ctrl,
+					      uint64_t remote)
+{
+	if (ctrl->frozen) {
+		uint64_t local;
+
+		local = ctrl->sched->current_time * ctrl->nsec_per_tick;
+		ctrl->offset = remote - local;
+	} else {
+		uint64_t time;
+
+		time = DIV_ROUND_UP(remote - ctrl->offset, ctrl->nsec_per_tick);
+		usfstl_sched_set_time(ctrl->sched, time);
+	}
+
+	ctrl->known_time = remote;
+	ctrl->time_known = 1;
+}
+
+static void usfstl_sched_ctrl_sync_update(struct usfstl_scheduler *sched)
+{
+	struct usfstl_sched_ctrl *ctrl = sched->ext.ctrl;
+	int64_t free_until;
+	uint64_t time;
+
+	if (!ctrl->shm)
+		return;
+
+	/*
+	 * Others lower free_until when they make a request while we run,
+	 * e.g. in response to something we sent them, without telling us.
+	 */
+	free_until = ctrl->shm->free_until - ctrl->offset;
+	if (free_until < 0) {
+		sched->next_external_sync_set = 0;
+		return;
+	}
+
+	/* round down here, so we don't overshoot */
+	time = free_until / ctrl->nsec_per_tick;
+	if (usfstl_time_cmp(time, <, sched->current_time))
+		sched->next_external_sync_set = 0;
+	else
+		usfstl_sched_set_sync_time(sched, time);
+}
+
+static int usfstl_sched_ctrl_recv(int fd, struct um_timetravel_msg *msg,
+				  int *fds, int max_fds)
+{
+	uint8_t msg_control[CMSG_SPACE(sizeof(int) *
+				       UM_TIMETRAVEL_SHARED_MAX_FDS)] = { 0 };
+	struct iovec msg_iov = {
+		.iov_base = msg,
+		.iov_len = sizeof(*msg),
+	};
+	struct msghdr msghdr = {
+		.msg_iov = &msg_iov,
+		.msg_iovlen = 1,
+		.msg_control = msg_control,
+		.msg_controllen = sizeof(msg_control),
+	};
+	struct cmsghdr *cmsg;
+	int n_fds = 0;
+
+	USFSTL_ASSERT_EQ((int)recvmsg(fd, &msghdr, MSG_CMSG_CLOEXEC),
+			 (int)sizeof(*msg), "%d");
+
+	for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg;
+	     cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		USFSTL_ASSERT(n_fds <= max_fds);
+		memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+		break;
+	}
+
+	return n_fds;
+}
+
 static void usfstl_sched_ctrl_sock_read(int fd, void *data)
 {
 	struct usfstl_sched_ctrl *ctrl = data;
+	int fds[UM_TIMETRAVEL_SHARED_MAX_FDS];
 	struct um_timetravel_msg msg;
-	int sz = read(fd, &msg, sizeof(msg));
+	int n_fds, i;
 	uint64_t time;
 
-	USFSTL_ASSERT_EQ(sz, (int)sizeof(msg), "%d");
+	n_fds = usfstl_sched_ctrl_recv(fd, &msg, fds,
+				       UM_TIMETRAVEL_SHARED_MAX_FDS);
+
+	/* only the ACK to START carries fds, we only use the memfd */
+	if (msg.op == UM_TIMETRAVEL_ACK && !ctrl->started &&
+	    msg.seq == ctrl->expected_ack_seq &&
+	    n_fds > UM_TIMETRAVEL_SHARED_MEMFD) {
+		ctrl->shm_fd = fds[UM_TIMETRAVEL_SHARED_MEMFD];
+		fds[UM_TIMETRAVEL_SHARED_MEMFD] = -1;
+	}
+
+	for (i = 0; i < n_fds; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
 
 	switch (msg.op) {
 	case UM_TIMETRAVEL_ACK:
-		if (msg.seq == ctrl->expected_ack_seq) {
-			ctrl->acked = 1;
+		if (!usfstl_sched_ctrl_acked(ctrl, msg.seq))
+			ctrl->acked_seq = msg.seq;
+		if (msg.seq == ctrl->expected_ack_seq)
 			ctrl->ack_time = msg.time;
-		}
 		return;
 	case UM_TIMETRAVEL_RUN:
 		time = DIV_ROUND_UP(msg.time - ctrl->offset,
 				    ctrl->nsec_per_tick);
 		usfstl_sched_set_time(ctrl->sched, time);
 		ctrl->waiting = 0;
+		ctrl->known_time = msg.time;
+		ctrl->time_known = 1;
+		ctrl->stats.runs++;
+		/*
+		 * With shared memory, the request was granted, so take it
+		 * out (the controller would otherwise still see it when
+		 * computing free_until), and it doesn't want an ACK.
+		 */
+		if (ctrl->shm) {
+			usfstl_sched_ctrl_shm_client(ctrl, ctrl->shm_id)->flags &=
+				~UM_TIMETRAVEL_SCHEDSHM_FLAGS_REQ_RUN;
+			return;
+		}
 		break;
 	case UM_TIMETRAVEL_FREE_UNTIL:
+		ctrl->stats.free_untils++;
+		/* not used with shared memory, free_until is there */
+		if (ctrl->shm)
+			break;
 		/* round down here, so we don't overshoot */
 		time = (msg.time - ctrl->offset) / ctrl->nsec_per_tick;
 		usfstl_sched_set_sync_time(ctrl->sched, time);
 		break;
+	case UM_TIMETRAVEL_BROADCAST:
+		/* nothing to do with it, but it needs the ACK */
+		break;
 	case UM_TIMETRAVEL_START:
 	case UM_TIMETRAVEL_REQUEST:
 	case UM_TIMETRAVEL_WAIT:
@@ -68,18 +333,41 @@ static void usfstl_sched_ctrl_send_msg(struct usfstl_sched_ctrl *ctrl,
 				       enum um_timetravel_ops op,
 				       uint64_t time)
 {
-	static uint32_t seq, old_expected;
+	uint64_t start = usfstl_sched_ctrl_now();
+	uint32_t seq, old_expected;
+
+	while (ctrl->seq - ctrl->acked_seq >= USFSTL_SCHED_CTRL_MAX_UNACKED)
+		usfstl_loop_wait_and_handle();
 
 	do {
-		seq++;
+		seq = ++ctrl->seq;
 	} while (seq == 0);
 
 	_usfstl_sched_ctrl_send_msg(ctrl, op, time, seq);
+
+	/*
+	 * While we're running, a request only matters to the controller
+	 * once we wait, and it handles that after the request, so don't
+	 * stall on it. The ACK is picked up whenever we next read from
+	 * the socket.
+	 *
+	 * While we're waiting, we're handling a message from another
+	 * participant (e.g. a vhost-user kick), and once we reply that
+	 * one may WAIT on its own socket; the controller could handle
+	 * that first and move the time past our request. The same holds
+	 * for UPDATE even if the ACK carries nothing: we're about to hand
+	 * the time to another participant, which may ask the controller
+	 * for it, so the controller must have it first. With shared
+	 * memory both are just stores.
+	 */
+	if (op == UM_TIMETRAVEL_REQUEST && !ctrl->waiting) {
+		usfstl_sched_ctrl_account(ctrl, op, start);
+		return;
+	}
+
 	old_expected = ctrl->expected_ack_seq;
 	ctrl->expected_ack_seq = seq;
 
-	USFSTL_ASSERT_EQ((int)ctrl->acked, 0, "%d");
-
 	/*
 	 * Race alert!
 	 *
@@ -95,43 +383,52 @@ static void usfstl_sched_ctrl_send_msg(struct usfstl_sched_ctrl *ctrl,
 	 * (host) kernel's message ordering and select() handling etc.
 	 *
 	 * To avoid this, directly read the ACK message for the WAIT,
-	 * without handling any other sockets (first).
+	 * without handling any other sockets (first). Any ACKs still
+	 * outstanding for requests come before it.
 	 */
 	if (op == UM_TIMETRAVEL_WAIT) {
-		usfstl_sched_ctrl_sock_read(ctrl->fd, ctrl);
-		USFSTL_ASSERT(ctrl->acked);
+		while (!usfstl_sched_ctrl_acked(ctrl, seq))
+			usfstl_sched_ctrl_sock_read(ctrl->fd, ctrl);
 	}
 
-	while (!ctrl->acked)
+	while (!usfstl_sched_ctrl_acked(ctrl, seq))
 		usfstl_loop_wait_and_handle();
-	ctrl->acked = 0;
 	ctrl->expected_ack_seq = old_expected;
+	usfstl_sched_ctrl_account(ctrl, op, start);
 
-	if (op == UM_TIMETRAVEL_GET) {
-		if (ctrl->frozen) {
-			uint64_t local;
-
-			local = ctrl->sched->current_time * ctrl->nsec_per_tick;
-			ctrl->offset = ctrl->ack_time - local;
-		} else {
-			uint64_t time;
-
-			time = DIV_ROUND_UP(ctrl->ack_time - ctrl->offset,
-					    ctrl->nsec_per_tick);
-			usfstl_sched_set_time(ctrl->sched, time);
-		}
-	}
+	if (op == UM_TIMETRAVEL_GET)
+		usfstl_sched_ctrl_set_remote_time(ctrl, ctrl->ack_time);
 }
 
 static void usfstl_sched_ctrl_request(struct usfstl_scheduler *sched, uint64_t time)
 {
 	struct usfstl_sched_ctrl *ctrl = sched->ext.ctrl;
+	union um_timetravel_schedshm_client *client, *running;
 
 	if (!ctrl->started)
 		return;
 
-	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_REQUEST,
-				   time * ctrl->nsec_per_tick + ctrl->offset);
+	time = time * ctrl->nsec_per_tick + ctrl->offset;
+
+	/*
+	 * The request can go into shared memory if whoever is running
+	 * (possibly us) reads it from there, otherwise it must be told.
+	 */
+	if (ctrl->shm) {
+		running = usfstl_sched_ctrl_shm_client(ctrl,
+						       ctrl->shm->running_id);
+		if (running->capa & UM_TIMETRAVEL_SCHEDSHM_CAP_TIME_SHARE) {
+			client = usfstl_sched_ctrl_shm_client(ctrl,
+							      ctrl->shm_id);
+			client->req_time = time;
+			client->flags |= UM_TIMETRAVEL_SCHEDSHM_FLAGS_REQ_RUN;
+			if (time < ctrl->shm->free_until)
+				ctrl->shm->free_until = time;
+			return;
+		}
+	}
+
+	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_REQUEST, time);
 }
 
 static void usfstl_sched_ctrl_wait(struct usfstl_scheduler *sched)
@@ -139,10 +436,14 @@ static void usfstl_sched_ctrl_wait(struct usfstl_scheduler *sched)
 	struct usfstl_sched_ctrl *ctrl = sched->ext.ctrl;
 
 	ctrl->waiting = 1;
+	/* others may run now, so the time may change under us */
+	ctrl->time_known = 0;
+	usfstl_sched_ctrl_phase(ctrl, true);
 	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_WAIT, -1);
 
 	while (ctrl->waiting)
 		usfstl_loop_wait_and_handle();
+	usfstl_sched_ctrl_phase(ctrl, false);
 }
 
 #define JOB_ASSERT_VAL(j) (j) ? (j)->name : "<NULL>"
@@ -159,6 +460,7 @@ void usfstl_sched_ctrl_start(struct usfstl_sched_ctrl *ctrl,
 	USFSTL_ASSERT_EQ(sched->ext.ctrl, NULL, "%p");
 
 	memset(ctrl, 0, sizeof(*ctrl));
+	ctrl->shm_fd = -1;
 
 	/*
 	 * The remote side assumes we start at 0, so if we don't have 0 right
@@ -174,22 +476,31 @@ void usfstl_sched_ctrl_start(struct usfstl_sched_ctrl *ctrl,
 			 (struct usfstl_job *)NULL, "%s", JOB_ASSERT_VAL);
 	USFSTL_ASSERT_EQ(sched->external_request, NULL, "%p");
 	USFSTL_ASSERT_EQ(sched->external_wait, NULL, "%p");
+	USFSTL_ASSERT_EQ(sched->external_sync_update, NULL, "%p");
 
 	sched->external_request = usfstl_sched_ctrl_request;
 	sched->external_wait = usfstl_sched_ctrl_wait;
+	sched->external_sync_update = usfstl_sched_ctrl_sync_update;
 
 	ctrl->fd = usfstl_uds_connect(socket, usfstl_sched_ctrl_sock_read,
 				      ctrl);
 
 	/* tell the other side we're starting  */
 	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_START, client_id);
+
+	/*
+	 * If the controller sent shared memory with the ACK, use it; this
+	 * must be set up before sending anything else to the controller.
+	 */
+	if (ctrl->shm_fd >= 0)
+		usfstl_sched_ctrl_shm_init(ctrl, client_id);
 	ctrl->started = 1;
+	ctrl->phase_start = usfstl_sched_ctrl_now();
 
 	/* if we have a job already, request it */
 	job = usfstl_sched_next_pending(sched, NULL);
 	if (job)
-		usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_REQUEST,
-					   job->start * nsec_per_tick);
+		usfstl_sched_ctrl_request(sched, job->start);
 
 	/*
 	 * At this point, we're allowed to do further setup work and can
@@ -207,13 +518,52 @@ void usfstl_sched_ctrl_sync_to(struct usfstl_sched_ctrl *ctrl)
 	time = usfstl_sched_current_time(ctrl->sched) * ctrl->nsec_per_tick;
 	time += ctrl->offset;
 
+	/* only the running participant may (and need to) set the time */
+	if (usfstl_sched_ctrl_shm_running(ctrl)) {
+		ctrl->shm->current_time = time;
+		ctrl->known_time = time;
+		ctrl->time_known = 1;
+		return;
+	}
+
+	/*
+	 * Only the participant that's running moves the time, so while
+	 * we are, the controller's time is what we last told it (or it
+	 * told us) and updating it again is just a round trip.
+	 */
+	if (ctrl->time_known && !ctrl->waiting && time == ctrl->known_time) {
+		ctrl->stats.updates_elided++;
+		return;
+	}
+
 	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_UPDATE, time);
+	ctrl->known_time = time;
+	ctrl->time_known = 1;
 }
 
 void usfstl_sched_ctrl_sync_from(struct usfstl_sched_ctrl *ctrl)
 {
+	struct usfstl_scheduler *sched = ctrl->sched;
+
 	if (!ctrl->started)
 		return;
+
+	/* see the documentation for the accuracy this has */
+	if (!ctrl->waiting &&
+	    (ctrl->time_known ||
+	     (sched->next_external_sync_set &&
+	      usfstl_time_cmp(sched->current_time, <,
+			      sched->next_external_sync)))) {
+		ctrl->stats.gets_elided++;
+		return;
+	}
+
+	if (ctrl->shm) {
+		usfstl_sched_ctrl_set_remote_time(ctrl,
+						  ctrl->shm->current_time);
+		return;
+	}
+
 	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_GET, -1);
 }
 
@@ -222,9 +572,18 @@ void usfstl_sched_ctrl_stop(struct usfstl_sched_ctrl *ctrl)
 	USFSTL_ASSERT_EQ(ctrl, ctrl->sched->ext.ctrl, "%p");
 	usfstl_sched_ctrl_send_msg(ctrl, UM_TIMETRAVEL_WAIT, -1);
 	usfstl_uds_disconnect(ctrl->fd);
+	if (ctrl->shm) {
+		munmap(ctrl->shm, ctrl->shm_len);
+		ctrl->shm = NULL;
+	}
+	if (ctrl->shm_fd >= 0) {
+		close(ctrl->shm_fd);
+		ctrl->shm_fd = -1;
+	}
 	ctrl->sched->ext.ctrl = NULL;
 	ctrl->sched->external_request = NULL;
 	ctrl->sched->external_wait = NULL;
+	ctrl->sched->external_sync_update = NULL;
 	ctrl->sched = NULL;
 }
 
@@ -3,6 +3,7 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#define _GNU_SOURCE /* memfd_create() */
 #include <stdlib.h>
 #include <usfstl/list.h>
 #include <usfstl/loop.h>
@@ -19,14 +20,47 @@
 
 /* copied from uapi */
 #define VIRTIO_F_VERSION_1		32
+#ifndef VIRTIO_F_RING_PACKED
+#define VIRTIO_F_RING_PACKED		34
+#endif
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER		35
+#endif
 
 #define MAX_REGIONS 8
 #define SG_STACK_PREALLOC 5
 
+/*
+ * Inflight descriptor tracking for split rings (see the vhost-user
+ * spec), shared with the frontend so it survives reconnecting.
+ */
+#define INFLIGHT_VERSION	1
+#define INFLIGHT_ALIGN		64
+
+struct usfstl_vhost_user_inflight_desc {
+	uint8_t inflight;
+	uint8_t padding[5];
+	uint16_t next;
+	uint64_t counter;
+};
+
+struct usfstl_vhost_user_inflight_queue {
+	uint64_t features;
+	uint16_t version;
+	uint16_t desc_num;
+	uint16_t last_batch_head;
+	uint16_t used_idx;
+	struct usfstl_vhost_user_inflight_desc desc[];
+};
+
 struct usfstl_vhost_user_dev_int {
 	struct usfstl_list fds;
 	struct usfstl_job irq_job;
 
+	/* on usfstl_vhost_user_polled_devs, with @poll in the server */
+	struct usfstl_list_entry poll_list;
+	bool polled;
+
 	struct usfstl_loop_entry entry;
 
 	struct usfstl_vhost_user_dev ext;
@@ -35,16 +69,50 @@ struct usfstl_vhost_user_dev_int {
 	struct vhost_user_region regions[MAX_REGIONS];
 	int region_fds[MAX_REGIONS];
 	void *region_vaddr[MAX_REGIONS];
+	/* consecutive lookups are usually in the same region */
+	unsigned int last_region;
+
+	/* inflight area, one queue region per virtqueue */
+	void *inflight;
+	size_t inflight_size, inflight_queue_size;
 
 	int req_fd;
 
-	struct {
+	struct usfstl_vhost_user_virtq {
 		struct usfstl_loop_entry entry;
 		bool enabled;
 		bool triggered;
 		struct vring virtq;
 		int call_fd;
 		uint16_t last_avail_idx;
+		/* next used entry, and the first one not published yet */
+		uint16_t used_idx, used_head;
+		unsigned int used_pending;
+		/* IN_ORDER: pending entry that unwritten buffers can share */
+		uint16_t used_run;
+		bool used_run_valid;
+		/* packed ring, used_head's flags are written on flush */
+		struct vring_packed_desc *packed_desc;
+		struct vring_packed_desc_event *driver_event, *device_event;
+		bool avail_wrap, used_wrap;
+		uint16_t used_head_flags;
+		struct usfstl_vhost_user_vq_stats stats;
+		/* messages waiting for the driver to post buffers */
+		struct usfstl_list backlog;
+		/* ring state given by the frontend, applied on SET_VRING_ADDR */
+		uint32_t base;
+		bool base_set;
+		/* stopped with GET_VRING_BASE, so the base is what we gave */
+		bool base_stopped;
+		/* inflight tracking, and heads to process again after it */
+		struct usfstl_vhost_user_inflight_queue *inflight;
+		uint64_t inflight_counter;
+		uint16_t *resubmit;
+		unsigned int n_resubmit, resubmit_pos;
+		/* reused for chains that don't fit the stack buffer */
+		struct usfstl_vhost_user_buf *big_buf;
+		unsigned int big_buf_max;
+		bool big_buf_busy;
 	} virtqs[];
 };
 
@@ -70,89 +138,401 @@ CONV(16)
 CONV(32)
 CONV(64)
 
+static bool usfstl_vhost_user_event_idx(struct usfstl_vhost_user_dev_int *dev)
+{
+	return dev->ext.features & (1ULL << VIRTIO_RING_F_EVENT_IDX);
+}
+
+static bool usfstl_vhost_user_packed(struct usfstl_vhost_user_dev_int *dev)
+{
+	return dev->ext.features & (1ULL << VIRTIO_F_RING_PACKED);
+}
+
+static bool usfstl_vhost_user_in_order(struct usfstl_vhost_user_dev_int *dev)
+{
+	return dev->ext.features & (1ULL << VIRTIO_F_IN_ORDER);
+}
+
+static bool usfstl_vhost_user_packed_desc_avail(uint16_t flags, bool wrap)
+{
+	return !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) == wrap &&
+	       !!(flags & (1 << VRING_PACKED_DESC_F_USED)) != wrap;
+}
+
+static bool usfstl_vhost_user_virtq_pending(struct usfstl_vhost_user_dev_int *dev,
+					    unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+
+	if (vq->resubmit_pos < vq->n_resubmit)
+		return true;
+
+	if (usfstl_vhost_user_packed(dev))
+		return usfstl_vhost_user_packed_desc_avail(
+			virtio_to_cpu16(dev,
+				vq->packed_desc[vq->last_avail_idx].flags),
+			vq->avail_wrap);
+
+	return virtio_to_cpu16(dev, vq->virtq.avail->idx) != vq->last_avail_idx;
+}
+
+/*
+ * With time control, polled devices still kick us: we're not running
+ * while the driver posts buffers, and without the kick the controller
+ * may move the time past them before the poller even sees them. So we
+ * poll, but the kick is what makes it correct.
+ */
+static bool usfstl_vhost_user_kick_disabled(struct usfstl_vhost_user_dev_int *dev)
+{
+	return dev->polled && !dev->ext.server->ctrl;
+}
+
+/*
+ * With polling, tell the driver not to kick us at all. Without event
+ * index that's a flag, otherwise keep the event index just behind the
+ * buffers we've seen, the driver won't get there.
+ */
+static void usfstl_vhost_user_disable_kick(struct usfstl_vhost_user_dev_int *dev,
+					   unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+
+	if (usfstl_vhost_user_packed(dev)) {
+		vq->device_event->flags =
+			cpu_to_virtio16(dev, VRING_PACKED_EVENT_FLAG_DISABLE);
+		return;
+	}
+
+	if (usfstl_vhost_user_event_idx(dev))
+		vring_avail_event(&vq->virtq) =
+			cpu_to_virtio16(dev, vq->last_avail_idx - 1);
+	else
+		vq->virtq.used->flags = cpu_to_virtio16(dev,
+							VRING_USED_F_NO_NOTIFY);
+}
+
+/*
+ * With VIRTIO_RING_F_EVENT_IDX, ask the driver to kick us only once it
+ * made buffers available beyond what we've already seen. Returns true
+ * if there are more buffers already, which must then be processed.
+ */
+static bool
+usfstl_vhost_user_enable_kick(struct usfstl_vhost_user_dev_int *dev,
+			      unsigned int virtq_idx)
+{
+	struct vring *virtq = &dev->virtqs[virtq_idx].virtq;
+	uint16_t last_avail_idx = dev->virtqs[virtq_idx].last_avail_idx;
+	bool avail_wrap = dev->virtqs[virtq_idx].avail_wrap;
+	struct vring_packed_desc_event *event;
+
+	if (usfstl_vhost_user_kick_disabled(dev)) {
+		usfstl_vhost_user_disable_kick(dev, virtq_idx);
+		return false;
+	}
+
+	if (!usfstl_vhost_user_event_idx(dev))
+		return false;
+
+	if (usfstl_vhost_user_packed(dev)) {
+		event = dev->virtqs[virtq_idx].device_event;
+		event->off_wrap = cpu_to_virtio16(dev, last_avail_idx |
+				avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+		__sync_synchronize();
+		event->flags = cpu_to_virtio16(dev, VRING_PACKED_EVENT_FLAG_DESC);
+
+		/* make sure the driver sees it before we check again */
+		__sync_synchronize();
+
+		return usfstl_vhost_user_packed_desc_avail(
+			virtio_to_cpu16(dev,
+				dev->virtqs[virtq_idx].packed_desc[last_avail_idx].flags),
+			avail_wrap);
+	}
+
+	vring_avail_event(virtq) = cpu_to_virtio16(dev, last_avail_idx);
+
+	/* make sure the driver sees it before we check again */
+	__sync_synchronize();
+
+	return virtio_to_cpu16(dev, virtq->avail->idx) != last_avail_idx;
+}
+
+/* a descriptor chain being parsed into a buffer */
+struct usfstl_vhost_user_chain {
+	struct usfstl_vhost_user_buf *buf;
+	unsigned int virtq_idx;
+	unsigned int max_in, max_out;
+	/* size of the descriptor table, no chain can be longer */
+	unsigned int max;
+	unsigned int n;
+};
+
+/*
+ * Switch to a buffer that can hold a chain of up to @max descriptors,
+ * preferring the one cached in the virtqueue over allocating one.
+ */
 static struct usfstl_vhost_user_buf *
-usfstl_vhost_user_get_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
+usfstl_vhost_user_grow_buf(struct usfstl_vhost_user_dev_int *dev,
+			   unsigned int virtq_idx,
+			   struct usfstl_vhost_user_buf *old,
+			   unsigned int max)
+{
+	struct usfstl_vhost_user_buf *buf = dev->virtqs[virtq_idx].big_buf;
+	struct iovec *vec;
+
+	if (!buf || dev->virtqs[virtq_idx].big_buf_busy ||
+	    dev->virtqs[virtq_idx].big_buf_max < max) {
+		buf = calloc(1, sizeof(*buf) + 2 * max * sizeof(*vec));
+		USFSTL_ASSERT(buf);
+
+		if (dev->virtqs[virtq_idx].big_buf_busy) {
+			buf->allocated = true;
+		} else {
+			free(dev->virtqs[virtq_idx].big_buf);
+			dev->virtqs[virtq_idx].big_buf = buf;
+			dev->virtqs[virtq_idx].big_buf_max = max;
+		}
+	}
+
+	if (!buf->allocated)
+		dev->virtqs[virtq_idx].big_buf_busy = true;
+
+	vec = (void *)(buf + 1);
+	buf->in_sg = vec;
+	buf->out_sg = vec + max;
+	memcpy(buf->in_sg, old->in_sg, old->n_in_sg * sizeof(*vec));
+	memcpy(buf->out_sg, old->out_sg, old->n_out_sg * sizeof(*vec));
+	buf->n_in_sg = old->n_in_sg;
+	buf->n_out_sg = old->n_out_sg;
+	buf->idx = old->idx;
+
+	return buf;
+}
+
+static void usfstl_vhost_user_chain_add(struct usfstl_vhost_user_dev_int *dev,
+					struct usfstl_vhost_user_chain *chain,
+					bool write, uint64_t addr, uint32_t len)
+{
+	struct usfstl_vhost_user_buf *buf = chain->buf;
+	struct iovec *vec;
+
+	/* this also stops descriptor loops */
+	USFSTL_ASSERT(chain->n < chain->max, "descriptor chain too long");
+	chain->n++;
+
+	if ((write && buf->n_in_sg == chain->max_in) ||
+	    (!write && buf->n_out_sg == chain->max_out)) {
+		buf = usfstl_vhost_user_grow_buf(dev, chain->virtq_idx, buf,
+						 chain->max);
+		chain->buf = buf;
+		chain->max_in = chain->max_out = chain->max;
+	}
+
+	if (write) {
+		vec = &buf->in_sg[buf->n_in_sg];
+		buf->n_in_sg++;
+	} else {
+		vec = &buf->out_sg[buf->n_out_sg];
+		buf->n_out_sg++;
+	}
+
+	vec->iov_base = usfstl_vhost_phys_to_va(&dev->ext, addr);
+	vec->iov_len = len;
+}
+
+static void usfstl_vhost_user_chain_init(struct usfstl_vhost_user_chain *chain,
+					 unsigned int virtq_idx,
+					 struct usfstl_vhost_user_buf *fixed,
+					 unsigned int max)
+{
+	chain->buf = fixed;
+	chain->virtq_idx = virtq_idx;
+	chain->max_in = fixed->n_in_sg;
+	chain->max_out = fixed->n_out_sg;
+	chain->max = max;
+	chain->n = 0;
+
+	fixed->n_in_sg = 0;
+	fixed->n_out_sg = 0;
+}
+
+static struct usfstl_vhost_user_buf *
+usfstl_vhost_user_get_split_buf(struct usfstl_vhost_user_dev_int *dev,
 				unsigned int virtq_idx,
 				struct usfstl_vhost_user_buf *fixed)
 {
-	struct usfstl_vhost_user_buf *buf = fixed;
-	struct vring *virtq = &dev->virtqs[virtq_idx].virtq;
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct vring *virtq = &vq->virtq;
 	uint16_t avail_idx = virtio_to_cpu16(dev, virtq->avail->idx);
-	uint16_t idx, desc_idx;
-	struct vring_desc *desc;
-	unsigned int n_in = 0, n_out = 0;
-	bool more;
+	struct vring_desc *desc, *table = virtq->desc;
+	struct usfstl_vhost_user_chain chain;
+	uint16_t idx, desc_idx, flags;
+
+	if (vq->resubmit_pos < vq->n_resubmit) {
+		/* still marked inflight, and accounted in last_avail_idx */
+		desc_idx = vq->resubmit[vq->resubmit_pos++];
+		if (vq->resubmit_pos == vq->n_resubmit) {
+			free(vq->resubmit);
+			vq->resubmit = NULL;
+			vq->n_resubmit = vq->resubmit_pos = 0;
+		}
+	} else {
+		if (avail_idx == vq->last_avail_idx)
+			return NULL;
 
-	if (avail_idx == dev->virtqs[virtq_idx].last_avail_idx)
-		return NULL;
+		/* ensure we read the descriptor after checking the index */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-	/* ensure we read the descriptor after checking the index */
-	__sync_synchronize();
+		idx = vq->last_avail_idx++;
+		idx %= virtq->num;
+		desc_idx = virtio_to_cpu16(dev, virtq->avail->ring[idx]);
 
-	idx = dev->virtqs[virtq_idx].last_avail_idx++;
-	idx %= virtq->num;
-	desc_idx = virtio_to_cpu16(dev, virtq->avail->ring[idx]);
+		if (vq->inflight) {
+			vq->inflight->desc[desc_idx].counter =
+				vq->inflight_counter++;
+			vq->inflight->desc[desc_idx].inflight = 1;
+		}
+	}
 	USFSTL_ASSERT(desc_idx < virtq->num);
 
-	desc = &virtq->desc[desc_idx];
-	do {
-		more = virtio_to_cpu16(dev, desc->flags) & VRING_DESC_F_NEXT;
+	usfstl_vhost_user_chain_init(&chain, virtq_idx, fixed, virtq->num);
+	desc = &table[desc_idx];
+	flags = virtio_to_cpu16(dev, desc->flags);
 
-		if (virtio_to_cpu16(dev, desc->flags) & VRING_DESC_F_WRITE)
-			n_in++;
-		else
-			n_out++;
-		desc = &virtq->desc[virtio_to_cpu16(dev, desc->next)];
-	} while (more);
+	if (flags & VRING_DESC_F_INDIRECT) {
+		USFSTL_ASSERT(dev->ext.features &
+			      (1ULL << VIRTIO_RING_F_INDIRECT_DESC));
+		USFSTL_ASSERT(!(flags & VRING_DESC_F_NEXT));
 
-	if (n_in > fixed->n_in_sg || n_out > fixed->n_out_sg) {
-		size_t sz = sizeof(*buf);
-		struct iovec *vec;
+		table = usfstl_vhost_phys_to_va(&dev->ext,
+						virtio_to_cpu64(dev, desc->addr));
+		chain.max = virtio_to_cpu32(dev, desc->len) / sizeof(*desc);
+		USFSTL_ASSERT(chain.max);
+		desc = &table[0];
+	}
 
-		sz += (n_in + n_out) * sizeof(*vec);
+	while (1) {
+		flags = virtio_to_cpu16(dev, desc->flags);
+		USFSTL_ASSERT(!(flags & VRING_DESC_F_INDIRECT));
 
-		buf = calloc(1, sz);
-		if (!buf)
-			return NULL;
+		usfstl_vhost_user_chain_add(dev, &chain,
+					    flags & VRING_DESC_F_WRITE,
+					    virtio_to_cpu64(dev, desc->addr),
+					    virtio_to_cpu32(dev, desc->len));
 
-		vec = (void *)(buf + 1);
-		buf->in_sg = vec;
-		buf->out_sg = vec + n_in;
-		buf->allocated = true;
+		if (!(flags & VRING_DESC_F_NEXT))
+			break;
+
+		idx = virtio_to_cpu16(dev, desc->next);
+		USFSTL_ASSERT(idx < chain.max);
+		desc = &table[idx];
 	}
 
-	buf->n_in_sg = 0;
-	buf->n_out_sg = 0;
-	buf->idx = desc_idx;
+	chain.buf->idx = desc_idx;
+	chain.buf->n_descs = 1;
 
-	desc = &virtq->desc[desc_idx];
-	do {
-		struct iovec *vec;
-		uint64_t addr;
+	return chain.buf;
+}
 
-		more = virtio_to_cpu16(dev, desc->flags) & VRING_DESC_F_NEXT;
+static struct usfstl_vhost_user_buf *
+usfstl_vhost_user_get_packed_buf(struct usfstl_vhost_user_dev_int *dev,
+				 unsigned int virtq_idx,
+				 struct usfstl_vhost_user_buf *fixed)
+{
+	struct vring_packed_desc *ring = dev->virtqs[virtq_idx].packed_desc;
+	unsigned int num = dev->virtqs[virtq_idx].virtq.num;
+	uint16_t pos = dev->virtqs[virtq_idx].last_avail_idx;
+	bool wrap = dev->virtqs[virtq_idx].avail_wrap;
+	struct usfstl_vhost_user_chain chain;
+	struct vring_packed_desc *desc;
+	unsigned int n_descs = 0;
+	uint16_t flags;
+
+	if (!usfstl_vhost_user_packed_desc_avail(
+			virtio_to_cpu16(dev, ring[pos].flags), wrap))
+		return NULL;
 
-		if (virtio_to_cpu16(dev, desc->flags) & VRING_DESC_F_WRITE) {
-			vec = &buf->in_sg[buf->n_in_sg];
-			buf->n_in_sg++;
+	/* ensure we read the descriptor after checking the flags */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	usfstl_vhost_user_chain_init(&chain, virtq_idx, fixed, num);
+
+	/* the driver makes the whole chain available at once */
+	do {
+		desc = &ring[pos];
+		flags = virtio_to_cpu16(dev, desc->flags);
+
+		if (flags & VRING_DESC_F_INDIRECT) {
+			struct vring_packed_desc *table;
+			unsigned int i, n;
+
+			USFSTL_ASSERT(dev->ext.features &
+				      (1ULL << VIRTIO_RING_F_INDIRECT_DESC));
+			USFSTL_ASSERT(!(flags & VRING_DESC_F_NEXT));
+
+			table = usfstl_vhost_phys_to_va(&dev->ext,
+					virtio_to_cpu64(dev, desc->addr));
+			n = virtio_to_cpu32(dev, desc->len) / sizeof(*table);
+			chain.max = n;
+
+			for (i = 0; i < n; i++) {
+				usfstl_vhost_user_chain_add(dev, &chain,
+					virtio_to_cpu16(dev, table[i].flags) &
+						VRING_DESC_F_WRITE,
+					virtio_to_cpu64(dev, table[i].addr),
+					virtio_to_cpu32(dev, table[i].len));
+			}
 		} else {
-			vec = &buf->out_sg[buf->n_out_sg];
-			buf->n_out_sg++;
+			usfstl_vhost_user_chain_add(dev, &chain,
+						    flags & VRING_DESC_F_WRITE,
+						    virtio_to_cpu64(dev, desc->addr),
+						    virtio_to_cpu32(dev, desc->len));
+		}
+
+		n_descs++;
+		USFSTL_ASSERT(n_descs <= num, "descriptor chain too long");
+
+		if (++pos == num) {
+			pos = 0;
+			wrap = !wrap;
 		}
+	} while (flags & VRING_DESC_F_NEXT);
+
+	/* the buffer ID is in the last descriptor */
+	chain.buf->idx = virtio_to_cpu16(dev, desc->id);
+	chain.buf->n_descs = n_descs;
+
+	dev->virtqs[virtq_idx].last_avail_idx = pos;
+	dev->virtqs[virtq_idx].avail_wrap = wrap;
+
+	return chain.buf;
+}
+
+static struct usfstl_vhost_user_buf *
+usfstl_vhost_user_get_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
+				unsigned int virtq_idx,
+				struct usfstl_vhost_user_buf *fixed)
+{
+	struct usfstl_vhost_user_buf *buf;
 
-		addr = virtio_to_cpu64(dev, desc->addr);
-		vec->iov_base = usfstl_vhost_phys_to_va(&dev->ext, addr);
-		vec->iov_len = virtio_to_cpu32(dev, desc->len);
+	if (usfstl_vhost_user_packed(dev))
+		buf = usfstl_vhost_user_get_packed_buf(dev, virtq_idx, fixed);
+	else
+		buf = usfstl_vhost_user_get_split_buf(dev, virtq_idx, fixed);
 
-		desc = &virtq->desc[virtio_to_cpu16(dev, desc->next)];
-	} while (more);
+	if (buf)
+		dev->virtqs[virtq_idx].stats.avail++;
 
 	return buf;
 }
 
-static void usfstl_vhost_user_free_buf(struct usfstl_vhost_user_buf *buf)
+static void usfstl_vhost_user_free_buf(struct usfstl_vhost_user_dev_int *dev,
+				       unsigned int virtq_idx,
+				       struct usfstl_vhost_user_buf *buf)
 {
-	if (buf->allocated)
+	if (buf == dev->virtqs[virtq_idx].big_buf)
+		dev->virtqs[virtq_idx].big_buf_busy = false;
+	else if (buf->allocated)
 		free(buf);
 }
 
@@ -272,30 +652,343 @@ static void usfstl_vhost_user_send_msg(struct usfstl_vhost_user_dev_int *dev,
 	}
 }
 
-static void usfstl_vhost_user_send_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
-					     struct usfstl_vhost_user_buf *buf,
-					     int virtq_idx)
+/*
+ * Put a buffer into the used ring without publishing it to the driver
+ * yet, that's done (for all buffers pushed since) by flush_used.
+ */
+static void usfstl_vhost_user_push_used(struct usfstl_vhost_user_dev_int *dev,
+					struct usfstl_vhost_user_buf *buf,
+					unsigned int virtq_idx)
+{
+	struct vring *virtq = &dev->virtqs[virtq_idx].virtq;
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	bool packed = usfstl_vhost_user_packed(dev);
+	/*
+	 * Only on packed rings, a split ring's used index counts buffers
+	 * so the entry would have to go into the last slot, and writing
+	 * the others doesn't hurt. Inflight recovery (split only anyway)
+	 * needs the ID of every used buffer.
+	 */
+	bool skip = packed && usfstl_vhost_user_in_order(dev) &&
+		    !buf->written && !vq->inflight;
+	uint16_t pos = vq->used_idx;
+	bool wrap = vq->used_wrap;
+	uint16_t flags;
+
+	if (!vq->used_pending)
+		vq->used_head = pos;
+	vq->used_pending++;
+
+	/* a packed ring entry (also) takes the place of all descriptors */
+	if (packed) {
+		vq->used_idx += buf->n_descs;
+		if (vq->used_idx >= virtq->num) {
+			vq->used_idx -= virtq->num;
+			vq->used_wrap = !vq->used_wrap;
+		}
+	}
+
+	/*
+	 * With IN_ORDER, the driver treats all buffers up to the one in
+	 * a used descriptor as used, so buffers the device didn't write to
+	 * can share the descriptor of a previous such buffer that isn't
+	 * published yet, it just needs the ID of the last one.
+	 */
+	if (skip && vq->used_run_valid) {
+		vq->packed_desc[vq->used_run].id = cpu_to_virtio16(dev, buf->idx);
+		return;
+	}
+
+	vq->used_run = pos;
+	vq->used_run_valid = skip;
+
+	if (!packed) {
+		vq->used_idx++;
+		virtq->used->ring[pos % virtq->num].id = cpu_to_virtio32(dev, buf->idx);
+		virtq->used->ring[pos % virtq->num].len = cpu_to_virtio32(dev, buf->written);
+		return;
+	}
+
+	vq->packed_desc[pos].id = cpu_to_virtio16(dev, buf->idx);
+	vq->packed_desc[pos].len = cpu_to_virtio32(dev, buf->written);
+
+	/* both flags equal to the wrap counter mark the descriptor used */
+	flags = 0;
+	if (wrap)
+		flags = 1 << VRING_PACKED_DESC_F_AVAIL |
+			1 << VRING_PACKED_DESC_F_USED;
+	if (buf->written)
+		flags |= VRING_DESC_F_WRITE;
+
+	/*
+	 * The driver won't look beyond the first pending entry, so only
+	 * that one needs to wait for the flush.
+	 */
+	if (pos == vq->used_head)
+		vq->used_head_flags = flags;
+	else
+		vq->packed_desc[pos].flags = cpu_to_virtio16(dev, flags);
+}
+
+/*
+ * The used entries [@from, @to) were published, so they're no longer
+ * inflight. If we stop before updating used_idx in the inflight area,
+ * recovery does this again.
+ */
+static void usfstl_vhost_user_inflight_used(struct usfstl_vhost_user_dev_int *dev,
+					    unsigned int virtq_idx,
+					    uint16_t from, uint16_t to)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct vring *virtq = &vq->virtq;
+	uint32_t id;
+
+	/* publish the used index before clearing */
+	__sync_synchronize();
+
+	for (; from != to; from++) {
+		id = virtio_to_cpu32(dev, virtq->used->ring[from % virtq->num].id);
+		if (id < vq->inflight->desc_num)
+			vq->inflight->desc[id].inflight = 0;
+		vq->inflight->last_batch_head = id;
+	}
+
+	__sync_synchronize();
+	vq->inflight->used_idx = to;
+}
+
+static int usfstl_vhost_user_cmp_inflight(const void *a, const void *b, void *data)
+{
+	struct usfstl_vhost_user_inflight_queue *inflight = data;
+	uint64_t ca = inflight->desc[*(const uint16_t *)a].counter;
+	uint64_t cb = inflight->desc[*(const uint16_t *)b].counter;
+
+	return ca < cb ? -1 : ca > cb;
+}
+
+/*
+ * Called when the split ring is set up with an inflight area: finish
+ * what the previous connection may have left, and queue the buffers
+ * that were taken but never returned for processing again, in order.
+ */
+static void usfstl_vhost_user_inflight_recover(struct usfstl_vhost_user_dev_int *dev,
+					       unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct usfstl_vhost_user_inflight_queue *inflight;
+	uint16_t used_idx = virtio_to_cpu16(dev, vq->virtq.used->idx);
+	unsigned int i, n = 0;
+
+	free(vq->resubmit);
+	vq->resubmit = NULL;
+	vq->n_resubmit = vq->resubmit_pos = 0;
+	vq->inflight = NULL;
+
+	if (!dev->inflight || usfstl_vhost_user_packed(dev) ||
+	    (virtq_idx + 1) * dev->inflight_queue_size > dev->inflight_size)
+		return;
+
+	inflight = (void *)((uint8_t *)dev->inflight +
+			    virtq_idx * dev->inflight_queue_size);
+	if (inflight->version != INFLIGHT_VERSION ||
+	    inflight->desc_num != vq->virtq.num)
+		return;
+
+	vq->inflight = inflight;
+
+	if (inflight->used_idx != used_idx)
+		usfstl_vhost_user_inflight_used(dev, virtq_idx,
+						inflight->used_idx, used_idx);
+
+	vq->inflight_counter = 0;
+	for (i = 0; i < inflight->desc_num; i++) {
+		if (!inflight->desc[i].inflight)
+			continue;
+		if (inflight->desc[i].counter >= vq->inflight_counter)
+			vq->inflight_counter = inflight->desc[i].counter + 1;
+		n++;
+	}
+
+	vq->last_avail_idx = used_idx + n;
+
+	if (!n)
+		return;
+
+	vq->resubmit = malloc(n * sizeof(*vq->resubmit));
+	USFSTL_ASSERT(vq->resubmit);
+
+	for (i = 0; i < inflight->desc_num; i++) {
+		if (inflight->desc[i].inflight)
+			vq->resubmit[vq->n_resubmit++] = i;
+	}
+
+	qsort_r(vq->resubmit, n, sizeof(*vq->resubmit),
+		usfstl_vhost_user_cmp_inflight, inflight);
+}
+
+static size_t usfstl_vhost_user_inflight_queue_size(unsigned int queue_size)
+{
+	size_t size = sizeof(struct usfstl_vhost_user_inflight_queue) +
+		      queue_size * sizeof(struct usfstl_vhost_user_inflight_desc);
+
+	return (size + INFLIGHT_ALIGN - 1) & ~(size_t)(INFLIGHT_ALIGN - 1);
+}
+
+static void usfstl_vhost_user_inflight_unmap(struct usfstl_vhost_user_dev_int *dev)
+{
+	unsigned int virtq;
+
+	if (!dev->inflight)
+		return;
+
+	for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++)
+		dev->virtqs[virtq].inflight = NULL;
+
+	munmap(dev->inflight, dev->inflight_size);
+	dev->inflight = NULL;
+}
+
+static int usfstl_vhost_user_inflight_map(struct usfstl_vhost_user_dev_int *dev,
+					  int fd, uint64_t size,
+					  uint64_t offset,
+					  unsigned int num_queues,
+					  unsigned int queue_size)
+{
+	void *area;
+
+	usfstl_vhost_user_inflight_unmap(dev);
+
+	area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	if (area == MAP_FAILED)
+		return -1;
+
+	dev->inflight = area;
+	dev->inflight_size = size;
+	dev->inflight_queue_size = usfstl_vhost_user_inflight_queue_size(queue_size);
+	if (dev->inflight_queue_size * num_queues > size)
+		dev->inflight_queue_size = num_queues ? size / num_queues : 0;
+
+	return 0;
+}
+
+/* allocate a fresh inflight area for the frontend to keep for us */
+static int usfstl_vhost_user_inflight_alloc(struct usfstl_vhost_user_dev_int *dev,
+					    unsigned int num_queues,
+					    unsigned int queue_size,
+					    uint64_t *mmap_size)
+{
+	size_t qsize = usfstl_vhost_user_inflight_queue_size(queue_size);
+	struct usfstl_vhost_user_inflight_queue *inflight;
+	unsigned int i;
+	int fd;
+
+	fd = memfd_create("vhost-user-inflight", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, qsize * num_queues) ||
+	    usfstl_vhost_user_inflight_map(dev, fd, qsize * num_queues, 0,
+					   num_queues, queue_size)) {
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < num_queues; i++) {
+		inflight = (void *)((uint8_t *)dev->inflight + i * qsize);
+		inflight->version = INFLIGHT_VERSION;
+		inflight->desc_num = queue_size;
+	}
+
+	*mmap_size = qsize * num_queues;
+	return fd;
+}
+
+static bool usfstl_vhost_user_need_call(struct usfstl_vhost_user_dev_int *dev,
+					unsigned int virtq_idx,
+					uint16_t old, uint16_t new)
 {
 	struct vring *virtq = &dev->virtqs[virtq_idx].virtq;
-	unsigned int idx, widx;
-	int call_fd = dev->virtqs[virtq_idx].call_fd;
+	struct vring_packed_desc_event *event;
+	uint16_t off_wrap, off;
+
+	if (!usfstl_vhost_user_packed(dev)) {
+		if (!usfstl_vhost_user_event_idx(dev))
+			return true;
+
+		/* publish the index before checking if the driver wants it */
+		__sync_synchronize();
+
+		return vring_need_event(virtio_to_cpu16(dev,
+							vring_used_event(virtq)),
+					new, old);
+	}
+
+	__sync_synchronize();
+
+	event = dev->virtqs[virtq_idx].driver_event;
+	switch (virtio_to_cpu16(dev, event->flags)) {
+	case VRING_PACKED_EVENT_FLAG_DISABLE:
+		return false;
+	case VRING_PACKED_EVENT_FLAG_DESC:
+		if (usfstl_vhost_user_event_idx(dev))
+			break;
+		/* fall through */
+	default:
+		return true;
+	}
+
+	off_wrap = virtio_to_cpu16(dev, event->off_wrap);
+	off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+	/* positions are within the ring, so adjust for wrapping */
+	if (new <= old)
+		old -= virtq->num;
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+	    dev->virtqs[virtq_idx].used_wrap)
+		off -= virtq->num;
+
+	return vring_need_event(off, new, old);
+}
+
+static void usfstl_vhost_user_flush_used(struct usfstl_vhost_user_dev_int *dev,
+					 unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct usfstl_vhost_user_vq_stats *stats = &vq->stats;
+	uint16_t old = vq->used_head;
+	uint16_t new = vq->used_idx;
+	int call_fd = vq->call_fd;
 	ssize_t written;
 	uint64_t e = 1;
 
+	if (!vq->used_pending)
+		return;
+
 	if (dev->ext.server->ctrl)
 		usfstl_sched_ctrl_sync_to(dev->ext.server->ctrl);
 
-	idx = virtio_to_cpu16(dev, virtq->used->idx);
-	widx = idx + 1;
-
-	idx %= virtq->num;
-	virtq->used->ring[idx].id = cpu_to_virtio32(dev, buf->idx);
-	virtq->used->ring[idx].len = cpu_to_virtio32(dev, buf->written);
-
 	/* write buffers / used table before flush */
 	__sync_synchronize();
 
-	virtq->used->idx = cpu_to_virtio16(dev, widx);
+	if (usfstl_vhost_user_packed(dev))
+		vq->packed_desc[old].flags =
+			cpu_to_virtio16(dev, vq->used_head_flags);
+	else
+		vq->virtq.used->idx = cpu_to_virtio16(dev, new);
+
+	if (vq->inflight)
+		usfstl_vhost_user_inflight_used(dev, virtq_idx, old, new);
+
+	stats->used += vq->used_pending;
+	vq->used_pending = 0;
+	vq->used_run_valid = false;
+
+	if (!usfstl_vhost_user_need_call(dev, virtq_idx, old, new)) {
+		stats->calls_suppressed++;
+		return;
+	}
+
+	stats->calls++;
 
 	if (call_fd < 0 &&
 	    dev->ext.protocol_features &
@@ -315,7 +1008,7 @@ static void usfstl_vhost_user_send_virtq_buf(struct usfstl_vhost_user_dev_int *d
 		return;
 	}
 
-	written = write(dev->virtqs[virtq_idx].call_fd, &e, sizeof(e));
+	written = write(call_fd, &e, sizeof(e));
 	USFSTL_ASSERT_EQ(written, (ssize_t)sizeof(e), "%zd");
 }
 
@@ -333,12 +1026,153 @@ static void usfstl_vhost_user_handle_queue(struct usfstl_vhost_user_dev_int *dev
 	};
 	struct usfstl_vhost_user_buf *buf;
 
-	while ((buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx, &_buf))) {
-		dev->ext.server->ops->handle(&dev->ext, buf, virtq_idx);
+	do {
+		while ((buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx,
+							      &_buf))) {
+			dev->ext.server->ops->handle(&dev->ext, buf, virtq_idx);
+
+			usfstl_vhost_user_push_used(dev, buf, virtq_idx);
+			usfstl_vhost_user_free_buf(dev, virtq_idx, buf);
 
-		usfstl_vhost_user_send_virtq_buf(dev, buf, virtq_idx);
-		usfstl_vhost_user_free_buf(buf);
+			/* the sizes were overwritten with the actual ones */
+			_buf.n_in_sg = SG_STACK_PREALLOC;
+			_buf.n_out_sg = SG_STACK_PREALLOC;
+		}
+
+		/* return everything we handled at once */
+		usfstl_vhost_user_flush_used(dev, virtq_idx);
+	} while (usfstl_vhost_user_enable_kick(dev, virtq_idx));
+}
+
+struct usfstl_vhost_user_backlog_entry {
+	struct usfstl_list_entry list;
+	size_t len;
+	uint8_t data[];
+};
+
+static size_t usfstl_vhost_user_fill_buf(struct usfstl_vhost_user_buf *buf,
+					 const struct iovec *data,
+					 unsigned int n_data)
+{
+	size_t written = 0;
+	unsigned int i;
+
+	USFSTL_ASSERT(buf->n_in_sg && !buf->n_out_sg);
+
+	/* gather the pieces straight into the guest buffer */
+	for (i = 0; i < n_data; i++) {
+		size_t copied;
+
+		copied = iov_fill_offset(buf->in_sg, buf->n_in_sg, written,
+					 data[i].iov_base, data[i].iov_len);
+		written += copied;
+		if (copied < data[i].iov_len)
+			break;
 	}
+
+	return written;
+}
+
+/*
+ * Move backlogged messages into buffers the driver posted since, and
+ * keep asking for a kick while some are left.
+ */
+static void usfstl_vhost_user_drain_backlog(struct usfstl_vhost_user_dev_int *dev,
+					    unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	/* preallocate on the stack for most cases */
+	struct iovec in_sg[SG_STACK_PREALLOC] = { };
+	struct usfstl_vhost_user_buf _buf = {
+		.in_sg = in_sg,
+		.n_in_sg = SG_STACK_PREALLOC,
+	};
+	struct usfstl_vhost_user_backlog_entry *entry;
+	struct usfstl_vhost_user_buf *buf;
+	struct iovec iov;
+
+	do {
+		while (!usfstl_list_empty(&vq->backlog) &&
+		       (buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx,
+							      &_buf))) {
+			entry = usfstl_list_first_item(&vq->backlog,
+						       struct usfstl_vhost_user_backlog_entry,
+						       list);
+			iov.iov_base = entry->data;
+			iov.iov_len = entry->len;
+			buf->written = usfstl_vhost_user_fill_buf(buf, &iov, 1);
+
+			usfstl_vhost_user_push_used(dev, buf, virtq_idx);
+			usfstl_vhost_user_free_buf(dev, virtq_idx, buf);
+
+			usfstl_list_item_remove(&entry->list);
+			free(entry);
+			vq->stats.backlog--;
+
+			_buf.n_in_sg = SG_STACK_PREALLOC;
+			_buf.n_out_sg = 0;
+		}
+
+		usfstl_vhost_user_flush_used(dev, virtq_idx);
+	} while (!usfstl_list_empty(&vq->backlog) &&
+		 usfstl_vhost_user_enable_kick(dev, virtq_idx));
+}
+
+static void usfstl_vhost_user_add_backlog(struct usfstl_vhost_user_dev_int *dev,
+					  unsigned int virtq_idx,
+					  const struct iovec *data,
+					  unsigned int n_data)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct usfstl_vhost_user_backlog_entry *entry;
+	bool first = usfstl_list_empty(&vq->backlog);
+	size_t len = 0, pos = 0;
+	unsigned int i;
+
+	if (vq->stats.backlog >= dev->ext.server->rx_backlog) {
+		vq->stats.dropped++;
+		return;
+	}
+
+	for (i = 0; i < n_data; i++)
+		len += data[i].iov_len;
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry) {
+		vq->stats.dropped++;
+		return;
+	}
+
+	for (i = 0; i < n_data; i++) {
+		memcpy(entry->data + pos, data[i].iov_base, data[i].iov_len);
+		pos += data[i].iov_len;
+	}
+	entry->len = len;
+
+	usfstl_list_append(&vq->backlog, &entry->list);
+	vq->stats.backlogged++;
+	vq->stats.backlog++;
+	if (vq->stats.backlog > vq->stats.backlog_max)
+		vq->stats.backlog_max = vq->stats.backlog;
+
+	/* the driver kicks when posting buffers, unless it was told not to */
+	if (first && usfstl_vhost_user_enable_kick(dev, virtq_idx))
+		usfstl_vhost_user_drain_backlog(dev, virtq_idx);
+}
+
+static void usfstl_vhost_user_free_backlog(struct usfstl_vhost_user_dev_int *dev,
+					   unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_virtq *vq = &dev->virtqs[virtq_idx];
+	struct usfstl_vhost_user_backlog_entry *entry;
+
+	while ((entry = usfstl_list_first_item(&vq->backlog,
+					       struct usfstl_vhost_user_backlog_entry,
+					       list))) {
+		usfstl_list_item_remove(&entry->list);
+		free(entry);
+	}
+	vq->stats.backlog = 0;
 }
 
 static void usfstl_vhost_user_job_callback(struct usfstl_job *job)
@@ -355,8 +1189,8 @@ static void usfstl_vhost_user_job_callback(struct usfstl_job *job)
 	}
 }
 
-static void usfstl_vhost_user_virtq_kick(struct usfstl_vhost_user_dev_int *dev,
-					 unsigned int virtq)
+static void usfstl_vhost_user_virtq_trigger(struct usfstl_vhost_user_dev_int *dev,
+					    unsigned int virtq)
 {
 	if (!(dev->ext.server->input_queues & (1ULL << virtq)))
 		return;
@@ -379,6 +1213,112 @@ static void usfstl_vhost_user_virtq_kick(struct usfstl_vhost_user_dev_int *dev,
 	usfstl_sched_add_job(dev->ext.server->scheduler, &dev->irq_job);
 }
 
+static void usfstl_vhost_user_virtq_kick(struct usfstl_vhost_user_dev_int *dev,
+					 unsigned int virtq)
+{
+	dev->virtqs[virtq].stats.kicks++;
+
+	if (!usfstl_list_empty(&dev->virtqs[virtq].backlog))
+		usfstl_vhost_user_drain_backlog(dev, virtq);
+
+	usfstl_vhost_user_virtq_trigger(dev, virtq);
+}
+
+static struct usfstl_list usfstl_vhost_user_polled_devs =
+	USFSTL_LIST_INIT(usfstl_vhost_user_polled_devs);
+
+static bool usfstl_vhost_user_dev_pending(struct usfstl_vhost_user_dev_int *dev,
+					  unsigned int virtq)
+{
+	if (!dev->virtqs[virtq].enabled)
+		return false;
+
+	/* a backlog waits for the driver to post buffers */
+	if (!usfstl_list_empty(&dev->virtqs[virtq].backlog))
+		return usfstl_vhost_user_virtq_pending(dev, virtq);
+
+	/* already triggered ones will be handled by the job */
+	return dev->ext.server->input_queues & (1ULL << virtq) &&
+	       !dev->virtqs[virtq].triggered &&
+	       usfstl_vhost_user_virtq_pending(dev, virtq);
+}
+
+static bool usfstl_vhost_user_poll_pending(struct usfstl_loop_poller *poller)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+	unsigned int virtq;
+
+	usfstl_for_each_list_item(dev, &usfstl_vhost_user_polled_devs,
+				  poll_list) {
+		for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++) {
+			if (usfstl_vhost_user_dev_pending(dev, virtq))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void usfstl_vhost_user_poll_handle(struct usfstl_loop_poller *poller)
+{
+	struct usfstl_vhost_user_dev_int *dev, *tmp;
+	unsigned int virtq;
+
+	/*
+	 * Handled like a kick, so with time control the time is synced
+	 * and the job scheduled from it. Handling may also free the
+	 * device (e.g. on errors).
+	 */
+	usfstl_for_each_list_item_safe(dev, tmp, &usfstl_vhost_user_polled_devs,
+				       poll_list) {
+		for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++) {
+			if (!usfstl_vhost_user_dev_pending(dev, virtq))
+				continue;
+
+			if (!usfstl_list_empty(&dev->virtqs[virtq].backlog))
+				usfstl_vhost_user_drain_backlog(dev, virtq);
+			else
+				usfstl_vhost_user_virtq_trigger(dev, virtq);
+		}
+	}
+}
+
+static struct usfstl_loop_poller usfstl_vhost_user_poller = {
+	.pending = usfstl_vhost_user_poll_pending,
+	.handle = usfstl_vhost_user_poll_handle,
+};
+
+static void usfstl_vhost_user_poll_add(struct usfstl_vhost_user_dev_int *dev)
+{
+	struct usfstl_vhost_user_server *server = dev->ext.server;
+
+	if (!server->poll)
+		return;
+
+	if (usfstl_list_empty(&usfstl_vhost_user_polled_devs)) {
+		usfstl_vhost_user_poller.max_idle_usec = server->poll_max_idle_usec;
+		usfstl_loop_register_poller(&usfstl_vhost_user_poller);
+	} else if (server->poll_max_idle_usec <
+		   usfstl_vhost_user_poller.max_idle_usec) {
+		usfstl_vhost_user_poller.max_idle_usec = server->poll_max_idle_usec;
+	}
+
+	usfstl_list_append(&usfstl_vhost_user_polled_devs, &dev->poll_list);
+	dev->polled = true;
+}
+
+static void usfstl_vhost_user_poll_del(struct usfstl_vhost_user_dev_int *dev)
+{
+	if (!dev->polled)
+		return;
+
+	usfstl_list_item_remove(&dev->poll_list);
+	dev->polled = false;
+
+	if (usfstl_list_empty(&usfstl_vhost_user_polled_devs))
+		usfstl_loop_unregister_poller(&usfstl_vhost_user_poller);
+}
+
 static void usfstl_vhost_user_virtq_fdkick(struct usfstl_loop_entry *entry)
 {
 	struct usfstl_vhost_user_dev_int *dev = entry->data;
@@ -457,13 +1397,18 @@ static void usfstl_vhost_user_dev_free(struct usfstl_vhost_user_dev_int *dev)
 
 	usfstl_loop_unregister(&dev->entry);
 	usfstl_sched_del_job(&dev->irq_job);
+	usfstl_vhost_user_poll_del(dev);
 
 	for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++) {
 		usfstl_vhost_user_update_virtq_kick(dev, virtq, -1);
 		if (dev->virtqs[virtq].call_fd != -1)
 			close(dev->virtqs[virtq].call_fd);
+		free(dev->virtqs[virtq].big_buf);
+		free(dev->virtqs[virtq].resubmit);
+		usfstl_vhost_user_free_backlog(dev, virtq);
 	}
 
+	usfstl_vhost_user_inflight_unmap(dev);
 	usfstl_vhost_user_clear_mappings(dev);
 
 	if (dev->req_fd != -1)
@@ -478,6 +1423,39 @@ static void usfstl_vhost_user_dev_free(struct usfstl_vhost_user_dev_int *dev)
 	free(dev);
 }
 
+/*
+ * Apply the ring state from SET_VRING_BASE; for packed rings it has
+ * the avail index in bits 0-14 and its wrap counter in bit 15, and the
+ * used index/wrap counter in bits 16-30/31.
+ */
+static void usfstl_vhost_user_set_base(struct usfstl_vhost_user_dev_int *dev,
+				       struct usfstl_vhost_user_virtq *vq)
+{
+	if (!usfstl_vhost_user_packed(dev)) {
+		vq->last_avail_idx = vq->base;
+		vq->used_idx = vq->base;
+		return;
+	}
+
+	/*
+	 * A fresh packed ring starts with both wrap counters set, but
+	 * UML's virtio_uml always sends 0, so take that as a fresh ring
+	 * too unless it's the state we returned when stopping the ring.
+	 */
+	if (!vq->base_set || (!vq->base && !vq->base_stopped)) {
+		vq->last_avail_idx = 0;
+		vq->used_idx = 0;
+		vq->avail_wrap = true;
+		vq->used_wrap = true;
+		return;
+	}
+
+	vq->last_avail_idx = vq->base & 0x7fff;
+	vq->avail_wrap = !!(vq->base & (1 << 15));
+	vq->used_idx = (vq->base >> 16) & 0x7fff;
+	vq->used_wrap = !!(vq->base & (1U << 31));
+}
+
 static void usfstl_vhost_user_get_msg_fds(struct msghdr *msghdr,
 					  int *outfds, int max_fds)
 {
@@ -525,8 +1503,10 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 	};
 	ssize_t len;
 	size_t reply_len = 0;
+	struct usfstl_vhost_user_virtq *vq;
 	unsigned int virtq;
-	int fd;
+	int fd, reply_fd = -1;
+	uint64_t inflight_size;
 
 	dev = container_of(entry, struct usfstl_vhost_user_dev_int, entry);
 
@@ -578,26 +1558,61 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 			      dev->ext.server->max_queues);
 		USFSTL_ASSERT_EQ(msg.payload.vring_addr.flags, (uint32_t)0, "0x%x");
 		USFSTL_ASSERT(!dev->virtqs[msg.payload.vring_addr.idx].enabled);
-		dev->virtqs[msg.payload.vring_addr.idx].last_avail_idx = 0;
-		dev->virtqs[msg.payload.vring_addr.idx].virtq.desc =
+		vq = &dev->virtqs[msg.payload.vring_addr.idx];
+		if (!vq->base_set)
+			vq->base = 0;
+		usfstl_vhost_user_set_base(dev, vq);
+		vq->base_stopped = false;
+		vq->used_pending = 0;
+		vq->used_run_valid = false;
+		vq->virtq.desc =
 			usfstl_vhost_user_to_va(&dev->ext,
 					      msg.payload.vring_addr.descriptor);
-		dev->virtqs[msg.payload.vring_addr.idx].virtq.used =
+		vq->virtq.used =
 			usfstl_vhost_user_to_va(&dev->ext,
 					      msg.payload.vring_addr.used);
-		dev->virtqs[msg.payload.vring_addr.idx].virtq.avail =
+		vq->virtq.avail =
 			usfstl_vhost_user_to_va(&dev->ext,
 					      msg.payload.vring_addr.avail);
-		USFSTL_ASSERT(dev->virtqs[msg.payload.vring_addr.idx].virtq.avail &&
-			    dev->virtqs[msg.payload.vring_addr.idx].virtq.desc &&
-			    dev->virtqs[msg.payload.vring_addr.idx].virtq.used);
+		USFSTL_ASSERT(vq->virtq.avail && vq->virtq.desc && vq->virtq.used);
+		/* the packed ring has the event areas in place of avail/used */
+		vq->packed_desc = (void *)vq->virtq.desc;
+		vq->driver_event = (void *)vq->virtq.avail;
+		vq->device_event = (void *)vq->virtq.used;
+		/* the split ring used index lives in shared memory */
+		if (!usfstl_vhost_user_packed(dev))
+			vq->used_idx = virtio_to_cpu16(dev, vq->virtq.used->idx);
+		usfstl_vhost_user_inflight_recover(dev,
+						   msg.payload.vring_addr.idx);
 		break;
 	case VHOST_USER_SET_VRING_BASE:
-		/* ignored - logging not supported */
-		/*
-		 * FIXME: our Linux UML virtio implementation
-		 *        shouldn't send this
-		 */
+		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
+		USFSTL_ASSERT(msg.payload.vring_state.idx <
+			      dev->ext.server->max_queues);
+		vq = &dev->virtqs[msg.payload.vring_state.idx];
+		vq->base = msg.payload.vring_state.num;
+		vq->base_set = true;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		/* stops the ring, the state is needed to restart it later */
+		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
+		USFSTL_ASSERT(msg.payload.vring_state.idx <
+			      dev->ext.server->max_queues);
+		vq = &dev->virtqs[msg.payload.vring_state.idx];
+		if (vq->virtq.desc)
+			usfstl_vhost_user_flush_used(dev,
+						     msg.payload.vring_state.idx);
+		msg.payload.vring_state.num = vq->last_avail_idx;
+		if (usfstl_vhost_user_packed(dev))
+			msg.payload.vring_state.num =
+				(vq->last_avail_idx & 0x7fff) |
+				(vq->avail_wrap << 15) |
+				((uint32_t)(vq->used_idx & 0x7fff) << 16) |
+				((uint32_t)vq->used_wrap << 31);
+		reply_len = sizeof(msg.payload.vring_state);
+		vq->enabled = false;
+		vq->base_set = false;
+		vq->base_stopped = true;
 		break;
 	case VHOST_USER_SET_VRING_KICK:
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.u64));
@@ -632,12 +1647,28 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		msg.payload.u64 |= 1ULL << VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD;
 		msg.payload.u64 |= 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK;
 		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		USFSTL_ASSERT_EQ(len, (ssize_t)0, "%zd");
+		reply_len = sizeof(uint64_t);
+		msg.payload.u64 = dev->ext.server->max_queues;
+		break;
 	case VHOST_USER_SET_VRING_ENABLE:
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
 		USFSTL_ASSERT(msg.payload.vring_state.idx <
 			      dev->ext.server->max_queues);
 		dev->virtqs[msg.payload.vring_state.idx].enabled =
 			msg.payload.vring_state.num;
+		if (usfstl_vhost_user_kick_disabled(dev) &&
+		    msg.payload.vring_state.num &&
+		    dev->ext.server->input_queues &
+				(1ULL << msg.payload.vring_state.idx))
+			usfstl_vhost_user_disable_kick(dev,
+						       msg.payload.vring_state.idx);
+		/* buffers left over from before reconnecting */
+		vq = &dev->virtqs[msg.payload.vring_state.idx];
+		if (vq->enabled && vq->resubmit_pos < vq->n_resubmit)
+			usfstl_vhost_user_virtq_trigger(dev,
+							msg.payload.vring_state.idx);
 		break;
 	case VHOST_USER_SET_PROTOCOL_FEATURES:
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.u64));
@@ -661,6 +1692,34 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		msg_iov[2].iov_base = (void *)dev->ext.server->config;
 		reply_len = len;
 		break;
+	case VHOST_USER_GET_INFLIGHT_FD:
+		USFSTL_ASSERT(len == (int)sizeof(msg.payload.inflight));
+		USFSTL_ASSERT(msg.payload.inflight.num_queues <=
+			      dev->ext.server->max_queues);
+		reply_fd = usfstl_vhost_user_inflight_alloc(dev,
+							    msg.payload.inflight.num_queues,
+							    msg.payload.inflight.queue_size,
+							    &inflight_size);
+		USFSTL_ASSERT(reply_fd >= 0, "cannot allocate inflight area");
+		msg.payload.inflight.mmap_size = inflight_size;
+		msg.payload.inflight.mmap_offset = 0;
+		reply_len = sizeof(msg.payload.inflight);
+		break;
+	case VHOST_USER_SET_INFLIGHT_FD:
+		USFSTL_ASSERT(len == (int)sizeof(msg.payload.inflight));
+		USFSTL_ASSERT(msg.payload.inflight.num_queues <=
+			      dev->ext.server->max_queues);
+		fd = -1;
+		usfstl_vhost_user_get_msg_fds(&msghdr, &fd, 1);
+		USFSTL_ASSERT(fd != -1);
+		USFSTL_ASSERT(usfstl_vhost_user_inflight_map(dev, fd,
+							     msg.payload.inflight.mmap_size,
+							     msg.payload.inflight.mmap_offset,
+							     msg.payload.inflight.num_queues,
+							     msg.payload.inflight.queue_size) == 0,
+			      "cannot map inflight area");
+		close(fd);
+		break;
 	case VHOST_USER_VRING_KICK:
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
 		USFSTL_ASSERT(msg.payload.vring_state.idx <
@@ -687,6 +1746,19 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		msghdr.msg_control = NULL;
 		msghdr.msg_controllen = 0;
 
+		if (reply_fd != -1) {
+			struct cmsghdr *cmsg;
+
+			memset(msg_control, 0, sizeof(msg_control));
+			msghdr.msg_control = msg_control;
+			msghdr.msg_controllen = CMSG_SPACE(sizeof(int));
+			cmsg = CMSG_FIRSTHDR(&msghdr);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &reply_fd, sizeof(int));
+		}
+
 		reply_len += sizeof(msg.hdr);
 
 		tmp = reply_len;
@@ -700,11 +1772,16 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		while (reply_len) {
 			len = sendmsg(entry->fd, &msghdr, 0);
 			if (len < 0) {
+				if (reply_fd != -1)
+					close(reply_fd);
 				usfstl_vhost_user_dev_free(dev);
 				return;
 			}
 			USFSTL_ASSERT(len != 0);
 			reply_len -= len;
+			/* the fd goes with the first part only */
+			msghdr.msg_control = NULL;
+			msghdr.msg_controllen = 0;
 
 			for (i = 0; len && i < msghdr.msg_iovlen; i++) {
 				unsigned int rm = len;
@@ -717,6 +1794,10 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 			}
 		}
 	}
+
+	/* we keep our own mapping, the frontend has its copy now */
+	if (reply_fd != -1)
+		close(reply_fd);
 }
 
 static void usfstl_vhost_user_connected(int fd, void *data)
@@ -735,6 +1816,7 @@ static void usfstl_vhost_user_connected(int fd, void *data)
 		dev->virtqs[i].entry.fd = -1;
 		dev->virtqs[i].entry.data = dev;
 		dev->virtqs[i].entry.handler = usfstl_vhost_user_virtq_fdkick;
+		usfstl_list_init(&dev->virtqs[i].backlog);
 	}
 
 	for (i = 0; i < MAX_REGIONS; i++)
@@ -755,6 +1837,7 @@ static void usfstl_vhost_user_connected(int fd, void *data)
 	dev->entry.handler = usfstl_vhost_user_handle_msg;
 
 	usfstl_loop_register(&dev->entry);
+	usfstl_vhost_user_poll_add(dev);
 }
 
 void usfstl_vhost_user_server_start(struct usfstl_vhost_user_server *server)
@@ -770,9 +1853,10 @@ void usfstl_vhost_user_server_stop(struct usfstl_vhost_user_server *server)
 	usfstl_uds_remove(server->socket);
 }
 
-void usfstl_vhost_user_dev_notify(struct usfstl_vhost_user_dev *extdev,
-				  unsigned int virtq_idx,
-				  const uint8_t *data, size_t datalen)
+void usfstl_vhost_user_dev_notify_iov(struct usfstl_vhost_user_dev *extdev,
+				      unsigned int virtq_idx,
+				      const struct iovec *data,
+				      unsigned int n_data)
 {
 	struct usfstl_vhost_user_dev_int *dev;
 	/* preallocate on the stack for most cases */
@@ -784,25 +1868,82 @@ void usfstl_vhost_user_dev_notify(struct usfstl_vhost_user_dev *extdev,
 		.out_sg = out_sg,
 		.n_out_sg = SG_STACK_PREALLOC,
 	};
-	struct usfstl_vhost_user_buf *buf;
+	struct usfstl_vhost_user_buf *buf = NULL;
 
 	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
 
 	USFSTL_ASSERT(virtq_idx <= dev->ext.server->max_queues);
 
-	if (!dev->virtqs[virtq_idx].enabled)
+	if (!dev->virtqs[virtq_idx].enabled) {
+		dev->virtqs[virtq_idx].stats.dropped++;
 		return;
+	}
 
-	buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx, &_buf);
-	if (!buf)
+	/* keep the order, nothing can overtake the backlog */
+	if (usfstl_list_empty(&dev->virtqs[virtq_idx].backlog))
+		buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx, &_buf);
+	if (!buf) {
+		usfstl_vhost_user_add_backlog(dev, virtq_idx, data, n_data);
 		return;
+	}
 
-	USFSTL_ASSERT(buf->n_in_sg && !buf->n_out_sg);
-	iov_fill(buf->in_sg, buf->n_in_sg, data, datalen);
-	buf->written = datalen;
+	buf->written = usfstl_vhost_user_fill_buf(buf, data, n_data);
+
+	usfstl_vhost_user_push_used(dev, buf, virtq_idx);
+	usfstl_vhost_user_free_buf(dev, virtq_idx, buf);
+
+	if (!dev->ext.server->batch_notify)
+		usfstl_vhost_user_flush_used(dev, virtq_idx);
+}
+
+bool usfstl_vhost_user_dev_vring_enabled(struct usfstl_vhost_user_dev *extdev,
+					 unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	if (virtq_idx >= dev->ext.server->max_queues)
+		return false;
+
+	return dev->virtqs[virtq_idx].enabled;
+}
+
+void usfstl_vhost_user_dev_flush(struct usfstl_vhost_user_dev *extdev,
+				 unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	USFSTL_ASSERT(virtq_idx < dev->ext.server->max_queues);
+
+	usfstl_vhost_user_flush_used(dev, virtq_idx);
+}
+
+void usfstl_vhost_user_dev_notify(struct usfstl_vhost_user_dev *extdev,
+				  unsigned int virtq_idx,
+				  const uint8_t *data, size_t datalen)
+{
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = datalen,
+	};
 
-	usfstl_vhost_user_send_virtq_buf(dev, buf, virtq_idx);
-	usfstl_vhost_user_free_buf(buf);
+	usfstl_vhost_user_dev_notify_iov(extdev, virtq_idx, &iov, 1);
+}
+
+void usfstl_vhost_user_get_vq_stats(struct usfstl_vhost_user_dev *extdev,
+				    unsigned int virtq_idx,
+				    struct usfstl_vhost_user_vq_stats *stats)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	USFSTL_ASSERT(virtq_idx < dev->ext.server->max_queues);
+
+	*stats = dev->virtqs[virtq_idx].stats;
 }
 
 void usfstl_vhost_user_config_changed(struct usfstl_vhost_user_dev *dev)
@@ -843,6 +1984,14 @@ void *usfstl_vhost_user_to_va(struct usfstl_vhost_user_dev *extdev, uint64_t add
 	return NULL;
 }
 
+static bool usfstl_vhost_phys_in_region(struct usfstl_vhost_user_dev_int *dev,
+					unsigned int region, uint64_t addr)
+{
+	return addr >= dev->regions[region].guest_phys_addr &&
+	       addr < dev->regions[region].guest_phys_addr +
+		      dev->regions[region].size;
+}
+
 void *usfstl_vhost_phys_to_va(struct usfstl_vhost_user_dev *extdev, uint64_t addr)
 {
 	struct usfstl_vhost_user_dev_int *dev;
@@ -850,18 +1999,24 @@ void *usfstl_vhost_phys_to_va(struct usfstl_vhost_user_dev *extdev, uint64_t add
 
 	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
 
+	region = dev->last_region;
+	if (region < dev->n_regions &&
+	    usfstl_vhost_phys_in_region(dev, region, addr))
+		goto found;
+
 	for (region = 0; region < dev->n_regions; region++) {
-		if (addr >= dev->regions[region].guest_phys_addr &&
-		    addr < dev->regions[region].guest_phys_addr +
-			   dev->regions[region].size)
-			return (uint8_t *)dev->region_vaddr[region] +
-			       (addr -
-				dev->regions[region].guest_phys_addr +
-				dev->regions[region].mmap_offset);
+		if (usfstl_vhost_phys_in_region(dev, region, addr)) {
+			dev->last_region = region;
+			goto found;
+		}
 	}
 
 	USFSTL_ASSERT(0, "cannot translate physical address %"PRIx64"\n", addr);
 	return NULL;
+found:
+	return (uint8_t *)dev->region_vaddr[region] +
+	       (addr - dev->regions[region].guest_phys_addr +
+		dev->regions[region].mmap_offset);
 }
 
 size_t iov_len(struct iovec *sg, unsigned int nsg)
@@ -877,6 +2032,12 @@ size_t iov_len(struct iovec *sg, unsigned int nsg)
 
 size_t iov_fill(struct iovec *sg, unsigned int nsg,
 		const void *_buf, size_t buflen)
+{
+	return iov_fill_offset(sg, nsg, 0, _buf, buflen);
+}
+
+size_t iov_fill_offset(struct iovec *sg, unsigned int nsg, size_t offset,
+		       const void *_buf, size_t buflen)
 {
 	const char *buf = _buf;
 	unsigned int i;
@@ -884,9 +2045,17 @@ size_t iov_fill(struct iovec *sg, unsigned int nsg,
 
 #define min(a, b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b; })
 	for (i = 0; buflen && i < nsg; i++) {
-		size_t cpy = min(buflen, sg[i].iov_len);
+		size_t cpy;
+
+		if (offset >= sg[i].iov_len) {
+			offset -= sg[i].iov_len;
+			continue;
+		}
+
+		cpy = min(buflen, sg[i].iov_len - offset);
 
-		memcpy(sg[i].iov_base, buf, cpy);
+		memcpy((char *)sg[i].iov_base + offset, buf, cpy);
+		offset = 0;
 		buflen -= cpy;
 		copied += cpy;
 		buf += cpy;
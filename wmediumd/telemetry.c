@@ -0,0 +1,216 @@
+/*
+ * Shared memory telemetry for wmediumd
+ *
+ * Publishes a snapshot of the station state, the SNR matrix and some
+ * global counters in a file (typically in /dev/shm) that monitoring
+ * tools can map and read at any rate without talking to wmediumd.
+ * The layout is described in api.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <usfstl/loop.h>
+
+#include "wmediumd.h"
+
+static void link_stats_add(struct link_stats *sum, const struct link_stats *s)
+{
+	sum->frames += s->frames;
+	sum->bytes += s->bytes;
+	sum->retries += s->retries;
+	sum->acked += s->acked;
+	sum->dropped_per += s->dropped_per;
+	sum->dropped_cca += s->dropped_cca;
+}
+
+/*
+ * Keep the global counters monotonic: call this before the per-link
+ * statistics are cleared or freed.
+ */
+void wmediumd_account_link_stats(struct wmediumd *ctx)
+{
+	int i;
+
+	if (!ctx->link_stats)
+		return;
+
+	for (i = 0; i < ctx->num_stas * ctx->num_stas; i++)
+		link_stats_add(&ctx->link_totals, &ctx->link_stats[i]);
+}
+
+static size_t telemetry_size(int n_stas)
+{
+	return sizeof(struct wmediumd_telemetry) +
+	       n_stas * sizeof(struct wmediumd_telemetry_station) +
+	       n_stas * n_stas * sizeof(int32_t);
+}
+
+static int telemetry_map(struct wmediumd *ctx, int n_stas)
+{
+	size_t size = telemetry_size(n_stas);
+	struct wmediumd_telemetry *t;
+	u32 seq = 0;
+
+	if (ftruncate(ctx->telemetry_fd, size)) {
+		w_logf(ctx, LOG_ERR, "telemetry: cannot resize: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 ctx->telemetry_fd, 0);
+	if (t == MAP_FAILED) {
+		w_logf(ctx, LOG_ERR, "telemetry: cannot map: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	if (ctx->telemetry) {
+		seq = ctx->telemetry->seq;
+		munmap(ctx->telemetry, ctx->telemetry_size);
+	}
+
+	ctx->telemetry = t;
+	ctx->telemetry_size = size;
+	ctx->telemetry_max_stas = n_stas;
+
+	/* the update will fill in the rest, under the seqlock */
+	t->magic = WMEDIUMD_TELEMETRY_MAGIC;
+	t->version = WMEDIUMD_TELEMETRY_VERSION;
+	t->header_size = sizeof(*t);
+	t->station_size = sizeof(struct wmediumd_telemetry_station);
+	t->seq = seq;
+
+	return 0;
+}
+
+void wmediumd_telemetry_update(struct wmediumd *ctx)
+{
+	struct wmediumd_telemetry *t = ctx->telemetry;
+	struct wmediumd_telemetry_station *sta_entry;
+	struct link_stats totals;
+	struct station *station;
+	struct client *client;
+	int32_t *snr;
+	int i, n = ctx->num_stas;
+	u32 seq;
+
+	if (!t)
+		return;
+
+	if (n > ctx->telemetry_max_stas) {
+		if (telemetry_map(ctx, n))
+			return;
+		t = ctx->telemetry;
+	}
+
+	totals = ctx->link_totals;
+	if (ctx->link_stats) {
+		for (i = 0; i < n * n; i++)
+			link_stats_add(&totals, &ctx->link_stats[i]);
+	}
+
+	seq = t->seq;
+	__atomic_store_n(&t->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	t->size = ctx->telemetry_size;
+	t->updates++;
+	t->time = scheduler.current_time;
+	t->n_stations = n;
+	t->stations_offset = sizeof(*t);
+	t->snr_offset = t->stations_offset +
+			ctx->telemetry_max_stas * t->station_size;
+
+	t->n_clients = 0;
+	list_for_each_entry(client, &ctx->clients, list)
+		t->n_clients++;
+
+	t->frames = totals.frames;
+	t->bytes = totals.bytes;
+	t->retries = totals.retries;
+	t->acked = totals.acked;
+	t->dropped_per = totals.dropped_per;
+	t->dropped_cca = totals.dropped_cca;
+
+	list_for_each_entry(station, &ctx->stations, list) {
+		sta_entry = (void *)((u8 *)t + t->stations_offset +
+				     station->index * t->station_size);
+		memcpy(sta_entry->addr, station->addr, ETH_ALEN);
+		memcpy(sta_entry->hwaddr, station->hwaddr, ETH_ALEN);
+		sta_entry->bound = !!station->client;
+		sta_entry->tx_power = station->tx_power;
+		sta_entry->x = station->x;
+		sta_entry->y = station->y;
+		sta_entry->dir_x = station->dir_x;
+		sta_entry->dir_y = station->dir_y;
+	}
+
+	snr = (void *)((u8 *)t + t->snr_offset);
+	for (i = 0; i < n * n; i++)
+		snr[i] = ctx->snr_matrix[i];
+
+	__atomic_store_n(&t->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void telemetry_timer(struct usfstl_loop_entry *entry)
+{
+	struct wmediumd *ctx = entry->data;
+	uint64_t expirations;
+
+	if (read(entry->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	wmediumd_telemetry_update(ctx);
+}
+
+int wmediumd_telemetry_init(struct wmediumd *ctx, const char *path,
+			    unsigned int interval_ms)
+{
+	struct itimerspec its = {
+		.it_interval.tv_sec = interval_ms / 1000,
+		.it_interval.tv_nsec = (interval_ms % 1000) * 1000000,
+	};
+	int fd;
+
+	/* start from scratch, and don't let readers write to it */
+	unlink(path);
+	ctx->telemetry_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+				 0444);
+	if (ctx->telemetry_fd < 0) {
+		w_logf(ctx, LOG_ERR, "telemetry: cannot create %s: %s\n",
+		       path, strerror(errno));
+		return -1;
+	}
+
+	if (telemetry_map(ctx, ctx->num_stas))
+		return -1;
+
+	wmediumd_telemetry_update(ctx);
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL)) {
+		close(fd);
+		return -1;
+	}
+
+	ctx->telemetry_loop.fd = fd;
+	ctx->telemetry_loop.data = ctx;
+	ctx->telemetry_loop.handler = telemetry_timer;
+	usfstl_loop_register(&ctx->telemetry_loop);
+
+	w_logf(ctx, LOG_NOTICE, "telemetry: %s, updated every %u ms\n",
+	       path, interval_ms);
+
+	return 0;
+}
@@ -22,6 +22,8 @@
  *	02110-1301, USA.
  */
 
+#define _GNU_SOURCE /* sendmmsg() */
+
 #include <netlink/netlink.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
@@ -32,6 +34,13 @@
 #include <signal.h>
 #include <math.h>
 #include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <linux/sock_diag.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
@@ -52,12 +61,52 @@ USFSTL_SCHEDULER(scheduler);
 
 static void wmediumd_deliver_frame(struct usfstl_job *job);
 
+/*
+ * Virtqueues within a queue pair, with multiqueue pair N uses the
+ * queues N * HWSIM_NUM_VQS + HWSIM_VQ_TX/HWSIM_VQ_RX.
+ */
 enum {
 	HWSIM_VQ_TX,
 	HWSIM_VQ_RX,
 	HWSIM_NUM_VQS,
 };
 
+#define HWSIM_MAX_VQ_PAIRS	32
+
+/* frames kept per RX queue while the guest has no buffers posted */
+#define HWSIM_RX_BACKLOG	256
+
+/*
+ * The kernel doesn't wait for us, so have room for bursts of frames
+ * from mac80211_hwsim, and read at most this many datagrams per wakeup
+ * so other sockets aren't starved.
+ */
+#define HWSIM_NL_RCVBUF		(4 * 1024 * 1024)
+#define HWSIM_NL_RX_BUDGET	64
+
+/* how long stations stay bound to a disconnected vhost-user client */
+#define HWSIM_RECONNECT_GRACE	(5 * 1000000) /* usec */
+
+/*
+ * RX for a station goes to the queue pair it transmits on, so traffic
+ * for one radio doesn't hold up that of others. Fall back to the first
+ * pair if the driver didn't set up that RX queue.
+ */
+static unsigned int wmediumd_vu_rx_vq(struct client *client,
+				      struct station *station)
+{
+	unsigned int vq;
+
+	if (!station || station->client != client)
+		return HWSIM_VQ_RX;
+
+	vq = station->vq_pair * HWSIM_NUM_VQS + HWSIM_VQ_RX;
+	if (!usfstl_vhost_user_dev_vring_enabled(client->dev, vq))
+		return HWSIM_VQ_RX;
+
+	return vq;
+}
+
 static inline int div_round(int a, int b)
 {
 	return (a + b - 1) / b;
@@ -277,14 +326,25 @@ static bool is_multicast_ether_addr(const u8 *addr)
 	return 0x01 & addr[0];
 }
 
+/*
+ * Binary search in the stations sorted by address; with duplicates
+ * it finds the first one, like walking ctx->stations would.
+ */
 static struct station *get_station_by_addr(struct wmediumd *ctx, u8 *addr)
 {
-	struct station *station;
+	int lo = 0, hi = ctx->num_stas, mid;
 
-	list_for_each_entry(station, &ctx->stations, list) {
-		if (memcmp(station->addr, addr, ETH_ALEN) == 0)
-			return station;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(ctx->sta_by_addr[mid]->addr, addr, ETH_ALEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	if (lo < ctx->num_stas &&
+	    memcmp(ctx->sta_by_addr[lo]->addr, addr, ETH_ALEN) == 0)
+		return ctx->sta_by_addr[lo];
 	return NULL;
 }
 
@@ -314,6 +374,106 @@ static struct station *get_station_by_used_addr(struct wmediumd *ctx, u8 *addr)
 	return NULL;
 }
 
+static inline struct link_stats *get_link_stats(struct wmediumd *ctx,
+						 struct station *src,
+						 struct station *dst)
+{
+	return &ctx->link_stats[ctx->num_stas * src->index + dst->index];
+}
+
+static void wmediumd_remove_client(struct wmediumd *ctx, struct client *client);
+
+static void wmediumd_api_disconnect(struct wmediumd *ctx, struct client *client)
+{
+	/* may get here again from a nested handler or a failed write */
+	if (client->disconnected)
+		return;
+
+	client->disconnected = true;
+	client->wait_for_ack = false;
+	usfstl_loop_unregister(&client->loop);
+	wmediumd_remove_client(ctx, client);
+}
+
+static int64_t wmediumd_monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * API sockets are non-blocking so a slow client cannot stall reading,
+ * but messages we send must still go out completely, so wait for room
+ * in the socket buffer if needed. A client that doesn't read for
+ * WMEDIUMD_API_TX_TIMEOUT_MS would stall the whole simulation though,
+ * so give up then and let the caller disconnect it. Note that this
+ * modifies the iovec.
+ */
+static int wmediumd_api_writev(struct client *client, struct iovec *iov,
+			       int iovcnt)
+{
+	struct pollfd pfd = {
+		.fd = client->loop.fd,
+		.events = POLLOUT,
+	};
+	int64_t deadline = -1, timeout;
+	ssize_t len;
+
+	if (client->disconnected)
+		return -1;
+
+	while (iovcnt) {
+		len = writev(client->loop.fd, iov, iovcnt);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			if (deadline < 0)
+				deadline = wmediumd_monotonic_ms() +
+					   WMEDIUMD_API_TX_TIMEOUT_MS;
+			timeout = deadline - wmediumd_monotonic_ms();
+			if (timeout <= 0)
+				return -1;
+
+			if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		while (iovcnt && (size_t)len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (u8 *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+static int wmediumd_api_send(struct client *client, u32 type,
+			     const void *data, size_t len)
+{
+	struct wmediumd_message_header hdr = {
+		.type = type,
+		.data_len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr), },
+		{ .iov_base = (void *)data, .iov_len = len, },
+	};
+
+	return wmediumd_api_writev(client, iov, 2);
+}
+
 static void wmediumd_wait_for_client_ack(struct wmediumd *ctx,
 					 struct client *client)
 {
@@ -323,44 +483,400 @@ static void wmediumd_wait_for_client_ack(struct wmediumd *ctx,
 		usfstl_loop_wait_and_handle();
 }
 
-static void wmediumd_remove_client(struct wmediumd *ctx, struct client *client);
+static bool wmediumd_wants_frame_start(struct client *client,
+				       struct frame *frame)
+{
+	static const u8 any_addr[ETH_ALEN];
+
+	if (!(client->flags & WMEDIUMD_CTL_NOTIFY_TX_START))
+		return false;
+
+	if (client->tx_start_freq && client->tx_start_freq != frame->freq)
+		return false;
+
+	if (memcmp(client->tx_start_transmitter, any_addr, ETH_ALEN) &&
+	    !station_has_addr(frame->sender, client->tx_start_transmitter))
+		return false;
+
+	return true;
+}
 
 static void wmediumd_notify_frame_start(struct usfstl_job *job)
 {
 	struct frame *frame = container_of(job, struct frame, start_job);
 	struct wmediumd *ctx = job->data;
 	struct client *client, *tmp;
-	struct {
-		struct wmediumd_message_header hdr;
-		struct wmediumd_tx_start start;
-	} __attribute__((packed)) msg = {
-		.hdr.type = WMEDIUMD_MSG_TX_START,
-		.hdr.data_len = sizeof(msg.start),
-		.start.freq = frame->freq,
+	struct wmediumd_tx_start start = {
+		.freq = frame->freq,
 	};
 
 	if (ctx->ctrl)
 		usfstl_sched_ctrl_sync_to(ctx->ctrl);
 
 	list_for_each_entry_safe(client, tmp, &ctx->clients, list) {
-		if (!(client->flags & WMEDIUMD_CTL_NOTIFY_TX_START))
+		if (!wmediumd_wants_frame_start(client, frame))
 			continue;
 
 		if (client == frame->src)
-			msg.start.cookie = frame->cookie;
+			start.cookie = frame->cookie;
 		else
-			msg.start.cookie = 0;
+			start.cookie = 0;
 
 		/* must be API socket since flags cannot otherwise be set */
 		assert(client->type == CLIENT_API_SOCK);
 
-		if (write(client->loop.fd, &msg, sizeof(msg)) < sizeof(msg)) {
-			usfstl_loop_unregister(&client->loop);
-			wmediumd_remove_client(ctx, client);
+		if (wmediumd_api_send(client, WMEDIUMD_MSG_TX_START,
+				      &start, sizeof(start))) {
+			wmediumd_api_disconnect(ctx, client);
 			continue;
 		}
 
-		wmediumd_wait_for_client_ack(ctx, client);
+		/*
+		 * Waiting costs a round trip per client and frame, so only
+		 * do it for those that asked, collect the ACK later for the
+		 * others.
+		 */
+		if (client->flags & WMEDIUMD_CTL_TX_START_LOCKSTEP)
+			wmediumd_wait_for_client_ack(ctx, client);
+		else
+			client->unacked_events++;
+	}
+}
+
+static void wmediumd_flush_station_events(struct usfstl_job *job);
+
+static void wmediumd_schedule_station_events(struct wmediumd *ctx)
+{
+	if (usfstl_job_scheduled(&ctx->station_notify_job))
+		return;
+
+	if (ctx->ctrl)
+		usfstl_sched_ctrl_sync_from(ctx->ctrl);
+
+	/* flush everything that changes at this time in one go */
+	ctx->station_notify_job.start = scheduler.current_time;
+	ctx->station_notify_job.callback = wmediumd_flush_station_events;
+	ctx->station_notify_job.data = ctx;
+	ctx->station_notify_job.name = "station-events";
+	usfstl_sched_add_job(&scheduler, &ctx->station_notify_job);
+}
+
+static void wmediumd_fill_station_event(struct wmediumd_station_event *ev,
+					struct station *station)
+{
+	memcpy(ev->addr, station->addr, ETH_ALEN);
+	memcpy(ev->hwaddr, station->hwaddr, ETH_ALEN);
+	ev->bound = !!station->client;
+	ev->x = station->x;
+	ev->y = station->y;
+	ev->dir_x = station->dir_x;
+	ev->dir_y = station->dir_y;
+	ev->tx_power = station->tx_power;
+}
+
+void wmediumd_notify_station(struct wmediumd *ctx, struct station *station,
+			     u32 changed)
+{
+	struct wmediumd_station_event *ev;
+
+	if (!ctx->need_station_notify)
+		return;
+
+	if (station->event_slot) {
+		ev = &ctx->sta_events[station->event_slot - 1];
+	} else {
+		if (ctx->n_sta_events == ctx->max_sta_events) {
+			unsigned int max = ctx->max_sta_events * 2 ?: 16;
+			void *new;
+
+			new = realloc(ctx->sta_events, max * sizeof(*ev));
+			if (!new)
+				return;
+			ctx->sta_events = new;
+			ctx->max_sta_events = max;
+		}
+		ev = &ctx->sta_events[ctx->n_sta_events++];
+		ev->changed = 0;
+		station->event_slot = ctx->n_sta_events;
+	}
+
+	ev->changed |= changed;
+	wmediumd_fill_station_event(ev, station);
+
+	/* the station is going away, anything later is a new station */
+	if (changed & WMEDIUMD_STA_EV_REMOVED) {
+		ev->changed = WMEDIUMD_STA_EV_REMOVED;
+		station->event_slot = 0;
+	}
+
+	wmediumd_schedule_station_events(ctx);
+}
+
+static void wmediumd_notify_all_stations(struct wmediumd *ctx, u32 changed)
+{
+	struct station *station;
+
+	list_for_each_entry(station, &ctx->stations, list)
+		wmediumd_notify_station(ctx, station, changed);
+}
+
+/* all stations, as added, for new subscribers */
+static struct wmediumd_station_event *
+wmediumd_station_snapshot(struct wmediumd *ctx, unsigned int *n_stations)
+{
+	struct wmediumd_station_event *events, *ev;
+	struct station *station;
+	unsigned int n = 0;
+
+	list_for_each_entry(station, &ctx->stations, list)
+		n++;
+
+	events = calloc(n ?: 1, sizeof(*events));
+	if (!events)
+		return NULL;
+
+	ev = events;
+	list_for_each_entry(station, &ctx->stations, list) {
+		ev->changed = WMEDIUMD_STA_EV_ADDED;
+		wmediumd_fill_station_event(ev, station);
+		ev++;
+	}
+
+	*n_stations = n;
+	return events;
+}
+
+/* all links and their current SNR, for new subscribers */
+static struct wmediumd_link_event *
+wmediumd_link_snapshot(struct wmediumd *ctx, unsigned int *n_links)
+{
+	struct wmediumd_link_event *events, *ev;
+	int i, j, n = ctx->num_stas;
+
+	events = calloc(n * n ?: 1, sizeof(*events));
+	if (!events)
+		return NULL;
+
+	ev = events;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			if (i == j)
+				continue;
+			memcpy(ev->src, ctx->sta_array[i]->addr, ETH_ALEN);
+			memcpy(ev->dst, ctx->sta_array[j]->addr, ETH_ALEN);
+			ev->snr = ctx->snr_matrix[n * i + j];
+			ev++;
+		}
+	}
+
+	*n_links = ev - events;
+	return events;
+}
+
+/*
+ * Mark the links from/to the station (or all links, if NULL) as possibly
+ * changed, they're compared against what was reported when flushing.
+ */
+void wmediumd_notify_link_snr(struct wmediumd *ctx, struct station *station)
+{
+	if (!ctx->need_link_notify)
+		return;
+
+	if (station)
+		station->snr_dirty = true;
+	else
+		ctx->snr_all_dirty = true;
+
+	wmediumd_schedule_station_events(ctx);
+}
+
+static void wmediumd_update_link_snr_threshold(struct wmediumd *ctx)
+{
+	struct client *client;
+
+	ctx->link_snr_threshold = INT_MAX;
+	list_for_each_entry(client, &ctx->clients, list) {
+		if (!(client->flags & WMEDIUMD_CTL_NOTIFY_LINK_SNR))
+			continue;
+		ctx->link_snr_threshold = min(ctx->link_snr_threshold,
+					      (int)min(client->link_snr_threshold,
+						       (u32)INT_MAX));
+	}
+}
+
+static bool wmediumd_check_link(struct wmediumd *ctx, int from, int to,
+				unsigned int n_links)
+{
+	int idx = ctx->num_stas * from + to;
+	int snr = ctx->snr_matrix[idx];
+	int prev = ctx->notified_snr[idx];
+	struct wmediumd_link_event *ev;
+
+	if (from == to || snr == prev)
+		return false;
+
+	/* the first value of a link is always reported */
+	if (prev != INT_MIN && abs(snr - prev) < ctx->link_snr_threshold)
+		return false;
+
+	if (n_links == ctx->max_link_events) {
+		unsigned int max = ctx->max_link_events * 2 ?: 16;
+		void *new;
+
+		new = realloc(ctx->link_events, max * sizeof(*ev));
+		if (!new)
+			return false;
+		ctx->link_events = new;
+		ctx->max_link_events = max;
+	}
+
+	ev = &ctx->link_events[n_links];
+	memcpy(ev->src, ctx->sta_array[from]->addr, ETH_ALEN);
+	memcpy(ev->dst, ctx->sta_array[to]->addr, ETH_ALEN);
+	ev->snr = snr;
+	ctx->notified_snr[idx] = snr;
+
+	return true;
+}
+
+static unsigned int wmediumd_collect_link_events(struct wmediumd *ctx)
+{
+	unsigned int n_links = 0;
+	int i, j, n = ctx->num_stas;
+
+	if (ctx->notified_snr_stas != n) {
+		free(ctx->notified_snr);
+		ctx->notified_snr = malloc(sizeof(int) * n * n);
+		if (!ctx->notified_snr) {
+			ctx->notified_snr_stas = 0;
+			return 0;
+		}
+		/* nothing reported yet, so report every link once */
+		for (i = 0; i < n * n; i++)
+			ctx->notified_snr[i] = INT_MIN;
+		ctx->notified_snr_stas = n;
+		ctx->snr_all_dirty = true;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!ctx->snr_all_dirty && !ctx->sta_array[i]->snr_dirty)
+			continue;
+
+		for (j = 0; j < n; j++) {
+			n_links += wmediumd_check_link(ctx, i, j, n_links);
+			if (!ctx->snr_all_dirty)
+				n_links += wmediumd_check_link(ctx, j, i,
+							       n_links);
+		}
+	}
+
+	return n_links;
+}
+
+static void wmediumd_flush_station_events(struct usfstl_job *job)
+{
+	struct wmediumd *ctx = job->data;
+	struct wmediumd_station_event *sta_events = ctx->sta_events;
+	unsigned int n_sta_events = ctx->n_sta_events;
+	unsigned int max_sta_events = ctx->max_sta_events;
+	unsigned int n_links = 0;
+	struct wmediumd_station_event *all_stations = NULL;
+	struct wmediumd_link_event *all_links = NULL;
+	unsigned int n_all_stations = 0, n_all_links = 0;
+	struct client *client, *tmp;
+	struct station *station;
+
+	if (ctx->need_link_notify)
+		n_links = wmediumd_collect_link_events(ctx);
+
+	list_for_each_entry(station, &ctx->stations, list) {
+		station->event_slot = 0;
+		station->snr_dirty = false;
+	}
+	ctx->snr_all_dirty = false;
+
+	/*
+	 * Take the events, removing a client below can generate new
+	 * ones and those will go out with the next flush.
+	 */
+	ctx->sta_events = NULL;
+	ctx->n_sta_events = 0;
+	ctx->max_sta_events = 0;
+
+	list_for_each_entry_safe(client, tmp, &ctx->clients, list) {
+		struct wmediumd_message_header hdr = {
+			.type = WMEDIUMD_MSG_STATION_EVENTS,
+		};
+		struct wmediumd_station_events events = {};
+		struct wmediumd_station_event *stations = sta_events;
+		struct wmediumd_link_event *links = ctx->link_events;
+		u32 snapshot = client->snapshot_pending & client->flags;
+		struct iovec iov[4];
+		size_t len;
+
+		client->snapshot_pending = 0;
+
+		/*
+		 * New subscribers get the full picture instead, it has
+		 * all the changes as well.
+		 */
+		if (snapshot & WMEDIUMD_CTL_NOTIFY_STATIONS && !all_stations)
+			all_stations = wmediumd_station_snapshot(ctx,
+								 &n_all_stations);
+		if (snapshot & WMEDIUMD_CTL_NOTIFY_LINK_SNR && !all_links)
+			all_links = wmediumd_link_snapshot(ctx, &n_all_links);
+
+		if (client->flags & WMEDIUMD_CTL_NOTIFY_STATIONS) {
+			events.n_stations = n_sta_events;
+			if (snapshot & WMEDIUMD_CTL_NOTIFY_STATIONS &&
+			    all_stations) {
+				stations = all_stations;
+				events.n_stations = n_all_stations;
+			}
+		}
+		if (client->flags & WMEDIUMD_CTL_NOTIFY_LINK_SNR) {
+			events.n_links = n_links;
+			if (snapshot & WMEDIUMD_CTL_NOTIFY_LINK_SNR &&
+			    all_links) {
+				links = all_links;
+				events.n_links = n_all_links;
+			}
+		}
+		if (!events.n_stations && !events.n_links)
+			continue;
+
+		/* must be API socket since flags cannot otherwise be set */
+		assert(client->type == CLIENT_API_SOCK);
+
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = &events;
+		iov[1].iov_len = sizeof(events);
+		iov[2].iov_base = stations;
+		iov[2].iov_len = events.n_stations * sizeof(*stations);
+		iov[3].iov_base = links;
+		iov[3].iov_len = events.n_links * sizeof(*links);
+
+		len = iov_len(iov, 4);
+		hdr.data_len = len - sizeof(hdr);
+
+		if (wmediumd_api_writev(client, iov, 4)) {
+			wmediumd_api_disconnect(ctx, client);
+			continue;
+		}
+
+		client->unacked_events++;
+	}
+
+	free(all_stations);
+	free(all_links);
+
+	/* keep the buffer around unless new events came in meanwhile */
+	if (!ctx->sta_events) {
+		ctx->sta_events = sta_events;
+		ctx->max_sta_events = max_sta_events;
+	} else {
+		free(sta_events);
 	}
 }
 
@@ -521,6 +1037,17 @@ static void queue_frame(struct wmediumd *ctx, struct station *station,
 		}
 	}
 
+	if (deststa) {
+		struct link_stats *stats = get_link_stats(ctx, station, deststa);
+
+		stats->frames++;
+		stats->bytes += frame->data_len;
+		if (retries)
+			stats->retries += retries - 1;
+		if (!is_acked)
+			stats->dropped_per++;
+	}
+
 	if (is_acked) {
 		frame->tx_rates[i-1].count = j + 1;
 		for (; i < frame->tx_rates_count; i++) {
@@ -588,45 +1115,127 @@ static void queue_frame(struct wmediumd *ctx, struct station *station,
 	list_add_tail(&frame->list, &queue->frames);
 }
 
+/*
+ * Send a message to the client, @iov are the pieces of a complete
+ * netlink message (at most WMEDIUMD_MSG_IOV_MAX of them).
+ */
+#define WMEDIUMD_MSG_IOV_MAX	5
+
+/*
+ * Messages to the kernel are collected during a delivery and sent with
+ * a single sendmmsg() by wmediumd_nl_flush(). Small pieces (headers,
+ * usually on the stack) are copied, larger ones (the frame data) are
+ * referenced and must stay valid until the flush.
+ */
+#define NL_BATCH_MAX		64
+#define NL_BATCH_INLINE		128
+
+struct nl_batch {
+	unsigned int n;
+	struct mmsghdr msgs[NL_BATCH_MAX];
+	struct iovec iov[NL_BATCH_MAX][WMEDIUMD_MSG_IOV_MAX];
+	u8 buf[NL_BATCH_MAX][WMEDIUMD_MSG_IOV_MAX * NL_BATCH_INLINE];
+};
+
+static void wmediumd_nl_flush(struct wmediumd *ctx)
+{
+	struct nl_batch *batch = ctx->nl_batch;
+	unsigned int done = 0;
+	int ret;
+
+	if (!batch)
+		return;
+
+	while (done < batch->n) {
+		ret = sendmmsg(nl_socket_get_fd(ctx->sock),
+			       batch->msgs + done, batch->n - done, 0);
+		ctx->nl_stats.tx_syscalls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			w_logf(ctx, LOG_ERR, "%s: sendmmsg failed: %s\n",
+			       __func__, strerror(errno));
+			/* skip the message that failed */
+			ret = 1;
+			ctx->nl_stats.tx_errors++;
+		}
+		done += ret;
+	}
+
+	batch->n = 0;
+}
+
+static void wmediumd_nl_batch_add(struct wmediumd *ctx,
+				  const struct iovec *iov, int iovcnt)
+{
+	struct nl_batch *batch = ctx->nl_batch;
+	struct iovec *dst;
+	u8 *buf;
+	int i;
+
+	if (batch->n == NL_BATCH_MAX)
+		wmediumd_nl_flush(ctx);
+
+	dst = batch->iov[batch->n];
+	buf = batch->buf[batch->n];
+
+	for (i = 0; i < iovcnt; i++) {
+		dst[i] = iov[i];
+		if (iov[i].iov_len > NL_BATCH_INLINE)
+			continue;
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		dst[i].iov_base = buf;
+		buf += iov[i].iov_len;
+	}
+
+	memset(&batch->msgs[batch->n], 0, sizeof(batch->msgs[0]));
+	batch->msgs[batch->n].msg_hdr.msg_iov = dst;
+	batch->msgs[batch->n].msg_hdr.msg_iovlen = iovcnt;
+	batch->n++;
+	ctx->nl_stats.tx_msgs++;
+}
+
 static void wmediumd_send_to_client(struct wmediumd *ctx,
 				    struct client *client,
-				    struct nl_msg *msg)
+				    struct station *station,
+				    const struct iovec *iov, int iovcnt)
 {
-	struct wmediumd_message_header hdr;
-	size_t len;
-	int ret;
+	struct iovec api_iov[1 + WMEDIUMD_MSG_IOV_MAX];
+	struct wmediumd_message_header hdr = {
+		.type = WMEDIUMD_MSG_NETLINK,
+	};
+	int i;
+
+	assert(iovcnt <= WMEDIUMD_MSG_IOV_MAX);
 
 	switch (client->type) {
 	case CLIENT_NETLINK:
-		ret = nl_send_auto_complete(ctx->sock, msg);
-		if (ret < 0)
-			w_logf(ctx, LOG_ERR, "%s: nl_send_auto failed\n", __func__);
+		wmediumd_nl_batch_add(ctx, iov, iovcnt);
 		break;
 	case CLIENT_VHOST_USER:
-		len = nlmsg_total_size(nlmsg_datalen(nlmsg_hdr(msg)));
-		usfstl_vhost_user_dev_notify(client->dev, HWSIM_VQ_RX,
-					     (void *)nlmsg_hdr(msg), len);
+		/* TX status for a frame queued before disconnecting */
+		if (client->zombie)
+			break;
+		usfstl_vhost_user_dev_notify_iov(client->dev,
+						 wmediumd_vu_rx_vq(client, station),
+						 iov, iovcnt);
 		break;
 	case CLIENT_API_SOCK:
-		len = nlmsg_total_size(nlmsg_datalen(nlmsg_hdr(msg)));
-		hdr.type = WMEDIUMD_MSG_NETLINK;
-		hdr.data_len = len;
-
-		if (write(client->loop.fd, &hdr, sizeof(hdr)) < sizeof(hdr))
-			goto disconnect;
+		api_iov[0].iov_base = &hdr;
+		api_iov[0].iov_len = sizeof(hdr);
+		for (i = 0; i < iovcnt; i++) {
+			api_iov[1 + i] = iov[i];
+			hdr.data_len += iov[i].iov_len;
+		}
 
-		if (write(client->loop.fd, (void *)nlmsg_hdr(msg), len) < len)
-			goto disconnect;
+		if (wmediumd_api_writev(client, api_iov, 1 + iovcnt)) {
+			wmediumd_api_disconnect(ctx, client);
+			break;
+		}
 
 		wmediumd_wait_for_client_ack(ctx, client);
 		break;
 	}
-
-	return;
-
-	disconnect:
-	usfstl_loop_unregister(&client->loop);
-	wmediumd_remove_client(ctx, client);
 }
 
 static void wmediumd_remove_client(struct wmediumd *ctx, struct client *client)
@@ -637,8 +1246,12 @@ static void wmediumd_remove_client(struct wmediumd *ctx, struct client *client)
 	int ac;
 
 	list_for_each_entry(station, &ctx->stations, list) {
-		if (station->client == client)
+		if (station->client == client) {
 			station->client = NULL;
+			station->vq_pair = 0;
+			wmediumd_notify_station(ctx, station,
+						WMEDIUMD_STA_EV_CLIENT);
+		}
 	}
 
 	list_for_each_entry(station, &ctx->stations, list) {
@@ -661,48 +1274,165 @@ static void wmediumd_remove_client(struct wmediumd *ctx, struct client *client)
 
 	if (client->flags & WMEDIUMD_CTL_NOTIFY_TX_START)
 		ctx->need_start_notify--;
+	if (client->flags & WMEDIUMD_CTL_NOTIFY_STATIONS)
+		ctx->need_station_notify--;
+	if (client->flags & WMEDIUMD_CTL_NOTIFY_LINK_SNR) {
+		ctx->need_link_notify--;
+		wmediumd_update_link_snr_threshold(ctx);
+	}
 
 	client->wait_for_ack = false;
 }
 
 /*
- * Report transmit status to the kernel.
+ * The layout of the messages we send never changes, so rather than
+ * building them with libnl, copy a template and fill in the variable
+ * fields; the frame itself is referenced by the iovec, not copied.
  */
-static void send_tx_info_frame_nl(struct wmediumd *ctx, struct frame *frame)
+struct tx_info_frame_msg {
+	struct nlmsghdr nlh;
+	struct genlmsghdr genlh;
+	struct nlattr transmitter;
+	u8 transmitter_addr[ETH_ALEN];
+	u8 transmitter_pad[NLA_ALIGN(ETH_ALEN) - ETH_ALEN];
+	struct nlattr flags;
+	u32 flags_val;
+	struct nlattr signal;
+	u32 signal_val;
+	struct nlattr cookie;
+	u64 cookie_val;
+	/* last, so it's simply cut short for fewer rates */
+	struct nlattr tx_info;
+	struct hwsim_tx_rate tx_rates[IEEE80211_TX_MAX_RATES];
+} __attribute__((packed));
+
+#define NLA_TEMPLATE(type, len) { .nla_len = NLA_HDRLEN + (len), .nla_type = (type) }
+
+static const struct tx_info_frame_msg tx_info_frame_template = {
+	.nlh.nlmsg_flags = NLM_F_REQUEST,
+	.genlh.cmd = HWSIM_CMD_TX_INFO_FRAME,
+	.genlh.version = VERSION_NR,
+	.transmitter = NLA_TEMPLATE(HWSIM_ATTR_ADDR_TRANSMITTER, ETH_ALEN),
+	.flags = NLA_TEMPLATE(HWSIM_ATTR_FLAGS, sizeof(u32)),
+	.signal = NLA_TEMPLATE(HWSIM_ATTR_SIGNAL, sizeof(u32)),
+	.cookie = NLA_TEMPLATE(HWSIM_ATTR_COOKIE, sizeof(u64)),
+};
+
+/* returns the length of the message */
+static size_t fill_tx_info_frame_msg(struct wmediumd *ctx,
+				     struct tx_info_frame_msg *msg,
+				     struct frame *frame)
 {
-	struct nl_msg *msg;
-
-	msg = nlmsg_alloc();
-	if (!msg) {
-		w_logf(ctx, LOG_ERR, "Error allocating new message MSG!\n");
-		return;
-	}
-
-	if (genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, ctx->family_id,
-			0, NLM_F_REQUEST, HWSIM_CMD_TX_INFO_FRAME,
-			VERSION_NR) == NULL) {
-		w_logf(ctx, LOG_ERR, "%s: genlmsg_put failed\n", __func__);
-		goto out;
-	}
+	size_t rates_len = frame->tx_rates_count * sizeof(struct hwsim_tx_rate);
+
+	*msg = tx_info_frame_template;
+	msg->nlh.nlmsg_len = offsetof(struct tx_info_frame_msg, tx_rates) +
+			     NLA_ALIGN(rates_len);
+	msg->nlh.nlmsg_type = ctx->family_id;
+	memcpy(msg->transmitter_addr, frame->sender->hwaddr, ETH_ALEN);
+	msg->flags_val = frame->flags;
+	msg->signal_val = frame->signal;
+	msg->cookie_val = frame->cookie;
+	msg->tx_info.nla_type = HWSIM_ATTR_TX_INFO;
+	msg->tx_info.nla_len = NLA_HDRLEN + rates_len;
+	memcpy(msg->tx_rates, frame->tx_rates, rates_len);
+
+	return msg->nlh.nlmsg_len;
+}
 
-	if (nla_put(msg, HWSIM_ATTR_ADDR_TRANSMITTER, ETH_ALEN,
-		    frame->sender->hwaddr) ||
-	    nla_put_u32(msg, HWSIM_ATTR_FLAGS, frame->flags) ||
-	    nla_put_u32(msg, HWSIM_ATTR_SIGNAL, frame->signal) ||
-	    nla_put(msg, HWSIM_ATTR_TX_INFO,
-		    frame->tx_rates_count * sizeof(struct hwsim_tx_rate),
-		    frame->tx_rates) ||
-	    nla_put_u64(msg, HWSIM_ATTR_COOKIE, frame->cookie)) {
-		w_logf(ctx, LOG_ERR, "%s: Failed to fill a payload\n", __func__);
-		goto out;
-	}
+/*
+ * Report transmit status to the kernel.
+ */
+static void send_tx_info_frame_nl(struct wmediumd *ctx, struct frame *frame)
+{
+	struct tx_info_frame_msg msg;
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = fill_tx_info_frame_msg(ctx, &msg, frame),
+	};
 
 	if (ctx->ctrl)
 		usfstl_sched_ctrl_sync_to(ctx->ctrl);
-	wmediumd_send_to_client(ctx, frame->src, msg);
+	wmediumd_send_to_client(ctx, frame->src, frame->sender, &iov, 1);
+}
 
-out:
-	nlmsg_free(msg);
+/*
+ * The RX message as pieces: the template parts, the frame data, and
+ * its padding. The cookie is only sent to the client that transmitted
+ * the frame, if it asked for all frames (WMEDIUMD_CTL_RX_ALL_FRAMES).
+ */
+struct cloned_frame_iov {
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genlh;
+		struct nlattr receiver;
+		u8 receiver_addr[ETH_ALEN];
+		u8 receiver_pad[NLA_ALIGN(ETH_ALEN) - ETH_ALEN];
+		struct nlattr frame;
+	} __attribute__((packed)) head;
+	struct {
+		struct nlattr rx_rate;
+		u32 rx_rate_val;
+		struct nlattr freq;
+		u32 freq_val;
+		struct nlattr signal;
+		u32 signal_val;
+	} __attribute__((packed)) tail;
+	struct {
+		struct nlattr cookie;
+		u64 cookie_val;
+	} __attribute__((packed)) cookie;
+	struct iovec iov[5];
+};
+
+static const struct cloned_frame_iov cloned_frame_template = {
+	.head = {
+		.nlh.nlmsg_flags = NLM_F_REQUEST,
+		.genlh.cmd = HWSIM_CMD_FRAME,
+		.genlh.version = VERSION_NR,
+		.receiver = NLA_TEMPLATE(HWSIM_ATTR_ADDR_RECEIVER, ETH_ALEN),
+		.frame.nla_type = HWSIM_ATTR_FRAME,
+	},
+	.tail = {
+		.rx_rate = NLA_TEMPLATE(HWSIM_ATTR_RX_RATE, sizeof(u32)),
+		.rx_rate_val = 1,
+		.freq = NLA_TEMPLATE(HWSIM_ATTR_FREQ, sizeof(u32)),
+		.signal = NLA_TEMPLATE(HWSIM_ATTR_SIGNAL, sizeof(u32)),
+	},
+	.cookie.cookie = NLA_TEMPLATE(HWSIM_ATTR_COOKIE, sizeof(u64)),
+};
+
+static void fill_cloned_frame_iov(struct wmediumd *ctx,
+				  struct cloned_frame_iov *rx,
+				  struct station *dst, u8 *data, int data_len,
+				  int signal, int freq, u64 cookie)
+{
+	static const u8 pad[NLA_ALIGNTO];
+
+	rx->head = cloned_frame_template.head;
+	rx->head.nlh.nlmsg_len = sizeof(rx->head) + NLA_ALIGN(data_len) +
+				 sizeof(rx->tail);
+	rx->head.nlh.nlmsg_type = ctx->family_id;
+	memcpy(rx->head.receiver_addr, dst->hwaddr, ETH_ALEN);
+	rx->head.frame.nla_len = NLA_HDRLEN + data_len;
+
+	rx->tail = cloned_frame_template.tail;
+	rx->tail.freq_val = freq;
+	rx->tail.signal_val = signal;
+
+	rx->cookie = cloned_frame_template.cookie;
+	rx->cookie.cookie_val = cookie;
+
+	rx->iov[0].iov_base = &rx->head;
+	rx->iov[0].iov_len = sizeof(rx->head);
+	rx->iov[1].iov_base = data;
+	rx->iov[1].iov_len = data_len;
+	rx->iov[2].iov_base = (void *)pad;
+	rx->iov[2].iov_len = NLA_ALIGN(data_len) - data_len;
+	rx->iov[3].iov_base = &rx->tail;
+	rx->iov[3].iov_len = sizeof(rx->tail);
+	rx->iov[4].iov_base = &rx->cookie;
+	rx->iov[4].iov_len = sizeof(rx->cookie);
 }
 
 /*
@@ -714,30 +1444,8 @@ static void send_cloned_frame_msg(struct wmediumd *ctx, struct client *src,
 				  uint64_t cookie)
 {
 	struct client *client, *tmp;
-	struct nl_msg *msg, *cmsg = NULL;
-
-	msg = nlmsg_alloc();
-	if (!msg) {
-		w_logf(ctx, LOG_ERR, "Error allocating new message MSG!\n");
-		return;
-	}
-
-	if (genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, ctx->family_id,
-			0, NLM_F_REQUEST, HWSIM_CMD_FRAME,
-			VERSION_NR) == NULL) {
-		w_logf(ctx, LOG_ERR, "%s: genlmsg_put failed\n", __func__);
-		goto out;
-	}
-
-	if (nla_put(msg, HWSIM_ATTR_ADDR_RECEIVER, ETH_ALEN,
-		    dst->hwaddr) ||
-	    nla_put(msg, HWSIM_ATTR_FRAME, data_len, data) ||
-	    nla_put_u32(msg, HWSIM_ATTR_RX_RATE, 1) ||
-	    nla_put_u32(msg, HWSIM_ATTR_FREQ, freq) ||
-	    nla_put_u32(msg, HWSIM_ATTR_SIGNAL, signal)) {
-		w_logf(ctx, LOG_ERR, "%s: Failed to fill a payload\n", __func__);
-		goto out;
-	}
+	struct cloned_frame_iov rx;
+	u32 len;
 
 	w_logf(ctx, LOG_DEBUG, "cloned msg dest " MAC_FMT " (radio: " MAC_FMT ") len %d\n",
 		   MAC_ARGS(dst->addr), MAC_ARGS(dst->hwaddr), data_len);
@@ -745,26 +1453,47 @@ static void send_cloned_frame_msg(struct wmediumd *ctx, struct client *src,
 	if (ctx->ctrl)
 		usfstl_sched_ctrl_sync_to(ctx->ctrl);
 
+	fill_cloned_frame_iov(ctx, &rx, dst, data, data_len, signal, freq,
+			      cookie);
+	len = rx.head.nlh.nlmsg_len;
+
 	list_for_each_entry_safe(client, tmp, &ctx->clients, list) {
 		if (client->flags & WMEDIUMD_CTL_RX_ALL_FRAMES) {
-			if (src == client && !cmsg) {
-				struct nlmsghdr *nlh = nlmsg_hdr(msg);
-
-				cmsg = nlmsg_inherit(nlh);
-				nlmsg_append(cmsg, nlmsg_data(nlh), nlmsg_datalen(nlh), 0);
-				assert(nla_put_u64(cmsg, HWSIM_ATTR_COOKIE, cookie) == 0);
+			if (src == client) {
+				/* with the cookie attribute appended */
+				rx.head.nlh.nlmsg_len = len + sizeof(rx.cookie);
+				wmediumd_send_to_client(ctx, client, dst,
+							rx.iov, 5);
+				rx.head.nlh.nlmsg_len = len;
+			} else {
+				wmediumd_send_to_client(ctx, client, dst,
+							rx.iov, 4);
 			}
-			wmediumd_send_to_client(ctx, client,
-						src == client ? cmsg : msg);
-		} else if (!dst->client || dst->client == client) {
-			wmediumd_send_to_client(ctx, client, msg);
+		} else if (!dst->client || dst->client->zombie ||
+			   dst->client == client) {
+			wmediumd_send_to_client(ctx, client, dst, rx.iov, 4);
 		}
 	}
+}
 
-out:
-	nlmsg_free(msg);
-	if (cmsg)
-		nlmsg_free(cmsg);
+/*
+ * Return all RX buffers filled during this delivery to the guests, so
+ * each of them gets at most a single interrupt for it.
+ */
+static void wmediumd_flush_vhost_clients(struct wmediumd *ctx)
+{
+	struct client *client;
+	unsigned int pair;
+
+	list_for_each_entry(client, &ctx->clients, list) {
+		if (client->type != CLIENT_VHOST_USER)
+			continue;
+
+		for (pair = 0; pair < ctx->vu_queue_pairs; pair++)
+			usfstl_vhost_user_dev_flush(client->dev,
+						    pair * HWSIM_NUM_VQS +
+						    HWSIM_VQ_RX);
+	}
 }
 
 static void wmediumd_deliver_frame(struct usfstl_job *job)
@@ -772,6 +1501,7 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 	struct wmediumd *ctx = job->data;
 	struct frame *frame = container_of(job, struct frame, job);
 	struct ieee80211_hdr *hdr = (void *) frame->data;
+	struct link_stats *stats;
 	struct station *station;
 	u8 *dest = hdr->addr1;
 	u8 *src = frame->sender->addr;
@@ -788,6 +1518,11 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 				int snr, rate_idx, signal;
 				double error_prob;
 
+				stats = get_link_stats(ctx, frame->sender,
+						       station);
+				stats->frames++;
+				stats->bytes += frame->data_len;
+
 				/*
 				 * we may or may not receive this based on
 				 * reverse link from sender -- check for
@@ -797,13 +1532,17 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 							station);
 				snr += ctx->get_fading_signal(ctx);
 				signal = snr + NOISE_LEVEL;
-				if (signal < CCA_THRESHOLD)
+				if (signal < CCA_THRESHOLD) {
+					stats->dropped_cca++;
 					continue;
+				}
 
 				if (set_interference_duration(ctx,
 					frame->sender->index, frame->duration,
-					signal))
+					signal)) {
+					stats->dropped_cca++;
 					continue;
+				}
 
 				snr -= get_signal_offset_by_interference(ctx,
 					frame->sender->index, station->index);
@@ -817,9 +1556,11 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 					w_logf(ctx, LOG_INFO, "Dropped mcast from "
 						   MAC_FMT " to " MAC_FMT " at receiver\n",
 						   MAC_ARGS(src), MAC_ARGS(station->addr));
+					stats->dropped_per++;
 					continue;
 				}
 
+				stats->acked++;
 				send_cloned_frame_msg(ctx, frame->sender->client,
 						      station,
 						      frame->data,
@@ -829,10 +1570,17 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 						      frame->cookie);
 
 			} else if (station_has_addr(station, dest)) {
+				stats = get_link_stats(ctx, frame->sender,
+						       station);
+
 				if (set_interference_duration(ctx,
 					frame->sender->index, frame->duration,
-					frame->signal))
+					frame->signal)) {
+					stats->dropped_cca++;
 					continue;
+				}
+
+				stats->acked++;
 
 				send_cloned_frame_msg(ctx, frame->sender->client,
 						      station,
@@ -849,6 +1597,9 @@ static void wmediumd_deliver_frame(struct usfstl_job *job)
 
 	send_tx_info_frame_nl(ctx, frame);
 
+	wmediumd_flush_vhost_clients(ctx);
+	wmediumd_nl_flush(ctx);
+
 	free(frame);
 }
 
@@ -888,84 +1639,230 @@ int nl_err_cb(struct sockaddr_nl *nla, struct nlmsgerr *nlerr, void *arg)
  * Handle events from the kernel.  Process CMD_FRAME events and queue them
  * for later delivery with the scheduler.
  */
-static void _process_messages(struct nl_msg *msg,
+/*
+ * The guest behind a disconnected vhost-user client is back on @client,
+ * move its stations and queued frames over.
+ */
+static void wmediumd_vu_reconnected(struct wmediumd *ctx,
+				    struct client *zombie,
+				    struct client *client)
+{
+	struct station *station;
+	struct frame *frame;
+	int ac;
+
+	list_for_each_entry(station, &ctx->stations, list) {
+		if (station->client == zombie) {
+			station->client = client;
+			wmediumd_notify_station(ctx, station,
+						WMEDIUMD_STA_EV_CLIENT);
+		}
+
+		for (ac = 0; ac < IEEE80211_NUM_ACS; ac++) {
+			list_for_each_entry(frame, &station->queues[ac].frames,
+					    list) {
+				if (frame->src == zombie)
+					frame->src = client;
+			}
+		}
+	}
+
+	usfstl_sched_del_job(&zombie->grace_job);
+	list_add(&zombie->list, &ctx->clients_to_free);
+}
+
+/* the HWSIM_CMD_FRAME attributes we use, pointing into the message */
+struct hwsim_frame_attrs {
+	u8 *hwaddr;
+	u8 *data;
+	unsigned int data_len;
+	u32 flags;
+	struct hwsim_tx_rate *tx_rates;
+	unsigned int tx_rates_len;
+	u64 cookie;
+	u32 freq;
+};
+
+#define HWSIM_FRAME_ATTRS_REQUIRED	((1U << HWSIM_ATTR_ADDR_TRANSMITTER) | \
+					 (1U << HWSIM_ATTR_FRAME) | \
+					 (1U << HWSIM_ATTR_FLAGS) | \
+					 (1U << HWSIM_ATTR_TX_INFO) | \
+					 (1U << HWSIM_ATTR_COOKIE))
+
+/*
+ * Every frame goes through here, so rather than filling a full
+ * attribute table with genlmsg_parse(), pick out what we need in a
+ * single pass, directly from the message. Returns 0 if all the
+ * required attributes are there and long enough. The message may
+ * still be in guest memory, so it's bounded by the @msg_len that
+ * was validated already, not by what nlmsg_len says now.
+ */
+static int parse_frame_attrs(struct nlmsghdr *nlh, unsigned int msg_len,
+			     struct hwsim_frame_attrs *fa)
+{
+	struct nlattr *nla;
+	u8 *payload;
+	unsigned int len, plen, aligned, type;
+	int rem;
+	u32 seen = 0;
+
+	memset(fa, 0, sizeof(*fa));
+	fa->freq = 2412;
+
+	nla = (void *)((u8 *)nlmsg_data(nlh) + GENL_HDRLEN);
+	rem = msg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+
+	while (rem >= (int)NLA_HDRLEN) {
+		len = nla->nla_len;
+		if (len < NLA_HDRLEN || len > (unsigned int)rem)
+			return -1;
+
+		payload = (u8 *)nla + NLA_HDRLEN;
+		plen = len - NLA_HDRLEN;
+		type = nla->nla_type & NLA_TYPE_MASK;
+
+		switch (type) {
+		case HWSIM_ATTR_ADDR_TRANSMITTER:
+			if (plen < ETH_ALEN)
+				return -1;
+			fa->hwaddr = payload;
+			break;
+		case HWSIM_ATTR_FRAME:
+			fa->data = payload;
+			fa->data_len = plen;
+			break;
+		case HWSIM_ATTR_FLAGS:
+			if (plen < sizeof(u32))
+				return -1;
+			memcpy(&fa->flags, payload, sizeof(u32));
+			break;
+		case HWSIM_ATTR_TX_INFO:
+			fa->tx_rates = (void *)payload;
+			fa->tx_rates_len = plen;
+			break;
+		case HWSIM_ATTR_COOKIE:
+			if (plen < sizeof(u64))
+				return -1;
+			memcpy(&fa->cookie, payload, sizeof(u64));
+			break;
+		case HWSIM_ATTR_FREQ:
+			if (plen < sizeof(u32))
+				return -1;
+			memcpy(&fa->freq, payload, sizeof(u32));
+			break;
+		}
+
+		if (type < 32)
+			seen |= (1U << type);
+
+		aligned = NLA_ALIGN(len);
+		if (aligned >= (unsigned int)rem)
+			break;
+		nla = (void *)((u8 *)nla + aligned);
+		rem -= aligned;
+	}
+
+	if ((seen & HWSIM_FRAME_ATTRS_REQUIRED) != HWSIM_FRAME_ATTRS_REQUIRED)
+		return -1;
+
+	return 0;
+}
+
+static void process_frame_message(struct wmediumd *ctx,
+				  struct client *client,
+				  struct nlmsghdr *nlh,
+				  unsigned int msg_len)
+{
+	struct hwsim_frame_attrs fa;
+	struct ieee80211_hdr *hdr;
+	struct station *sender;
+	struct frame *frame;
+	u8 *src;
+
+	if (parse_frame_attrs(nlh, msg_len, &fa)) {
+		w_logf(ctx, LOG_ERR, "Invalid HWSIM_CMD_FRAME message\n");
+		return;
+	}
+
+	if (fa.data_len < 6 + 6 + 4)
+		return;
+
+	hdr = (struct ieee80211_hdr *)fa.data;
+	src = hdr->addr2;
+
+	sender = get_station_by_addr(ctx, fa.hwaddr);
+	if (!sender) {
+		sender = get_station_by_used_addr(ctx, src);
+		if (!sender) {
+			w_flogf(ctx, LOG_ERR, stderr,
+				"Unable to find sender station by src=" MAC_FMT " nor hwaddr=" MAC_FMT "\n",
+				MAC_ARGS(src), MAC_ARGS(fa.hwaddr));
+			return;
+		}
+		memcpy(sender->hwaddr, fa.hwaddr, ETH_ALEN);
+	}
+
+	if (sender->client && sender->client->zombie &&
+	    client->type == CLIENT_VHOST_USER)
+		wmediumd_vu_reconnected(ctx, sender->client, client);
+	if (!sender->client) {
+		sender->client = client;
+		wmediumd_notify_station(ctx, sender, WMEDIUMD_STA_EV_CLIENT);
+	}
+	if (sender->client == client)
+		sender->vq_pair = client->tx_vq_pair;
+
+	frame = calloc(1, sizeof(*frame) + fa.data_len);
+	if (!frame)
+		return;
+
+	memcpy(frame->data, fa.data, fa.data_len);
+	frame->data_len = fa.data_len;
+	frame->flags = fa.flags;
+	frame->cookie = fa.cookie;
+	frame->freq = fa.freq;
+	frame->sender = sender;
+	frame->tx_rates_count = min(fa.tx_rates_len, sizeof(frame->tx_rates)) /
+				sizeof(struct hwsim_tx_rate);
+	memcpy(frame->tx_rates, fa.tx_rates,
+	       frame->tx_rates_count * sizeof(struct hwsim_tx_rate));
+	queue_frame(ctx, sender, frame);
+}
+
+static void _process_messages(struct nlmsghdr *nlh,
+			      unsigned int msg_len,
 			      struct wmediumd *ctx,
 			      struct client *client)
 {
 	struct nlattr *attrs[HWSIM_ATTR_MAX+1];
-	/* netlink header */
-	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 	/* generic netlink header*/
 	struct genlmsghdr *gnlh = nlmsg_data(nlh);
 
 	struct station *sender;
-	struct frame *frame;
-	struct ieee80211_hdr *hdr;
-	u8 *src, *hwaddr, *addr;
+	u8 *hwaddr, *addr;
 	void *new;
 	unsigned int i;
+	u8 cmd;
 
-	genlmsg_parse(nlh, 0, attrs, HWSIM_ATTR_MAX, NULL);
-
-	switch (gnlh->cmd) {
-	case HWSIM_CMD_FRAME:
-		if (attrs[HWSIM_ATTR_ADDR_TRANSMITTER]) {
-			hwaddr = (u8 *)nla_data(attrs[HWSIM_ATTR_ADDR_TRANSMITTER]);
-
-			unsigned int data_len =
-				nla_len(attrs[HWSIM_ATTR_FRAME]);
-			char *data = (char *)nla_data(attrs[HWSIM_ATTR_FRAME]);
-			unsigned int flags =
-				nla_get_u32(attrs[HWSIM_ATTR_FLAGS]);
-			unsigned int tx_rates_len =
-				nla_len(attrs[HWSIM_ATTR_TX_INFO]);
-			struct hwsim_tx_rate *tx_rates =
-				(struct hwsim_tx_rate *)
-				nla_data(attrs[HWSIM_ATTR_TX_INFO]);
-			u64 cookie = nla_get_u64(attrs[HWSIM_ATTR_COOKIE]);
-			u32 freq;
-
-			freq = attrs[HWSIM_ATTR_FREQ] ?
-				nla_get_u32(attrs[HWSIM_ATTR_FREQ]) : 2412;
-
-			hdr = (struct ieee80211_hdr *)data;
-			src = hdr->addr2;
-
-			if (data_len < 6 + 6 + 4)
-				return;
-
-			sender = get_station_by_addr(ctx, hwaddr);
-			if (!sender) {
-				sender = get_station_by_used_addr(ctx, src);
-				if (!sender) {
-					w_flogf(ctx, LOG_ERR, stderr,
-						"Unable to find sender station by src=" MAC_FMT " nor hwaddr=" MAC_FMT "\n",
-						MAC_ARGS(src), MAC_ARGS(hwaddr));
-					return;
-				}
-				memcpy(sender->hwaddr, hwaddr, ETH_ALEN);
-			}
+	if (msg_len < NLMSG_HDRLEN + GENL_HDRLEN)
+		return;
 
-			if (!sender->client)
-				sender->client = client;
+	/* the hot path, everything else is rare */
+	cmd = gnlh->cmd;
+	if (cmd == HWSIM_CMD_FRAME) {
+		process_frame_message(ctx, client, nlh, msg_len);
+		return;
+	}
 
-			frame = calloc(1, sizeof(*frame) + data_len);
-			if (!frame)
-				return;
+	/*
+	 * Not genlmsg_parse(), that takes the length from the header
+	 * again, and the message may still be in guest memory.
+	 */
+	if (nla_parse(attrs, HWSIM_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		      msg_len - NLMSG_HDRLEN - GENL_HDRLEN, NULL))
+		return;
 
-			memcpy(frame->data, data, data_len);
-			frame->data_len = data_len;
-			frame->flags = flags;
-			frame->cookie = cookie;
-			frame->freq = freq;
-			frame->sender = sender;
-			frame->tx_rates_count =
-				tx_rates_len / sizeof(struct hwsim_tx_rate);
-			memcpy(frame->tx_rates, tx_rates,
-			       min(tx_rates_len, sizeof(frame->tx_rates)));
-			queue_frame(ctx, sender, frame);
-		}
-		break;
+	switch (cmd) {
 	case HWSIM_CMD_ADD_MAC_ADDR:
 		if (!attrs[HWSIM_ATTR_ADDR_TRANSMITTER] ||
 		    !attrs[HWSIM_ATTR_ADDR_RECEIVER])
@@ -1012,7 +1909,9 @@ static int process_messages_cb(struct nl_msg *msg, void *arg)
 {
 	struct wmediumd *ctx = arg;
 
-	_process_messages(msg, ctx, &ctx->nl_client);
+	ctx->nl_stats.rx_msgs++;
+	_process_messages(nlmsg_hdr(msg), nlmsg_hdr(msg)->nlmsg_len,
+			  ctx, &ctx->nl_client);
 	return 0;
 }
 
@@ -1025,6 +1924,7 @@ static void wmediumd_vu_connected(struct usfstl_vhost_user_dev *dev)
 	dev->data = client;
 	client->type = CLIENT_VHOST_USER;
 	client->dev = dev;
+	client->id = ctx->next_vu_client_id++;
 	list_add(&client->list, &ctx->clients);
 }
 
@@ -1032,29 +1932,89 @@ static void wmediumd_vu_handle(struct usfstl_vhost_user_dev *dev,
 			       struct usfstl_vhost_user_buf *buf,
 			       unsigned int vring)
 {
-	struct nl_msg *nlmsg;
-	char data[4096];
+	struct wmediumd *ctx = dev->server->data;
+	struct client *client;
+	struct nlmsghdr *nlh;
+	unsigned int msg_len;
 	size_t len;
 
-	len = iov_read(data, sizeof(data), buf->out_sg, buf->n_out_sg);
+	/*
+	 * Usually the whole message is in a single buffer, so parse it
+	 * right there in guest memory, only the frame itself is copied
+	 * (into struct frame). Otherwise linearize it first.
+	 */
+	if (buf->n_out_sg == 1) {
+		nlh = buf->out_sg[0].iov_base;
+		len = buf->out_sg[0].iov_len;
+	} else {
+		len = iov_len(buf->out_sg, buf->n_out_sg);
+		if (len > ctx->vu_tx_buf_size) {
+			void *tmp = realloc(ctx->vu_tx_buf, len);
+
+			if (!tmp)
+				return;
+			ctx->vu_tx_buf = tmp;
+			ctx->vu_tx_buf_size = len;
+		}
+		len = iov_read(ctx->vu_tx_buf, len,
+			       buf->out_sg, buf->n_out_sg);
+		nlh = ctx->vu_tx_buf;
+	}
 
-	if (!nlmsg_ok((const struct nlmsghdr *)data, len))
+	if (len < sizeof(*nlh))
 		return;
-	nlmsg = nlmsg_convert((struct nlmsghdr *)data);
-	if (!nlmsg)
+
+	/* read the length only once, the guest can still change it */
+	msg_len = nlh->nlmsg_len;
+	if (msg_len < sizeof(*nlh) || msg_len > len)
 		return;
 
-	_process_messages(nlmsg, dev->server->data, dev->data);
+	client = dev->data;
+	client->tx_vq_pair = vring / HWSIM_NUM_VQS;
+	_process_messages(nlh, msg_len, ctx, client);
+}
+
+static void wmediumd_vu_grace_expired(struct usfstl_job *job)
+{
+	struct client *client = container_of(job, struct client, grace_job);
 
-	nlmsg_free(nlmsg);
+	wmediumd_remove_client(job->data, client);
 }
 
 static void wmediumd_vu_disconnected(struct usfstl_vhost_user_dev *dev)
 {
+	struct wmediumd *ctx = dev->server->data;
 	struct client *client = dev->data;
+	struct station *station;
 
 	dev->data = NULL;
-	wmediumd_remove_client(dev->server->data, client);
+	client->dev = NULL;
+
+	list_for_each_entry(station, &ctx->stations, list) {
+		if (station->client == client)
+			break;
+	}
+
+	if (&station->list == &ctx->stations) {
+		wmediumd_remove_client(ctx, client);
+		return;
+	}
+
+	/*
+	 * A restarted VMM reconnects quickly (and resumes the rings from
+	 * the inflight area), so keep the stations bound and their frames
+	 * queued for a while; the new client takes them over as soon as
+	 * it transmits for one of them.
+	 */
+	client->zombie = true;
+	list_del_init(&client->list);
+
+	client->grace_job.start = scheduler.current_time +
+				  HWSIM_RECONNECT_GRACE;
+	client->grace_job.callback = wmediumd_vu_grace_expired;
+	client->grace_job.data = ctx;
+	client->grace_job.name = "vhost-user-grace";
+	usfstl_sched_add_job(&scheduler, &client->grace_job);
 }
 
 static int process_set_snr_message(struct wmediumd *ctx, struct wmediumd_set_snr *set_snr) {
@@ -1068,9 +2028,148 @@ static int process_set_snr_message(struct wmediumd *ctx, struct wmediumd_set_snr
 	ctx->snr_matrix[ctx->num_stas * node2->index + node1->index] = set_snr->snr;
 	ctx->snr_matrix[ctx->num_stas * node1->index + node2->index] = set_snr->snr;
 
+	wmediumd_notify_link_snr(ctx, node1);
+	wmediumd_notify_link_snr(ctx, node2);
+
 	return 0;
 }
 
+/*
+ * Update the SNRs after the given station (or, if NULL, many stations)
+ * moved or changed tx_power; only the path loss model depends on them.
+ */
+static void wmediumd_update_path_loss(struct wmediumd *ctx,
+				      struct station *station)
+{
+	if (!ctx->calc_path_loss)
+		return;
+
+	if (station)
+		recalc_station_path_loss(ctx, station);
+	else
+		recalc_path_loss(ctx);
+
+	wmediumd_notify_link_snr(ctx, station);
+}
+
+static int process_set_position_message(struct wmediumd *ctx,
+					const void *data, size_t data_len)
+{
+	const struct wmediumd_set_position *pos = data;
+	size_t i, n = data_len / sizeof(*pos);
+	/* for a large batch recalculating everything is cheaper */
+	bool full = 2 * n >= (size_t)ctx->num_stas;
+	struct station *station;
+	int ret = 0;
+
+	/* the position only matters to the path loss model */
+	if (!ctx->calc_path_loss)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		station = get_station_by_addr(ctx, (u8 *)pos[i].mac);
+		if (!station) {
+			ret = -1;
+			continue;
+		}
+
+		station->x = pos[i].x;
+		station->y = pos[i].y;
+		wmediumd_notify_station(ctx, station, WMEDIUMD_STA_EV_POSITION);
+
+		if (!full)
+			wmediumd_update_path_loss(ctx, station);
+	}
+
+	if (full)
+		wmediumd_update_path_loss(ctx, NULL);
+
+	return ret;
+}
+
+static int process_set_direction_message(struct wmediumd *ctx,
+					 const void *data, size_t data_len)
+{
+	const struct wmediumd_set_direction *dir = data;
+	size_t i, n = data_len / sizeof(*dir);
+	struct station *station;
+	int ret = 0;
+
+	/* stations are moved by recalculating the path loss */
+	if (!ctx->calc_path_loss)
+		return -1;
+
+	/* movement is scheduled relative to the current time */
+	if (ctx->ctrl)
+		usfstl_sched_ctrl_sync_from(ctx->ctrl);
+
+	for (i = 0; i < n; i++) {
+		station = get_station_by_addr(ctx, (u8 *)dir[i].mac);
+		if (!station) {
+			ret = -1;
+			continue;
+		}
+
+		station->dir_x = dir[i].dir_x;
+		station->dir_y = dir[i].dir_y;
+		wmediumd_notify_station(ctx, station,
+					WMEDIUMD_STA_EV_DIRECTION);
+
+		if (station->dir_x || station->dir_y)
+			start_moving_stations(ctx);
+	}
+
+	return ret;
+}
+
+static int process_set_tx_power_message(struct wmediumd *ctx,
+					const void *data, size_t data_len)
+{
+	const struct wmediumd_set_tx_power *power = data;
+	size_t i, n = data_len / sizeof(*power);
+	bool full = 2 * n >= (size_t)ctx->num_stas;
+	struct station *station;
+	int ret = 0;
+
+	/* so does tx_power, the SNRs are given otherwise */
+	if (!ctx->calc_path_loss)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		station = get_station_by_addr(ctx, (u8 *)power[i].mac);
+		if (!station) {
+			ret = -1;
+			continue;
+		}
+
+		station->tx_power = power[i].tx_power;
+		wmediumd_notify_station(ctx, station, WMEDIUMD_STA_EV_TX_POWER);
+
+		if (!full)
+			wmediumd_update_path_loss(ctx, station);
+	}
+
+	if (full)
+		wmediumd_update_path_loss(ctx, NULL);
+
+	return ret;
+}
+
+static void wmediumd_reload_config(struct wmediumd *ctx,
+				   const char *config_path)
+{
+	wmediumd_notify_all_stations(ctx, WMEDIUMD_STA_EV_REMOVED);
+
+	clear_config(ctx);
+	load_config(ctx, config_path, NULL);
+
+	wmediumd_notify_all_stations(ctx, WMEDIUMD_STA_EV_ADDED);
+
+	/* links refer to different stations now, report all again */
+	ctx->notified_snr_stas = 0;
+	wmediumd_notify_link_snr(ctx, NULL);
+}
+
 static int process_reload_config_message(struct wmediumd *ctx,
 					 struct wmediumd_reload_config *reload_config) {
 	char *config_path;
@@ -1079,8 +2178,7 @@ static int process_reload_config_message(struct wmediumd *ctx,
 	config_path = reload_config->config_path;
 
 	if (validate_config(config_path)) {
-		clear_config(ctx);
-		load_config(ctx, config_path, NULL);
+		wmediumd_reload_config(ctx, config_path);
 	} else {
 		result = -1;
 	}
@@ -1095,8 +2193,7 @@ static int process_reload_current_config_message(struct wmediumd *ctx) {
 	config_path = strdup(ctx->config_path);
 
 	if (validate_config(config_path)) {
-		clear_config(ctx);
-		load_config(ctx, config_path, NULL);
+		wmediumd_reload_config(ctx, config_path);
 	} else {
 		result = -1;
 	}
@@ -1142,6 +2239,306 @@ static int process_get_stations_message(struct wmediumd *ctx, ssize_t *response_
 	return 0;
 }
 
+static void fill_vhost_queue_stats(struct wmediumd *ctx,
+				   struct wmediumd_vhost_stats *entry,
+				   struct wmediumd_vhost_queue_stats *out,
+				   struct usfstl_vhost_user_dev *dev,
+				   unsigned int vring)
+{
+	struct usfstl_vhost_user_vq_stats stats;
+	unsigned int pair;
+
+	for (pair = 0; pair < ctx->vu_queue_pairs; pair++) {
+		usfstl_vhost_user_get_vq_stats(dev,
+					       pair * HWSIM_NUM_VQS + vring,
+					       &stats);
+
+		out->kicks += stats.kicks;
+		out->buffers += stats.avail;
+		out->used += stats.used;
+		out->calls += stats.calls;
+		out->calls_suppressed += stats.calls_suppressed;
+
+		if (vring != HWSIM_VQ_RX)
+			continue;
+
+		entry->rx_dropped += stats.dropped;
+		entry->rx_backlogged += stats.backlogged;
+		entry->rx_backlog += stats.backlog;
+		if (stats.backlog_max > entry->rx_backlog_max)
+			entry->rx_backlog_max = stats.backlog_max;
+	}
+}
+
+static int process_get_vhost_stats_message(struct wmediumd *ctx,
+					   ssize_t *response_len,
+					   unsigned char **response_data)
+{
+	struct wmediumd_vhost_stats_list *list;
+	struct wmediumd_vhost_stats *entry;
+	struct station *station;
+	struct client *client;
+	int count = 0;
+
+	list_for_each_entry(client, &ctx->clients, list) {
+		if (client->type == CLIENT_VHOST_USER)
+			count++;
+	}
+
+	*response_len = sizeof(*list) + sizeof(*entry) * count;
+	list = calloc(1, *response_len);
+	if (!list)
+		return -1;
+
+	list->count = count;
+	list->entry_size = sizeof(*entry);
+	entry = list->clients;
+
+	list_for_each_entry(client, &ctx->clients, list) {
+		if (client->type != CLIENT_VHOST_USER)
+			continue;
+
+		entry->client_id = client->id;
+		list_for_each_entry(station, &ctx->stations, list) {
+			if (station->client == client) {
+				memcpy(entry->hwaddr, station->hwaddr,
+				       ETH_ALEN);
+				break;
+			}
+		}
+
+		fill_vhost_queue_stats(ctx, entry, &entry->tx, client->dev,
+				       HWSIM_VQ_TX);
+		fill_vhost_queue_stats(ctx, entry, &entry->rx, client->dev,
+				       HWSIM_VQ_RX);
+		entry++;
+	}
+
+	*response_data = (unsigned char *)list;
+
+	return 0;
+}
+
+static int process_get_netlink_stats_message(struct wmediumd *ctx,
+					     ssize_t *response_len,
+					     unsigned char **response_data)
+{
+	struct wmediumd_netlink_stats *stats;
+	u32 meminfo[SK_MEMINFO_VARS] = {};
+	socklen_t len = sizeof(meminfo);
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	*response_len = sizeof(*stats);
+	*response_data = (unsigned char *)stats;
+
+	if (!ctx->sock)
+		return 0;
+
+	stats->rx_msgs = ctx->nl_stats.rx_msgs;
+	stats->rx_reads = ctx->nl_stats.reads;
+	stats->wakeups = ctx->nl_stats.wakeups;
+	stats->budget_exhausted = ctx->nl_stats.budget_exhausted;
+	stats->overruns = ctx->nl_stats.overruns;
+	stats->rx_errors = ctx->nl_stats.errors;
+	stats->max_batch = ctx->nl_stats.max_batch;
+	stats->rcvbuf = ctx->nl_rcvbuf;
+	stats->tx_msgs = ctx->nl_stats.tx_msgs;
+	stats->tx_syscalls = ctx->nl_stats.tx_syscalls;
+	stats->tx_errors = ctx->nl_stats.tx_errors;
+
+	/* older kernels have fewer fields */
+	if (!getsockopt(nl_socket_get_fd(ctx->sock), SOL_SOCKET, SO_MEMINFO,
+			meminfo, &len) &&
+	    len > SK_MEMINFO_DROPS * sizeof(u32))
+		stats->kernel_drops = meminfo[SK_MEMINFO_DROPS];
+
+	return 0;
+}
+
+static void
+copy_timetravel_op_stats(struct wmediumd_timetravel_op_stats *dst,
+			 const struct usfstl_sched_ctrl_op_stats *src)
+{
+	int i;
+
+	dst->count = src->count;
+	dst->total_ns = src->total_ns;
+	dst->max_ns = src->max_ns;
+	for (i = 0; i < WMEDIUMD_TIMETRAVEL_HIST_BUCKETS &&
+		    i < USFSTL_SCHED_CTRL_HIST_BUCKETS; i++)
+		dst->hist[i] = src->hist[i];
+}
+
+static int process_get_timetravel_stats_message(struct wmediumd *ctx,
+						ssize_t *response_len,
+						unsigned char **response_data)
+{
+	struct wmediumd_timetravel_stats *stats;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	*response_len = sizeof(*stats);
+	*response_data = (unsigned char *)stats;
+
+	if (!ctx->ctrl)
+		return 0;
+
+	stats->updates_elided = ctx->ctrl->stats.updates_elided;
+	stats->gets_elided = ctx->ctrl->stats.gets_elided;
+	copy_timetravel_op_stats(&stats->request, &ctx->ctrl->stats.request);
+	copy_timetravel_op_stats(&stats->wait, &ctx->ctrl->stats.wait);
+	copy_timetravel_op_stats(&stats->update, &ctx->ctrl->stats.update);
+	copy_timetravel_op_stats(&stats->get, &ctx->ctrl->stats.get);
+	stats->wait_ns = ctx->ctrl->stats.wait_ns;
+	stats->run_ns = ctx->ctrl->stats.run_ns;
+	stats->runs = ctx->ctrl->stats.runs;
+	stats->free_untils = ctx->ctrl->stats.free_untils;
+
+	return 0;
+}
+
+static void log_timetravel_op_stats(struct wmediumd *ctx, const char *name,
+				    const struct usfstl_sched_ctrl_op_stats *op)
+{
+	/* " >=" + 10 digits + ":" + 20 digits per bucket at most */
+	char hist[USFSTL_SCHED_CTRL_HIST_BUCKETS * 34 + 1] = "";
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < USFSTL_SCHED_CTRL_HIST_BUCKETS; i++) {
+		if (!op->hist[i])
+			continue;
+		if (len >= sizeof(hist))
+			break;
+		len += snprintf(hist + len, sizeof(hist) - len, " %s%u:%llu",
+				i == USFSTL_SCHED_CTRL_HIST_BUCKETS - 1 ?
+					">=" : "<",
+				1U << (i == USFSTL_SCHED_CTRL_HIST_BUCKETS - 1 ?
+					i - 1 : i),
+				(unsigned long long)op->hist[i]);
+	}
+
+	w_logf(ctx, LOG_NOTICE,
+	       "time-travel: %-7s %llu, avg %llu ns, max %llu ns, usec%s\n",
+	       name, (unsigned long long)op->count,
+	       (unsigned long long)(op->count ? op->total_ns / op->count : 0),
+	       (unsigned long long)op->max_ns, hist);
+}
+
+static void wmediumd_signal_handler(struct usfstl_loop_entry *entry)
+{
+	struct wmediumd *ctx = entry->data;
+	struct usfstl_sched_ctrl_stats *stats;
+	struct signalfd_siginfo info;
+
+	if (read(entry->fd, &info, sizeof(info)) != sizeof(info))
+		return;
+
+	if (!ctx->ctrl) {
+		w_logf(ctx, LOG_NOTICE, "time-travel: not in use\n");
+		return;
+	}
+
+	stats = &ctx->ctrl->stats;
+	w_logf(ctx, LOG_NOTICE,
+	       "time-travel: waited %llu ms, ran %llu ms, %llu RUN, %llu FREE_UNTIL\n",
+	       (unsigned long long)(stats->wait_ns / 1000000),
+	       (unsigned long long)(stats->run_ns / 1000000),
+	       (unsigned long long)stats->runs,
+	       (unsigned long long)stats->free_untils);
+	log_timetravel_op_stats(ctx, "REQUEST", &stats->request);
+	log_timetravel_op_stats(ctx, "WAIT", &stats->wait);
+	log_timetravel_op_stats(ctx, "UPDATE", &stats->update);
+	log_timetravel_op_stats(ctx, "GET", &stats->get);
+	w_logf(ctx, LOG_NOTICE,
+	       "time-travel: elided %llu UPDATE, %llu GET\n",
+	       (unsigned long long)stats->updates_elided,
+	       (unsigned long long)stats->gets_elided);
+}
+
+static int init_signal_handler(struct wmediumd *ctx)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL))
+		return -1;
+
+	fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ctx->signal_loop.fd = fd;
+	ctx->signal_loop.data = ctx;
+	ctx->signal_loop.handler = wmediumd_signal_handler;
+	usfstl_loop_register(&ctx->signal_loop);
+
+	return 0;
+}
+
+static int process_get_link_stats_message(struct wmediumd *ctx,
+					  const void *data, size_t data_len,
+					  ssize_t *response_len,
+					  unsigned char **response_data)
+{
+	struct wmediumd_get_link_stats get = {};
+	struct wmediumd_link_stats_list *list;
+	struct wmediumd_link_stats *entry;
+	struct link_stats *stats;
+	int i, j, count = 0;
+
+	/* copy what we get and understand, leave the rest zeroed */
+	memcpy(&get, data, min(sizeof(get), data_len));
+
+	for (i = 0; i < ctx->num_stas * ctx->num_stas; i++) {
+		if (ctx->link_stats[i].frames)
+			count++;
+	}
+
+	*response_len = sizeof(*list) + sizeof(*entry) * count;
+	list = malloc(*response_len);
+	if (!list)
+		return -1;
+
+	list->count = count;
+	entry = list->links;
+
+	for (i = 0; i < ctx->num_stas; i++) {
+		for (j = 0; j < ctx->num_stas; j++) {
+			stats = &ctx->link_stats[ctx->num_stas * i + j];
+			if (!stats->frames)
+				continue;
+
+			memcpy(entry->src, ctx->sta_array[i]->addr, ETH_ALEN);
+			memcpy(entry->dst, ctx->sta_array[j]->addr, ETH_ALEN);
+			entry->frames = stats->frames;
+			entry->bytes = stats->bytes;
+			entry->retries = stats->retries;
+			entry->acked = stats->acked;
+			entry->dropped_per = stats->dropped_per;
+			entry->dropped_cca = stats->dropped_cca;
+			entry++;
+		}
+	}
+
+	if (get.flags & WMEDIUMD_LINK_STATS_RESET) {
+		wmediumd_account_link_stats(ctx);
+		memset(ctx->link_stats, 0, sizeof(*ctx->link_stats) *
+		       ctx->num_stas * ctx->num_stas);
+	}
+
+	*response_data = (unsigned char *)list;
+
+	return 0;
+}
+
 static const struct usfstl_vhost_user_ops wmediumd_vu_ops = {
 	.connected = wmediumd_vu_connected,
 	.handle = wmediumd_vu_handle,
@@ -1161,36 +2558,19 @@ static void close_pcapng(struct wmediumd *ctx) {
 
 static void init_pcapng(struct wmediumd *ctx, const char *filename);
 
-static void wmediumd_api_handler(struct usfstl_loop_entry *entry)
+static int wmediumd_api_handle_message(struct wmediumd *ctx,
+				       struct client *client,
+				       struct wmediumd_message_header *hdr,
+				       unsigned char *data)
 {
-	struct client *client = container_of(entry, struct client, loop);
-	struct wmediumd *ctx = entry->data;
-	struct wmediumd_message_header hdr;
 	enum wmediumd_message response = WMEDIUMD_MSG_ACK;
 	struct wmediumd_message_control control = {};
-	struct nl_msg *nlmsg;
-	unsigned char *data;
 	ssize_t response_len = 0;
 	unsigned char *response_data = NULL;
-	ssize_t len;
-
-	len = read(entry->fd, &hdr, sizeof(hdr));
-	if (len != sizeof(hdr))
-		goto disconnect;
-
-	/* safety valve */
-	if (hdr.data_len > 1024 * 1024)
-		goto disconnect;
-
-	data = malloc(hdr.data_len);
-	if (!data)
-		goto disconnect;
-
-	len = read(entry->fd, data, hdr.data_len);
-	if (len != hdr.data_len)
-		goto disconnect;
+	u32 subscribed;
+	int ret;
 
-	switch (hdr.type) {
+	switch (hdr->type) {
 	case WMEDIUMD_MSG_REGISTER:
 		if (!list_empty(&client->list)) {
 			response = WMEDIUMD_MSG_INVALID;
@@ -1209,30 +2589,50 @@ static void wmediumd_api_handler(struct usfstl_loop_entry *entry)
 		if (ctx->ctrl)
 			usfstl_sched_ctrl_sync_from(ctx->ctrl);
 
-		if (!nlmsg_ok((const struct nlmsghdr *)data, len)) {
+		if (!nlmsg_ok((const struct nlmsghdr *)data, hdr->data_len)) {
 			response = WMEDIUMD_MSG_INVALID;
 			break;
 		}
 
-		nlmsg = nlmsg_convert((struct nlmsghdr *)data);
-		if (!nlmsg)
-			break;
-
-		_process_messages(nlmsg, ctx, client);
-
-		nlmsg_free(nlmsg);
+		_process_messages((struct nlmsghdr *)data,
+				  ((struct nlmsghdr *)data)->nlmsg_len,
+				  ctx, client);
 		break;
 	case WMEDIUMD_MSG_SET_CONTROL:
 		/* copy what we get and understand, leave the rest zeroed */
 		memcpy(&control, data,
-		       min(sizeof(control), hdr.data_len));
+		       min(sizeof(control), hdr->data_len));
 
 		if (client->flags & WMEDIUMD_CTL_NOTIFY_TX_START)
 			ctx->need_start_notify--;
 		if (control.flags & WMEDIUMD_CTL_NOTIFY_TX_START)
 			ctx->need_start_notify++;
-
+		if (client->flags & WMEDIUMD_CTL_NOTIFY_STATIONS)
+			ctx->need_station_notify--;
+		if (control.flags & WMEDIUMD_CTL_NOTIFY_STATIONS)
+			ctx->need_station_notify++;
+		if (client->flags & WMEDIUMD_CTL_NOTIFY_LINK_SNR)
+			ctx->need_link_notify--;
+		if (control.flags & WMEDIUMD_CTL_NOTIFY_LINK_SNR)
+			ctx->need_link_notify++;
+
+		subscribed = control.flags & ~client->flags;
 		client->flags = control.flags;
+		client->link_snr_threshold = control.link_snr_threshold;
+		wmediumd_update_link_snr_threshold(ctx);
+		client->tx_start_freq = control.tx_start_freq;
+		memcpy(client->tx_start_transmitter,
+		       control.tx_start_transmitter, ETH_ALEN);
+
+		/*
+		 * Give new subscribers (only) the full picture first, with
+		 * the next flush so it comes after the ACK to this.
+		 */
+		client->snapshot_pending |= subscribed &
+					    (WMEDIUMD_CTL_NOTIFY_STATIONS |
+					     WMEDIUMD_CTL_NOTIFY_LINK_SNR);
+		if (client->snapshot_pending)
+			wmediumd_schedule_station_events(ctx);
 		break;
 	case WMEDIUMD_MSG_GET_STATIONS:
 		if (process_get_stations_message(ctx, &response_len, &response_data) < 0) {
@@ -1240,11 +2640,60 @@ static void wmediumd_api_handler(struct usfstl_loop_entry *entry)
 		}
 		response = WMEDIUMD_MSG_STATIONS_LIST;
 		break;
+	case WMEDIUMD_MSG_GET_LINK_STATS:
+		if (process_get_link_stats_message(ctx, data, hdr->data_len,
+						   &response_len,
+						   &response_data) < 0) {
+			response = WMEDIUMD_MSG_INVALID;
+			response_len = 0;
+			break;
+		}
+		response = WMEDIUMD_MSG_LINK_STATS;
+		break;
+	case WMEDIUMD_MSG_GET_VHOST_STATS:
+		if (process_get_vhost_stats_message(ctx, &response_len,
+						    &response_data) < 0) {
+			response = WMEDIUMD_MSG_INVALID;
+			response_len = 0;
+			break;
+		}
+		response = WMEDIUMD_MSG_VHOST_STATS;
+		break;
+	case WMEDIUMD_MSG_GET_NETLINK_STATS:
+		if (process_get_netlink_stats_message(ctx, &response_len,
+						      &response_data) < 0) {
+			response = WMEDIUMD_MSG_INVALID;
+			response_len = 0;
+			break;
+		}
+		response = WMEDIUMD_MSG_NETLINK_STATS;
+		break;
+	case WMEDIUMD_MSG_GET_TIMETRAVEL_STATS:
+		if (process_get_timetravel_stats_message(ctx, &response_len,
+							 &response_data) < 0) {
+			response = WMEDIUMD_MSG_INVALID;
+			response_len = 0;
+			break;
+		}
+		response = WMEDIUMD_MSG_TIMETRAVEL_STATS;
+		break;
 	case WMEDIUMD_MSG_SET_SNR:
 		if (process_set_snr_message(ctx, (struct wmediumd_set_snr *)data) < 0) {
 			response = WMEDIUMD_MSG_INVALID;
                 }
 		break;
+	case WMEDIUMD_MSG_SET_POSITION:
+		if (process_set_position_message(ctx, data, hdr->data_len) < 0)
+			response = WMEDIUMD_MSG_INVALID;
+		break;
+	case WMEDIUMD_MSG_SET_DIRECTION:
+		if (process_set_direction_message(ctx, data, hdr->data_len) < 0)
+			response = WMEDIUMD_MSG_INVALID;
+		break;
+	case WMEDIUMD_MSG_SET_TX_POWER:
+		if (process_set_tx_power_message(ctx, data, hdr->data_len) < 0)
+			response = WMEDIUMD_MSG_INVALID;
+		break;
 	case WMEDIUMD_MSG_RELOAD_CONFIG:
 		if (process_reload_config_message(ctx,
 				(struct wmediumd_reload_config *)data) < 0) {
@@ -1263,41 +2712,153 @@ static void wmediumd_api_handler(struct usfstl_loop_entry *entry)
 		close_pcapng(ctx);
 		break;
 	case WMEDIUMD_MSG_ACK:
+		assert(hdr->data_len == 0);
+		/* ACKs come in order, so first for what we didn't wait for */
+		if (client->unacked_events) {
+			client->unacked_events--;
+			return 0;
+		}
 		assert(client->wait_for_ack == true);
-		assert(hdr.data_len == 0);
 		client->wait_for_ack = false;
 		/* don't send a response to a response, of course */
-		return;
+		return 0;
 	default:
 		response = WMEDIUMD_MSG_INVALID;
 		break;
 	}
 
 	/* return a response */
-	hdr.type = response;
-	hdr.data_len = response_len;
-	len = write(entry->fd, &hdr, sizeof(hdr));
-	if (len != sizeof(hdr))
-		goto disconnect;
+	ret = wmediumd_api_send(client, response, response_data,
+				response_data ? response_len : 0);
+	free(response_data);
 
-	if (response_data != NULL) {
-		if (response_len != 0) {
-			len = write(entry->fd, response_data, response_len);
+	return ret;
+}
 
-			if (len != response_len) {
-				free(response_data);
-				goto disconnect;
-			}
+/*
+ * Make sure there's room in the receive buffer for at least @need bytes
+ * starting at the first unprocessed message. While messages are being
+ * dispatched the buffer they live in must stay put, so in that case a
+ * larger buffer is allocated and the old one is released only once the
+ * dispatch of the current message has finished.
+ */
+static int wmediumd_api_rx_reserve(struct client *client, size_t need)
+{
+	size_t pending = client->rx_len - client->rx_start;
+	size_t size;
+	u8 *buf;
+
+	if (!client->rx_pinned && client->rx_start) {
+		memmove(client->rx_buf, client->rx_buf + client->rx_start,
+			pending);
+		client->rx_start = 0;
+		client->rx_len = pending;
+	}
+
+	if (client->rx_size - client->rx_start >= need &&
+	    client->rx_size > client->rx_len)
+		return 0;
+
+	size = client->rx_size ? client->rx_size : WMEDIUMD_API_RX_BUF_SIZE;
+	while (size < need || size <= pending)
+		size *= 2;
+
+	if (size > WMEDIUMD_API_RX_BUF_MAX)
+		return -1;
+
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	memcpy(buf, client->rx_buf + client->rx_start, pending);
+	if (client->rx_buf != client->rx_pinned)
+		free(client->rx_buf);
+
+	client->rx_buf = buf;
+	client->rx_size = size;
+	client->rx_start = 0;
+	client->rx_len = pending;
+
+	return 0;
+}
+
+static void wmediumd_api_dispatch(struct wmediumd *ctx, struct client *client)
+{
+	struct wmediumd_message_header hdr;
+	unsigned char *data;
+	int ret;
+
+	/*
+	 * Handling a message can run the loop (e.g. to sync time), so
+	 * we may get here again while still handling the previous one;
+	 * just leave new messages to the outer invocation, in order.
+	 */
+	if (client->rx_pinned)
+		return;
+
+	while (!client->disconnected &&
+	       client->rx_len - client->rx_start >= sizeof(hdr)) {
+		memcpy(&hdr, client->rx_buf + client->rx_start, sizeof(hdr));
+
+		/* safety valve */
+		if (hdr.data_len > WMEDIUMD_API_MAX_MSG_LEN) {
+			wmediumd_api_disconnect(ctx, client);
+			return;
 		}
 
-		free(response_data);
-		response_data = NULL;
+		if (client->rx_len - client->rx_start < sizeof(hdr) + hdr.data_len)
+			break;
+
+		data = client->rx_buf + client->rx_start + sizeof(hdr);
+		client->rx_start += sizeof(hdr) + hdr.data_len;
+
+		client->rx_pinned = client->rx_buf;
+		ret = wmediumd_api_handle_message(ctx, client, &hdr, data);
+		if (client->rx_pinned != client->rx_buf)
+			free(client->rx_pinned);
+		client->rx_pinned = NULL;
+
+		if (ret) {
+			wmediumd_api_disconnect(ctx, client);
+			return;
+		}
+	}
+
+	if (client->rx_start == client->rx_len)
+		client->rx_start = client->rx_len = 0;
+}
+
+static void wmediumd_api_handler(struct usfstl_loop_entry *entry)
+{
+	struct client *client = container_of(entry, struct client, loop);
+	struct wmediumd *ctx = entry->data;
+	struct wmediumd_message_header hdr;
+	size_t need = sizeof(hdr);
+	ssize_t len;
+
+	/* try to make room for all of a partially received message */
+	if (client->rx_len - client->rx_start >= sizeof(hdr)) {
+		memcpy(&hdr, client->rx_buf + client->rx_start, sizeof(hdr));
+		if (hdr.data_len <= WMEDIUMD_API_MAX_MSG_LEN)
+			need += hdr.data_len;
 	}
 
+	if (wmediumd_api_rx_reserve(client, need))
+		goto disconnect;
+
+	len = read(entry->fd, client->rx_buf + client->rx_len,
+		   client->rx_size - client->rx_len);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR))
+		return;
+	if (len <= 0)
+		goto disconnect;
+
+	client->rx_len += len;
+	wmediumd_api_dispatch(ctx, client);
 	return;
 disconnect:
-	usfstl_loop_unregister(&client->loop);
-	wmediumd_remove_client(ctx, client);
+	wmediumd_api_disconnect(ctx, client);
 }
 
 static void wmediumd_api_connected(int fd, void *data)
@@ -1310,6 +2871,7 @@ static void wmediumd_api_connected(int fd, void *data)
 	client->loop.fd = fd;
 	client->loop.data = ctx;
 	client->loop.handler = wmediumd_api_handler;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 	usfstl_loop_register(&client->loop);
 	INIT_LIST_HEAD(&client->list);
 }
@@ -1353,14 +2915,63 @@ out:
 static void sock_event_cb(struct usfstl_loop_entry *entry)
 {
 	struct wmediumd *ctx = entry->data;
+	unsigned int reads;
+	int ret;
+
+	ctx->nl_stats.wakeups++;
+
+	for (reads = 0; reads < HWSIM_NL_RX_BUDGET; reads++) {
+		ret = nl_recvmsgs_report(ctx->sock, ctx->cb);
+		if (ret == -NLE_AGAIN)
+			break;
+
+		if (ret == -NLE_NOMEM) {
+			/*
+			 * ENOBUFS: the socket overflowed and frames are
+			 * gone, the datagrams queued after that are fine
+			 */
+			ctx->nl_stats.overruns++;
+			w_logf(ctx, LOG_WARNING,
+			       "netlink receive overrun, frames lost\n");
+		} else if (ret < 0) {
+			ctx->nl_stats.errors++;
+			w_logf(ctx, LOG_ERR, "netlink receive failed: %s\n",
+			       nl_geterror(ret));
+			break;
+		}
+	}
+
+	if (reads == HWSIM_NL_RX_BUDGET)
+		ctx->nl_stats.budget_exhausted++;
+
+	ctx->nl_stats.reads += reads;
+	if (reads > ctx->nl_stats.max_batch)
+		ctx->nl_stats.max_batch = reads;
+}
+
+static void init_netlink_rcvbuf(struct wmediumd *ctx, int size)
+{
+	int fd = nl_socket_get_fd(ctx->sock);
+	socklen_t len = sizeof(ctx->nl_rcvbuf);
+
+	/* beyond net.core.rmem_max only with CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+		w_logf(ctx, LOG_WARNING,
+		       "Cannot set netlink receive buffer size: %s\n",
+		       strerror(errno));
+
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ctx->nl_rcvbuf, &len))
+		ctx->nl_rcvbuf = 0;
 
-	nl_recvmsgs_default(ctx->sock);
+	w_logf(ctx, LOG_NOTICE, "netlink receive buffer: %d bytes\n",
+	       ctx->nl_rcvbuf);
 }
 
 /*
  * Setup netlink socket and callbacks.
  */
-static int init_netlink(struct wmediumd *ctx)
+static int init_netlink(struct wmediumd *ctx, int rcvbuf)
 {
 	struct nl_sock *sock;
 	int ret;
@@ -1394,6 +3005,21 @@ static int init_netlink(struct wmediumd *ctx)
 	nl_cb_set(ctx->cb, NL_CB_MSG_IN, NL_CB_CUSTOM, process_messages_cb, ctx);
 	nl_cb_err(ctx->cb, NL_CB_CUSTOM, nl_err_cb, ctx);
 
+	init_netlink_rcvbuf(ctx, rcvbuf);
+
+	ctx->nl_batch = calloc(1, sizeof(*ctx->nl_batch));
+	if (!ctx->nl_batch) {
+		w_logf(ctx, LOG_ERR, "Error allocating netlink batch\n");
+		return -1;
+	}
+
+	/* drained until empty in sock_event_cb() */
+	ret = nl_socket_set_nonblocking(sock);
+	if (ret < 0) {
+		w_logf(ctx, LOG_ERR, "Error setting netlink socket nonblocking\n");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1421,6 +3047,18 @@ static void print_help(int exval)
 	printf("  -a socket       expose wmediumd API socket\n");
 	printf("  -n              force netlink use even with vhost-user\n");
 	printf("  -p FILE         log packets to pcapng file FILE\n");
+	printf("  -s FILE         publish telemetry in shared memory file FILE\n");
+	printf("                  (e.g. /dev/shm/wmediumd), see api.h\n");
+	printf("  -r MSEC         telemetry update interval (default 100)\n");
+	printf("  -q PAIRS        number of vhost-user TX/RX queue pairs\n");
+	printf("                  (default 1, max %d), stations get RX on\n",
+	       HWSIM_MAX_VQ_PAIRS);
+	printf("                  the pair they transmit on\n");
+	printf("  -b USEC         poll vhost-user queues instead of waiting\n");
+	printf("                  for kicks, sleeping at most USEC when idle\n");
+	printf("                  (uses a CPU, with -t guests still kick)\n");
+	printf("  -k BYTES        netlink receive buffer size (default %d)\n",
+	       HWSIM_NL_RCVBUF);
 
 	exit(exval);
 }
@@ -1479,6 +3117,18 @@ static void init_pcapng(struct wmediumd *ctx, const char *filename)
 #ifndef VIRTIO_F_VERSION_1
 #define VIRTIO_F_VERSION_1 32
 #endif
+#ifndef VIRTIO_RING_F_EVENT_IDX
+#define VIRTIO_RING_F_EVENT_IDX 29
+#endif
+#ifndef VIRTIO_RING_F_INDIRECT_DESC
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#endif
+#ifndef VIRTIO_F_RING_PACKED
+#define VIRTIO_F_RING_PACKED 34
+#endif
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER 35
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -1487,14 +3137,26 @@ int main(int argc, char *argv[])
 	char *config_file = NULL;
 	char *per_file = NULL;
 	const char *time_socket = NULL, *api_socket = NULL;
+	const char *telemetry_file = NULL;
+	unsigned long telemetry_interval = 100;
+	unsigned long vu_queue_pairs = 1;
+	int nl_rcvbuf = HWSIM_NL_RCVBUF;
+	unsigned int i;
 	struct usfstl_sched_ctrl ctrl = {};
 	struct usfstl_vhost_user_server vusrv = {
 		.ops = &wmediumd_vu_ops,
 		.max_queues = HWSIM_NUM_VQS,
 		.input_queues = 1 << HWSIM_VQ_TX,
-		.features = 1ULL << VIRTIO_F_VERSION_1,
+		.batch_notify = true,
+		.rx_backlog = HWSIM_RX_BACKLOG,
+		.features = 1ULL << VIRTIO_F_VERSION_1 |
+			    1ULL << VIRTIO_RING_F_EVENT_IDX |
+			    1ULL << VIRTIO_RING_F_INDIRECT_DESC |
+			    1ULL << VIRTIO_F_RING_PACKED |
+			    1ULL << VIRTIO_F_IN_ORDER,
 		.protocol_features =
-			1ULL << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS,
+			1ULL << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS |
+			1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD,
 		.data = &ctx,
 	};
 	bool use_netlink, force_netlink = false;
@@ -1510,7 +3172,7 @@ int main(int argc, char *argv[])
 	unsigned long int parse_log_lvl;
 	char* parse_end_token;
 
-	while ((opt = getopt(argc, argv, "hVc:l:x:t:u:a:np:")) != -1) {
+	while ((opt = getopt(argc, argv, "hVc:l:x:t:u:a:np:s:r:q:b:k:")) != -1) {
 		switch (opt) {
 		case 'h':
 			print_help(EXIT_SUCCESS);
@@ -1557,6 +3219,48 @@ int main(int argc, char *argv[])
 		case 'p':
 			init_pcapng(&ctx, optarg);
 			break;
+		case 's':
+			telemetry_file = optarg;
+			break;
+		case 'r':
+			telemetry_interval = strtoul(optarg, &parse_end_token, 10);
+			if (optarg == parse_end_token || *parse_end_token ||
+			    !telemetry_interval) {
+				printf("wmediumd: Error - Invalid telemetry interval: "
+				       "%s\n\n", optarg);
+				print_help(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			vu_queue_pairs = strtoul(optarg, &parse_end_token, 10);
+			if (optarg == parse_end_token || *parse_end_token ||
+			    !vu_queue_pairs ||
+			    vu_queue_pairs > HWSIM_MAX_VQ_PAIRS) {
+				printf("wmediumd: Error - Invalid number of queue pairs: "
+				       "%s\n\n", optarg);
+				print_help(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			vusrv.poll_max_idle_usec = strtoul(optarg,
+							   &parse_end_token,
+							   10);
+			if (optarg == parse_end_token || *parse_end_token) {
+				printf("wmediumd: Error - Invalid poll idle time: "
+				       "%s\n\n", optarg);
+				print_help(EXIT_FAILURE);
+			}
+			vusrv.poll = true;
+			break;
+		case 'k':
+			nl_rcvbuf = strtol(optarg, &parse_end_token, 10);
+			if (optarg == parse_end_token || *parse_end_token ||
+			    nl_rcvbuf <= 0) {
+				printf("wmediumd: Error - Invalid netlink buffer size: "
+				       "%s\n\n", optarg);
+				print_help(EXIT_FAILURE);
+			}
+			break;
 		case '?':
 			printf("wmediumd: Error - No such option: "
 			       "`%c'\n\n", optopt);
@@ -1583,10 +3287,18 @@ int main(int argc, char *argv[])
 	if (load_config(&ctx, config_file, per_file))
 		return EXIT_FAILURE;
 
+	ctx.vu_queue_pairs = vu_queue_pairs;
+	vusrv.max_queues = vu_queue_pairs * HWSIM_NUM_VQS;
+	vusrv.input_queues = 0;
+	for (i = 0; i < vu_queue_pairs; i++)
+		vusrv.input_queues |= 1ULL << (i * HWSIM_NUM_VQS + HWSIM_VQ_TX);
+	if (vu_queue_pairs > 1)
+		vusrv.protocol_features |= 1ULL << VHOST_USER_PROTOCOL_F_MQ;
+
 	use_netlink = force_netlink || !vusrv.socket;
 
 	/* init netlink */
-	if (use_netlink && init_netlink(&ctx) < 0)
+	if (use_netlink && init_netlink(&ctx, nl_rcvbuf) < 0)
 		return EXIT_FAILURE;
 
 	if (ctx.intf) {
@@ -1619,6 +3331,14 @@ int main(int argc, char *argv[])
 		usfstl_uds_create(api_socket, wmediumd_api_connected, &ctx);
 	}
 
+	if (telemetry_file &&
+	    wmediumd_telemetry_init(&ctx, telemetry_file, telemetry_interval))
+		return EXIT_FAILURE;
+
+	/* SIGUSR1 dumps the time-travel statistics */
+	if (init_signal_handler(&ctx))
+		w_logf(&ctx, LOG_ERR, "Failed to set up the signal handler\n");
+
 	if (time_socket) {
 		usfstl_sched_ctrl_start(&ctrl, time_socket,
 				      1000 /* nsec per usec */,
@@ -1648,10 +3368,12 @@ int main(int argc, char *argv[])
 						  struct client, list);
 
 			list_del(&client->list);
+			free(client->rx_buf);
 			free(client);
 		}
 	}
 
+	free(ctx.nl_batch);
 	free(ctx.sock);
 	free(ctx.cb);
 	free(ctx.intf);
@@ -119,6 +119,7 @@ enum {
 
 #include "list.h"
 #include "ieee80211.h"
+#include "api.h"
 
 typedef uint8_t u8;
 typedef uint32_t u32;
@@ -161,6 +162,9 @@ struct station {
 	struct client *client;
 	unsigned int n_addrs;
 	struct addr *addrs;
+	unsigned int event_slot;	/* 1 + index of pending event, or 0 */
+	bool snr_dirty;			/* links may have changed */
+	unsigned int vq_pair;		/* vhost-user queue pair it uses */
 };
 
 enum client_type {
@@ -169,6 +173,13 @@ enum client_type {
 	CLIENT_API_SOCK,
 };
 
+/* API socket receive buffer sizing */
+#define WMEDIUMD_API_MAX_MSG_LEN	(1024 * 1024)
+#define WMEDIUMD_API_RX_BUF_SIZE	4096
+#define WMEDIUMD_API_RX_BUF_MAX		(4 * 1024 * 1024)
+/* how long a client may keep its socket buffer full before it's dropped */
+#define WMEDIUMD_API_TX_TIMEOUT_MS	1000
+
 struct client {
 	struct list_head list;
 	enum client_type type;
@@ -180,19 +191,63 @@ struct client {
 
 	/* for vhost-user */
 	struct usfstl_vhost_user_dev *dev;
+	u32 id;
+	/* queue pair of the TX message being processed */
+	unsigned int tx_vq_pair;
+	/* disconnected, stations stay bound until grace_job runs */
+	bool zombie;
+	struct usfstl_job grace_job;
 
 	/* for API socket */
 	struct usfstl_loop_entry loop;
 	bool wait_for_ack;
+	bool disconnected;
+	unsigned int unacked_events;
+	/* WMEDIUMD_CTL_NOTIFY_* to send everything for with the next flush */
+	u32 snapshot_pending;
+	u32 link_snr_threshold;
+	/* filters for WMEDIUMD_MSG_TX_START, if non-zero */
+	u32 tx_start_freq;
+	u8 tx_start_transmitter[ETH_ALEN];
+	/* incoming messages, unprocessed data is [rx_start, rx_len) */
+	u8 *rx_buf, *rx_pinned;
+	size_t rx_start, rx_len, rx_size;
 
 	u32 flags;
 };
 
+struct link_stats {
+	u64 frames;
+	u64 bytes;
+	u64 retries;
+	u64 acked;
+	u64 dropped_per;
+	u64 dropped_cca;
+};
+
+/* see struct wmediumd_netlink_stats */
+struct netlink_stats {
+	u64 rx_msgs;
+	u64 reads;
+	u64 wakeups;
+	u64 budget_exhausted;
+	u64 overruns;
+	u64 errors;
+	u32 max_batch;
+	u64 tx_msgs;
+	u64 tx_syscalls;
+	u64 tx_errors;
+};
+
 struct wmediumd {
 	int timerfd;
 
 	struct nl_sock *sock;
 	struct usfstl_loop_entry nl_loop;
+	struct netlink_stats nl_stats;
+	int nl_rcvbuf;
+	/* messages to the kernel, sent together after each delivery */
+	struct nl_batch *nl_batch;
 
 	struct usfstl_sched_ctrl *ctrl;
 
@@ -202,9 +257,12 @@ struct wmediumd {
 	int num_stas;
 	struct list_head stations;
 	struct station **sta_array;
+	/* the stations sorted by address, see get_station_by_addr() */
+	struct station **sta_by_addr;
 	int *snr_matrix;
 	double *error_prob_matrix;
 	struct intf_info *intf;
+	struct link_stats *link_stats;
 	struct usfstl_job intf_job, move_job;
 #define MOVE_INTERVAL	(3) /* station movement interval [sec] */
 	void *path_loss_param;
@@ -228,6 +286,35 @@ struct wmediumd {
 
 	u32 need_start_notify;
 
+	u32 need_station_notify, need_link_notify;
+	struct usfstl_job station_notify_job;
+	struct wmediumd_station_event *sta_events;
+	unsigned int n_sta_events, max_sta_events;
+	struct wmediumd_link_event *link_events;
+	unsigned int max_link_events;
+	int link_snr_threshold;
+	bool snr_all_dirty;
+	int *notified_snr;
+	int notified_snr_stas;
+
+	u32 next_vu_client_id;
+	unsigned int vu_queue_pairs;
+
+	/* for vhost-user TX messages spread over multiple buffers */
+	void *vu_tx_buf;
+	size_t vu_tx_buf_size;
+
+	/* link statistics from before they were last reset or freed */
+	struct link_stats link_totals;
+
+	struct wmediumd_telemetry *telemetry;
+	size_t telemetry_size;
+	int telemetry_max_stas;
+	int telemetry_fd;
+	struct usfstl_loop_entry telemetry_loop;
+
+	struct usfstl_loop_entry signal_loop;
+
 	FILE *pcap_file;
 
 	char *config_path;
@@ -277,6 +364,13 @@ double get_error_prob_from_snr(double snr, unsigned int rate_idx, u32 freq,
 			       int frame_len);
 int set_default_per(struct wmediumd *ctx);
 int read_per_file(struct wmediumd *ctx, const char *file_name);
+void wmediumd_notify_station(struct wmediumd *ctx, struct station *station,
+			     u32 changed);
+void wmediumd_notify_link_snr(struct wmediumd *ctx, struct station *station);
+void wmediumd_account_link_stats(struct wmediumd *ctx);
+void wmediumd_telemetry_update(struct wmediumd *ctx);
+int wmediumd_telemetry_init(struct wmediumd *ctx, const char *path,
+			    unsigned int interval_ms);
 int w_logf(struct wmediumd *ctx, u8 level, const char *format, ...);
 int w_flogf(struct wmediumd *ctx, u8 level, FILE *stream, const char *format, ...);
 int index_to_rate(size_t index, u32 freq);